@@ -0,0 +1,137 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <cmath>
+#include <cstdint>
+using namespace std;
+
+/*
+事件循环和工作线程之间的准入控制，所有loop共用一个。
+- 有界：同时在排队的连接数不超过capacity。满了时要么让loop暂时不读这个连接（backpressure，稍后重试），要么立刻回503
+- CoDel：工作线程取到任务时用排队时间（从loop发现可读算起）判断。排队时间持续超过target一整个interval后进入丢弃状态，
+  按interval/sqrt(count)的间隔丢弃请求（回503），直到排队时间重新低于target。
+  短暂的突发不会触发丢弃，持续过载时丢弃频率逐渐加快，把排队延迟压回target附近
+排队时间低于target且不在丢弃状态是最常见的情况，只有几次relaxed读，不加锁。
+*/
+class AdmissionQueue
+{
+public:
+    struct Options
+    {
+        size_t capacity = 1024;      // 同时排队的连接数上限
+        int64_t target_us = 5000;    // 可以接受的排队时间
+        int64_t interval_us = 100000; // 排队时间持续超过target多久才开始丢弃，通常取几个往返时间
+        bool backpressure = true;    // 队列满时先不读连接；false时直接回503
+    };
+
+    enum ShedReason
+    {
+        QUEUE_FULL, // 队列满且没有开启backpressure
+        LATE,       // CoDel丢弃
+        SHED_REASONS
+    };
+
+    void setOptions(const Options &o)
+    {
+        options = o;
+    }
+
+    const Options &getOptions() const
+    {
+        return options;
+    }
+
+    // loop线程：占一个排队名额，队列满时返回false
+    bool tryEnter()
+    {
+        size_t depth = queued.fetch_add(1, memory_order_relaxed);
+        if (depth < options.capacity)
+            return true;
+        queued.fetch_sub(1, memory_order_relaxed);
+        return false;
+    }
+
+    // 工作线程：离开队列。sojourn_ns为排队时间，now_ns为单调时间。返回true表示这个请求应该被丢弃
+    bool leave(uint64_t sojourn_ns, uint64_t now_ns)
+    {
+        queued.fetch_sub(1, memory_order_relaxed);
+        bool below = sojourn_ns < uint64_t(options.target_us) * 1000;
+        if (below && !dropping.load(memory_order_relaxed) && first_above.load(memory_order_relaxed) == 0)
+            return false;
+
+        lock_guard<mutex> lock(state_mutex);
+        uint64_t interval = uint64_t(options.interval_us) * 1000;
+        bool ok_to_drop = false;
+        if (below)
+        {
+            first_above.store(0, memory_order_relaxed);
+        }
+        else if (first_above.load(memory_order_relaxed) == 0)
+        {
+            first_above.store(now_ns + interval, memory_order_relaxed);
+        }
+        else if (now_ns >= first_above.load(memory_order_relaxed))
+        {
+            ok_to_drop = true;
+        }
+
+        if (dropping.load(memory_order_relaxed))
+        {
+            if (!ok_to_drop)
+            {
+                dropping.store(false, memory_order_relaxed);
+                return false;
+            }
+            if (now_ns < drop_next)
+                return false;
+            count++;
+            drop_next = controlLaw(drop_next, count, interval);
+            return true;
+        }
+        if (!ok_to_drop)
+            return false;
+        dropping.store(true, memory_order_relaxed);
+        // 刚退出丢弃状态不久又进来，从上次的丢弃频率附近继续，而不是从头开始
+        uint32_t delta = count - last_count;
+        count = (delta > 1 && now_ns - drop_next < 16 * interval) ? delta : 1;
+        last_count = count;
+        drop_next = controlLaw(now_ns, count, interval);
+        return true;
+    }
+
+    size_t depth() const
+    {
+        return queued.load(memory_order_relaxed);
+    }
+
+    // 回了503的请求数，供/metrics输出
+    void countShed(ShedReason reason)
+    {
+        shed[reason].fetch_add(1, memory_order_relaxed);
+    }
+
+    uint64_t shedCount(ShedReason reason) const
+    {
+        return shed[reason].load(memory_order_relaxed);
+    }
+
+    bool inDropState() const
+    {
+        return dropping.load(memory_order_relaxed);
+    }
+
+private:
+    Options options;
+    atomic<size_t> queued{0};
+    atomic<uint64_t> shed[SHED_REASONS] = {};
+    atomic<bool> dropping{false};
+    atomic<uint64_t> first_above{0}; // 排队时间第一次超过target的时刻+interval，0表示当前低于target
+    mutex state_mutex;
+    uint64_t drop_next = 0;
+    uint32_t count = 0, last_count = 0;
+
+    static uint64_t controlLaw(uint64_t t, uint32_t count, uint64_t interval)
+    {
+        return t + uint64_t(double(interval) / sqrt(double(count)));
+    }
+};
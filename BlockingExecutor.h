@@ -0,0 +1,151 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <optional>
+#include <exception>
+#include <type_traits>
+#include "Task.h"
+#include "Metrics.h"
+using namespace std;
+
+/*
+阻塞操作（SQLite）专用的有界线程池，和处理请求的工作线程分开。
+协程co_await run(fn)时把fn交给这里的线程执行，自己挂起，不占着工作线程；fn返回后协程回到挂起时的Scheduler（连接所属的loop）继续。
+排队的任务数有上限，队列满时fn直接在当前线程执行（调用者执行），相当于退回同步调用，压力反馈给上游的准入控制。
+*/
+class BlockingExecutor
+{
+public:
+    BlockingExecutor(size_t threads, size_t capacity) : capacity(capacity)
+    {
+        for (size_t i = 0; i < threads; i++)
+            workers.emplace_back([this]
+                                 { this->work(); });
+    }
+
+    ~BlockingExecutor()
+    {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        not_empty.notify_all();
+        for (thread &worker : workers)
+            worker.join();
+    }
+
+    BlockingExecutor(const BlockingExecutor &) = delete;
+    BlockingExecutor &operator=(const BlockingExecutor &) = delete;
+
+    template <class F>
+    class RunAwaitable
+    {
+    public:
+        using Result = invoke_result_t<F &>;
+        static_assert(!is_void_v<Result>, "BlockingExecutor::run needs a function returning a value");
+
+        RunAwaitable(BlockingExecutor &executor, F fn) : executor(executor), fn(move(fn)) {}
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        // 返回false表示没有挂起（队列满，已经在当前线程执行完）
+        bool await_suspend(coroutine_handle<> handle)
+        {
+            Scheduler *scheduler = Scheduler::current();
+            // 被追踪的请求在执行器线程上的耗时（例如数据库）也记到它名下
+            Metrics::TraceHook *trace = Metrics::traceHook();
+            bool queued = executor.trySubmit([this, handle, scheduler, trace]
+                                             {
+                Metrics::setTraceHook(trace);
+                invoke();
+                Metrics::setTraceHook(nullptr);
+                // 恢复之后协程帧（包括这个对象）可能随时被销毁，之后不能再访问this
+                if (scheduler != nullptr)
+                    scheduler->schedule(handle);
+                else
+                    handle.resume(); });
+            if (queued)
+                return true;
+            invoke();
+            return false;
+        }
+
+        Result await_resume()
+        {
+            if (error)
+                rethrow_exception(error);
+            return move(*result);
+        }
+
+    private:
+        BlockingExecutor &executor;
+        F fn;
+        optional<Result> result;
+        exception_ptr error;
+
+        void invoke()
+        {
+            try
+            {
+                result.emplace(fn());
+            }
+            catch (...)
+            {
+                error = current_exception();
+            }
+        }
+    };
+
+    // co_await executor.run(fn)：在执行器线程上调用fn并取得它的返回值
+    template <class F>
+    RunAwaitable<F> run(F fn)
+    {
+        return RunAwaitable<F>(*this, move(fn));
+    }
+
+    // 队列满时返回false，任务没有被接受
+    bool trySubmit(function<void()> task)
+    {
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            if (queue.size() >= capacity)
+                return false;
+            queue.push_back(move(task));
+        }
+        not_empty.notify_one();
+        return true;
+    }
+
+private:
+    size_t capacity;
+    vector<thread> workers;
+    mutex queue_mutex;
+    condition_variable not_empty;
+    deque<function<void()>> queue;
+    bool stopping = false;
+
+    void work()
+    {
+        while (true)
+        {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(queue_mutex);
+                not_empty.wait(lock, [this]
+                               { return stopping || !queue.empty(); });
+                if (queue.empty())
+                    return;
+                task = move(queue.front());
+                queue.pop_front();
+            }
+            task();
+        }
+    }
+};
@@ -0,0 +1,219 @@
+#pragma once
+#include <sys/mman.h>
+#include <cstring>
+#include <string_view>
+#include <vector>
+#include <new>
+#include <algorithm>
+using namespace std;
+
+/*
+连接缓冲区的slab池：每次mmap一个slab，切成BLOCK_SIZE大小的块挂在空闲链表上，连接关闭后块回到链表给下一个连接用。
+池属于一个EventLoop，只在loop线程里取还（接受连接时取，释放连接时还），不需要加锁。
+slab不还给系统，占用的内存取决于连接数的峰值。
+*/
+class BufferPool
+{
+public:
+    static constexpr size_t BLOCK_SIZE = 4096;
+    static constexpr size_t BLOCKS_PER_SLAB = 64;
+
+    BufferPool() = default;
+
+    ~BufferPool()
+    {
+        for (char *slab : slabs)
+            munmap(slab, SLAB_SIZE);
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    char *acquire()
+    {
+        if (free_list == nullptr)
+            grow();
+        FreeBlock *block = free_list;
+        free_list = block->next;
+        in_use++;
+        return reinterpret_cast<char *>(block);
+    }
+
+    void release(char *block)
+    {
+        FreeBlock *node = reinterpret_cast<FreeBlock *>(block);
+        node->next = free_list;
+        free_list = node;
+        in_use--;
+    }
+
+    size_t blocksInUse() const
+    {
+        return in_use;
+    }
+
+    size_t blocksTotal() const
+    {
+        return slabs.size() * BLOCKS_PER_SLAB;
+    }
+
+private:
+    static constexpr size_t SLAB_SIZE = BLOCK_SIZE * BLOCKS_PER_SLAB;
+
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    FreeBlock *free_list = nullptr;
+    vector<char *> slabs;
+    size_t in_use = 0;
+
+    void grow()
+    {
+        void *slab = mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+            throw bad_alloc();
+        slabs.push_back(static_cast<char *>(slab));
+        for (size_t i = BLOCKS_PER_SLAB; i-- > 0;)
+        {
+            FreeBlock *node = reinterpret_cast<FreeBlock *>(static_cast<char *>(slab) + i * BLOCK_SIZE);
+            node->next = free_list;
+            free_list = node;
+        }
+    }
+};
+
+/*
+连接的输入缓冲区，[begin, end)是还没处理的字节。平时就用池里的一块，可以直接把套接字数据读进来；
+一个请求超过一块时换成堆上更大的缓冲区，数据处理完（缓冲区变空）后回到池里的块，大缓冲区不会一直占着。
+没有attach过的Buffer第一次写入时直接用堆。
+*/
+class Buffer
+{
+public:
+    Buffer() = default;
+
+    ~Buffer()
+    {
+        detach();
+    }
+
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+
+    // 从池里取一块作为存储（loop线程）
+    void attach(BufferPool *p)
+    {
+        detach();
+        pool = p;
+        block = pool->acquire();
+        buf = block;
+        cap = BufferPool::BLOCK_SIZE;
+    }
+
+    // 块还给池，释放堆上的缓冲区（loop线程）
+    void detach()
+    {
+        freeHeap();
+        if (block != nullptr)
+            pool->release(block);
+        pool = nullptr;
+        block = buf = nullptr;
+        cap = begin = end = 0;
+    }
+
+    const char *data() const
+    {
+        return buf + begin;
+    }
+
+    size_t size() const
+    {
+        return end - begin;
+    }
+
+    bool empty() const
+    {
+        return begin == end;
+    }
+
+    string_view view() const
+    {
+        return string_view(data(), size());
+    }
+
+    // 保证末尾至少有n字节可写，返回写入位置，写完用commit确认实际写了多少
+    char *prepare(size_t n)
+    {
+        if (cap - end < n)
+            makeRoom(n);
+        return buf + end;
+    }
+
+    size_t writable() const
+    {
+        return cap - end;
+    }
+
+    void commit(size_t n)
+    {
+        end += n;
+    }
+
+    void append(const char *p, size_t n)
+    {
+        memcpy(prepare(n), p, n);
+        commit(n);
+    }
+
+    // 丢掉开头已经处理完的n字节
+    void consume(size_t n)
+    {
+        begin += n;
+        if (begin < end)
+            return;
+        begin = end = 0;
+        if (buf != block)
+        {
+            freeHeap();
+            cap = block != nullptr ? BufferPool::BLOCK_SIZE : 0;
+        }
+    }
+
+private:
+    BufferPool *pool = nullptr;
+    char *block = nullptr; // 池里的块，attach之后一直持有
+    char *buf = nullptr;   // 当前存储：block或者堆上的缓冲区
+    size_t cap = 0;
+    size_t begin = 0, end = 0;
+
+    void makeRoom(size_t n)
+    {
+        size_t used = size();
+        // 前面已经处理掉的空间够用时只把剩下的字节挪到开头
+        if (used + n <= cap)
+        {
+            memmove(buf, buf + begin, used);
+            begin = 0;
+            end = used;
+            return;
+        }
+        size_t new_cap = max(max(cap * 2, used + n), BufferPool::BLOCK_SIZE);
+        char *bigger = new char[new_cap];
+        if (used > 0)
+            memcpy(bigger, buf + begin, used);
+        freeHeap();
+        buf = bigger;
+        cap = new_cap;
+        begin = 0;
+        end = used;
+    }
+
+    void freeHeap()
+    {
+        if (buf != block)
+            delete[] buf;
+        buf = block;
+    }
+};
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstddef>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// 返回[p, end)中第一个等于a或b的字符位置，找不到返回end。SSE2下每次比较16字节
+inline const char *findChar2(const char *p, const char *end, char a, char b)
+{
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++)
+    {
+        if (*p == a || *p == b)
+            return p;
+    }
+    return end;
+}
+
+// 返回[p, end)中第一个控制字符（小于0x20）的位置，找不到返回end
+inline const char *findControlChar(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i limit = _mm_set1_epi8(0x1F);
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        // 无符号比较：max(c, 0x1F) == 0x1F 即 c <= 0x1F
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(chunk, limit), limit));
+        if (mask != 0)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    for (; p < end; p++)
+    {
+        if (static_cast<unsigned char>(*p) < 0x20)
+            return p;
+    }
+    return end;
+}
@@ -0,0 +1,347 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <climits>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include "HttpRequest.h"
+#include "HttpBody.h"
+#include "Task.h"
+#include "Trace.h"
+#include "StaticFile.h"
+#include "TimerWheel.h"
+#include "BufferPool.h"
+#include "RequestArena.h"
+using namespace std;
+
+class EventLoop;
+
+/*
+待发送的数据：内存里的字节（响应头和短的响应体）都分配在队列自己的arena里，流水线上相邻的响应在内存中连续，合并成一段；
+长的响应体不拷贝，单独一段指向原处（arena里或者由段持有的缓存响应），和响应头一起writev；
+静态文件的段：小文件指向mmap区域，和其他段一起writev；大文件用sendfile从fd直接发送。
+没发完的部分留在队列里，等可写时继续。队列排空时arena整体释放，同一个连接上处理下一批请求时从头复用。
+*/
+struct OutputQueue
+{
+    struct Segment
+    {
+        string_view data; // 非文件段：arena里的字节，或者owner里的字节
+        shared_ptr<const void> owner; // 非空时data指向它拥有的内存（例如缓存的PreparedResponse），发完前保持它存活
+        shared_ptr<const StaticFile> file; // 非空时这一段是文件的[file_offset, file_offset+file_length)
+        size_t file_offset = 0;
+        size_t file_length = 0;
+
+        size_t size() const
+        {
+            return file ? file_length : data.size();
+        }
+
+        bool useSendfile() const
+        {
+            return file && file->map == nullptr;
+        }
+    };
+
+    vector<Segment> segments;
+    size_t used = 0;   // segments中有效的段数
+    size_t first = 0;  // 第一个未发完的段
+    size_t offset = 0; // 该段已经发出的字节数
+    RequestArena arena; // 处理请求期间也是HttpResponse等的分配区，见HttpServer::handleConnection
+
+    bool empty() const
+    {
+        return first == used;
+    }
+
+    // 还没发出的字节数
+    size_t pending() const
+    {
+        size_t bytes = 0;
+        for (size_t i = first; i < used; i++)
+            bytes += segments[i].size();
+        return bytes - offset;
+    }
+
+    // 在队列末尾追加n字节，返回由调用者填写的位置。和上一段在内存中相邻时直接延长上一段
+    char *append(size_t n)
+    {
+        char *p = static_cast<char *>(arena.get()->allocate(n, 1));
+        if (used > first && !segments[used - 1].file && !segments[used - 1].owner)
+        {
+            string_view &last = segments[used - 1].data;
+            if (last.data() + last.size() == p)
+            {
+                last = string_view(last.data(), last.size() + n);
+                return p;
+            }
+        }
+        next().data = string_view(p, n);
+        return p;
+    }
+
+    // 追加一段不拷贝的字节。owner为空时data必须在arena里（队列排空前一直有效），否则由这一段持有owner直到发完
+    void pushView(string_view data, shared_ptr<const void> owner)
+    {
+        if (data.empty())
+            return;
+        Segment &segment = next();
+        segment.data = data;
+        segment.owner = move(owner);
+    }
+
+    void pushFile(const shared_ptr<const StaticFile> &file, size_t file_offset, size_t length)
+    {
+        if (length == 0)
+            return;
+        Segment &segment = next();
+        segment.file = file;
+        segment.file_offset = file_offset;
+        segment.file_length = length;
+    }
+
+    // 尽量发送，直到发完或者套接字缓冲区满(EAGAIN)。返回false表示连接出错
+    bool flush(int fd)
+    {
+        while (!empty())
+        {
+            ssize_t n;
+            if (segments[first].useSendfile())
+            {
+                const Segment &segment = segments[first];
+                off_t file_pos = segment.file_offset + offset;
+                n = sendfile(fd, segment.file->fd, &file_pos, segment.file_length - offset);
+            }
+            else
+            {
+                struct iovec iov[64];
+                // sendmsg等同于writev，但可以带MSG_NOSIGNAL，对端关闭时返回EPIPE而不是触发SIGPIPE
+                struct msghdr msg = {};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = fillIov(iov, 64);
+                n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            }
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            if (n == 0)
+                return false; // 文件被截断，sendfile读不到数据
+            consume(n);
+        }
+        reset();
+        return true;
+    }
+
+    // 从第一个未发完的段开始，把连续的非sendfile段填进iov，返回填了几个
+    int fillIov(struct iovec *iov, int max) const
+    {
+        int count = 0;
+        for (size_t i = first; i < used && count < max && !segments[i].useSendfile(); i++)
+        {
+            size_t skip = (i == first) ? offset : 0;
+            const Segment &segment = segments[i];
+            const char *base = segment.file ? segment.file->map + segment.file_offset : segment.data.data();
+            iov[count].iov_base = const_cast<char *>(base) + skip;
+            iov[count].iov_len = segment.size() - skip;
+            count++;
+        }
+        return count;
+    }
+
+    // fillIov填的count段是否就是剩下的全部
+    bool coversAll(int count) const
+    {
+        return first + count == used;
+    }
+
+    // 已经发出sent字节，前移发送位置
+    void consume(size_t sent)
+    {
+        while (sent > 0)
+        {
+            size_t left = segments[first].size() - offset;
+            if (sent < left)
+            {
+                offset += sent;
+                break;
+            }
+            sent -= left;
+            segments[first].file.reset();
+            segments[first].owner.reset();
+            first++;
+            offset = 0;
+        }
+    }
+
+    // 全部发完：释放文件引用，arena里的一切一起释放
+    void reset()
+    {
+        for (size_t i = 0; i < used; i++)
+        {
+            segments[i].file.reset();
+            segments[i].owner.reset();
+        }
+        used = first = offset = 0;
+        arena.release();
+    }
+
+private:
+    Segment &next()
+    {
+        if (used == segments.size())
+            segments.emplace_back();
+        Segment &segment = segments[used++];
+        segment.data = {};
+        segment.owner.reset();
+        segment.file.reset();
+        return segment;
+    }
+};
+
+// 各阶段的超时（毫秒）
+struct Timeouts
+{
+    int64_t idle_ms = 60000;   // 两个请求之间（以及连接建立后）没有任何数据
+    int64_t header_ms = 10000; // 从请求第一个字节到请求头收全
+    int64_t body_ms = 30000;   // 从请求头收全到请求体收全
+    int64_t write_ms = 30000;  // 响应发送没有任何进展
+};
+
+enum TimeoutKind
+{
+    IDLE_TIMEOUT,
+    HEADER_TIMEOUT,
+    BODY_TIMEOUT,
+    WRITE_TIMEOUT
+};
+
+// 一个客户端连接的状态。事件是一次性的（epoll的EPOLLONESHOT，io_uring的单次recv），同一时刻只有一个工作线程持有它
+struct Connection
+{
+    Connection(int fd, EventLoop *loop) : fd(fd), loop(loop)
+    {
+        timer.data = this;
+    };
+
+    int fd;
+    EventLoop *loop; // 接受这个连接的loop，连接始终留在这里
+    uint32_t peer_ip = 0; // 客户端的IPv4地址（网络字节序），0表示还没取到
+    Buffer input;    // 尚未处理的请求字节，跨多次epoll唤醒保留，用于拼接被拆开的请求和流水线请求
+    HttpRequest request; // 正在解析的请求，数据不完整时保留解析进度
+    OutputQueue output;  // 还没发送完的响应
+
+    // 输入缓冲区和发送队列的arena各用池里的一块，连接释放时随析构还回去（都在loop线程）
+    void attachBuffers(BufferPool *pool)
+    {
+        input.attach(pool);
+        output.arena.attach(pool);
+    }
+    bool close_after_write = false; // 发送队列排空后关闭连接（分块响应产生完之后）
+    uint64_t ready_at = 0; // loop发现连接可读的时间（Metrics::now()），排队时间从这里算，包括被暂停的时间
+
+    /*
+    超时：定时节点只由所属loop的线程操作。工作线程只写deadline（0表示正在被工作线程处理），
+    loop在节点到期时读deadline，没到就按新的deadline重新挂上去，所以重设超时不需要通知loop。
+    */
+    TimerNode timer;
+    atomic<int64_t> deadline{0};
+    atomic<int> timeout_kind{IDLE_TIMEOUT};
+    int64_t request_start_ms = 0; // 当前请求第一个字节到达的时间，0表示还没开始
+    int64_t body_start_ms = 0;    // 当前请求头收全的时间
+
+    /*
+    逐段读取的请求体：chunked请求体，或者流式路由上请求头到达时还没到齐的请求体。
+    这期间输入缓冲区随解码被消耗，request改为指向head里的请求头副本。
+    有body_handler时解码出的数据直接交给它；否则攒在body里，收完后按普通路由处理
+    */
+    bool reading_body = false;
+    BodyDecoder body_decoder;
+    unique_ptr<BodyHandler> body_handler;
+    int body_route = 0;
+    string head;
+    string body;
+
+    // 还没产生完的分块响应体，发送队列排空后回到工作线程继续产生；stream_framed为false时不加chunk的长度行（HTTP/1.0）
+    shared_ptr<ChunkedBody> stream;
+    bool stream_framed = true;
+
+    /*
+    挂起的异步处理函数。启动它的工作线程和完成它的线程用async_state交接连接：
+    双方各自把状态换成自己的，后到的一方接着处理连接（见HttpServer::runTask）
+    */
+    Task<HttpResponse> task;
+    atomic<int> async_state{0};
+    int async_route = 0;     // 指标编号
+    uint64_t async_start = 0; // 开始处理的时间（Metrics::now()）
+    size_t async_bytes = 0;   // 这个请求及之前已经处理完的输入字节数，完成后才丢掉，挂起期间request指向这里
+    bool async_close = false; // 挂起前已经读到对端关闭
+
+    TraceContext trace; // 抽样追踪中的请求，见HttpServer::handleConnection
+
+    // 客户端地址。epoll接受连接时已经拿到；io_uring的multishot accept不返回地址，第一次用到时getpeername
+    uint32_t peerAddress()
+    {
+        if (peer_ip == 0)
+        {
+            struct sockaddr_in address = {};
+            socklen_t len = sizeof(address);
+            if (getpeername(fd, (struct sockaddr *)&address, &len) == 0 && address.sin_family == AF_INET)
+                peer_ip = address.sin_addr.s_addr;
+        }
+        return peer_ip;
+    }
+
+    // 正在发送或者生成一个响应，这时不能插入别的响应（例如503）
+    bool midResponse() const
+    {
+        return !output.empty() || stream != nullptr || bool(task);
+    }
+
+    void setDeadline(TimeoutKind kind, int64_t when_ms)
+    {
+        timeout_kind.store(kind, memory_order_relaxed);
+        deadline.store(when_ms, memory_order_release);
+    }
+
+    // 等待请求数据时的超时：没有请求数据时是空闲超时；请求头没收全从第一个字节起算头部超时；请求体没收全从头部收全起算请求体超时
+    void setReadDeadline(const Timeouts &timeouts)
+    {
+        int64_t now = TimerWheel::nowMs();
+        if (input.empty() && request.getState() == HttpRequest::REQUEST_LINE)
+        {
+            setDeadline(IDLE_TIMEOUT, now + timeouts.idle_ms);
+            return;
+        }
+        if (request_start_ms == 0)
+            request_start_ms = now;
+        if (request.getState() == HttpRequest::BODY)
+        {
+            if (body_start_ms == 0)
+                body_start_ms = now;
+            setDeadline(BODY_TIMEOUT, body_start_ms + timeouts.body_ms);
+            return;
+        }
+        setDeadline(HEADER_TIMEOUT, request_start_ms + timeouts.header_ms);
+    }
+
+    /*
+    I/O后端的状态，只在loop线程里读写（io_result在分发给工作线程之前写好）。
+    epoll后端不用这些字段；io_uring后端用它们记录进行中的操作数、收到数据的结果和正在提交的sendmsg参数。
+    */
+    static const int IO_IOV_MAX = 16;
+    int io_pending = 0;
+    bool io_closing = false;
+    bool io_linked = false; // 正在进行的发送后面链接了recv
+    int io_result = 0;
+    struct msghdr io_msg = {};
+    struct iovec io_iov[IO_IOV_MAX];
+};
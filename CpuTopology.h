@@ -0,0 +1,232 @@
+#pragma once
+#include <sched.h>        // sched_getaffinity, sched_getcpu
+#include <pthread.h>      // pthread_setaffinity_np
+#include <sys/socket.h>   // setsockopt
+#include <linux/filter.h> // 经典BPF：sock_filter, SKF_AD_CPU
+#include <dirent.h>       // 遍历/sys/devices/system/node
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+using namespace std;
+
+// 按CPU拓扑放置线程的选项，见HttpServer::setCpuPlacement
+struct CpuPlacement
+{
+    bool pin = false;          // 关闭时线程不绑定CPU，loop数量取构造参数，工作线程固定16个
+    int workers_per_cpu = 2;   // 每个可用CPU上的工作线程数
+    bool steer_accepts = true; // 新连接交给收到它的那个CPU上的loop（SO_ATTACH_REUSEPORT_CBPF）
+};
+
+/*
+进程可以使用的CPU和它们所在的NUMA节点，用来决定loop和工作线程的数量和绑定位置。
+- 可用的CPU取自进程的亲和性掩码，cgroup cpuset的限制已经包含在里面；cgroup的CPU配额（cpu.max或cfs_quota）再限制个数
+- 节点从/sys/devices/system/node读取，读不到时都算节点0
+线程绑定以后再分配自己的内存（连接缓冲区、io_uring的环、指标和日志的线程数据），按Linux默认的first-touch策略页就落在本地节点上
+*/
+class CpuTopology
+{
+public:
+    struct Cpu
+    {
+        int id;
+        int node;
+    };
+
+    static CpuTopology detect()
+    {
+        CpuTopology topology;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            for (int i = 0; i < CPU_SETSIZE; i++)
+            {
+                if (CPU_ISSET(i, &set))
+                    topology.cpus.push_back({i, 0});
+            }
+        }
+        if (topology.cpus.empty())
+        {
+            int n = max(1, int(thread::hardware_concurrency()));
+            for (int i = 0; i < n; i++)
+                topology.cpus.push_back({i, 0});
+        }
+        topology.readNodes();
+        // 配额比可用的CPU少时只用一部分，多出来的线程只会被限流
+        int quota = cgroupCpuQuota();
+        if (quota > 0 && size_t(quota) < topology.cpus.size())
+            topology.cpus.resize(quota);
+        return topology;
+    }
+
+    size_t size() const
+    {
+        return cpus.size();
+    }
+
+    const Cpu &operator[](size_t i) const
+    {
+        return cpus[i];
+    }
+
+    int nodes() const
+    {
+        int count = 0;
+        for (const Cpu &cpu : cpus)
+            count = max(count, cpu.node + 1);
+        return count;
+    }
+
+    // 把调用它的线程绑定到一个CPU上
+    static bool pinCurrentThread(int cpu)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    /*
+    给一组SO_REUSEPORT监听套接字挂一个经典BPF程序：新连接交给组里第loop_of_cpu[收到它的CPU]个套接字（按listen的顺序），
+    不在表里的CPU返回超出范围的编号，内核退回按四元组哈希选择。挂在组里任意一个已经listen的套接字上即可
+    */
+    static bool steerAcceptsByCpu(int fd, const vector<int> &loop_of_cpu)
+    {
+        vector<sock_filter> code;
+        code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, uint32_t(SKF_AD_OFF + SKF_AD_CPU)));
+        for (size_t cpu = 0; cpu < loop_of_cpu.size() && code.size() + 3 <= BPF_MAXINSNS; cpu++)
+        {
+            if (loop_of_cpu[cpu] < 0)
+                continue;
+            code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, uint32_t(cpu), 0, 1));
+            code.push_back(BPF_STMT(BPF_RET | BPF_K, uint32_t(loop_of_cpu[cpu])));
+        }
+        code.push_back(BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFFu));
+        sock_fprog program = {static_cast<unsigned short>(code.size()), code.data()};
+        return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+    }
+
+    // 内核处理这个套接字上的数据包的CPU，没有记录时返回-1
+    static int incomingCpu(int fd)
+    {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0)
+            return -1;
+        return cpu;
+    }
+
+    // "0-3,8,10-11"这样的CPU列表
+    static vector<int> parseCpuList(const char *list)
+    {
+        vector<int> result;
+        const char *p = list;
+        while (*p != '\0' && *p != '\n')
+        {
+            char *end;
+            long first = strtol(p, &end, 10);
+            if (end == p)
+                break;
+            long last = first;
+            if (*end == '-')
+            {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+            }
+            for (long i = first; i <= last; i++)
+                result.push_back(int(i));
+            p = *end == ',' ? end + 1 : end;
+        }
+        return result;
+    }
+
+private:
+    vector<Cpu> cpus;
+
+    void readNodes()
+    {
+        DIR *dir = opendir("/sys/devices/system/node");
+        if (dir == nullptr)
+            return;
+        while (dirent *entry = readdir(dir))
+        {
+            int node;
+            if (sscanf(entry->d_name, "node%d", &node) != 1)
+                continue;
+            string path = string("/sys/devices/system/node/") + entry->d_name + "/cpulist";
+            char list[4096];
+            if (!readLine(path, list, sizeof(list)))
+                continue;
+            for (int id : parseCpuList(list))
+            {
+                for (Cpu &cpu : cpus)
+                {
+                    if (cpu.id == id)
+                        cpu.node = node;
+                }
+            }
+        }
+        closedir(dir);
+    }
+
+    // cgroup限制的CPU个数（向上取整），没有限制时返回0。先看cgroup v2的cpu.max，再看v1的cfs_quota_us
+    static int cgroupCpuQuota()
+    {
+        char line[256];
+        long long quota = 0, period = 0;
+        string v2 = "/sys/fs/cgroup" + cgroupPath() + "/cpu.max";
+        if (readLine(v2, line, sizeof(line)) || readLine("/sys/fs/cgroup/cpu.max", line, sizeof(line)))
+        {
+            if (sscanf(line, "%lld %lld", &quota, &period) != 2)
+                return 0;
+        }
+        else
+        {
+            if (!readLine("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", line, sizeof(line)))
+                return 0;
+            quota = atoll(line);
+            if (!readLine("/sys/fs/cgroup/cpu/cpu.cfs_period_us", line, sizeof(line)))
+                return 0;
+            period = atoll(line);
+        }
+        if (quota <= 0 || period <= 0)
+            return 0; // "max"或-1：不限制
+        return int((quota + period - 1) / period);
+    }
+
+    // 进程所在的cgroup v2路径（/proc/self/cgroup里"0::"开头的一行）
+    static string cgroupPath()
+    {
+        FILE *f = fopen("/proc/self/cgroup", "r");
+        if (f == nullptr)
+            return "";
+        char line[512];
+        string path;
+        while (fgets(line, sizeof(line), f) != nullptr)
+        {
+            if (strncmp(line, "0::", 3) == 0)
+            {
+                path = line + 3;
+                while (!path.empty() && (path.back() == '\n' || path.back() == '/'))
+                    path.pop_back();
+                break;
+            }
+        }
+        fclose(f);
+        return path;
+    }
+
+    static bool readLine(const string &path, char *line, size_t size)
+    {
+        FILE *f = fopen(path.c_str(), "r");
+        if (f == nullptr)
+            return false;
+        bool ok = fgets(line, int(size), f) != nullptr;
+        fclose(f);
+        return ok;
+    }
+};
@@ -0,0 +1,152 @@
+#pragma once
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+using namespace std;
+
+/*
+loginUser前面的用户名->密码缓存。按用户名哈希分成SHARDS个分片，每片一把锁、一条LRU链表和自己的内存预算。
+"用户不存在"也会缓存（负缓存），注册成功后由database用put覆盖，所以热门账号登录完全不访问SQLite。
+只对经过database的写入保持一致，直接改数据库文件的写入需要重启或clear。
+*/
+class CredentialCache
+{
+public:
+    static const size_t SHARDS = 64;
+
+    struct Record
+    {
+        bool exists = false;
+        string password;
+    };
+
+    // budget_bytes: 所有分片合计的大致内存上限
+    CredentialCache(size_t budget_bytes = 16 * 1024 * 1024) : shard_budget(budget_bytes / SHARDS) {}
+
+    // 命中时填好record返回true；未命中返回false，并给出version供之后的fill使用
+    bool get(const string &username, Record &record, uint64_t &version)
+    {
+        Shard &shard = shardOf(username);
+        lock_guard<mutex> lock(shard.lock);
+        auto it = shard.index.find(username);
+        if (it == shard.index.end())
+        {
+            shard.misses++;
+            version = shard.version;
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        record = it->second->second;
+        shard.hits++;
+        return true;
+    }
+
+    // 把未命中后从数据库读到的结果放进缓存。读的期间如果这个分片被put过（例如刚好有人注册），结果可能过时，直接丢弃
+    void fill(const string &username, const Record &record, uint64_t version)
+    {
+        Shard &shard = shardOf(username);
+        lock_guard<mutex> lock(shard.lock);
+        if (shard.version != version)
+            return;
+        store(shard, username, record);
+    }
+
+    // 数据库写入成功后调用，覆盖旧的记录（包括负缓存）
+    void put(const string &username, const string &password)
+    {
+        Shard &shard = shardOf(username);
+        lock_guard<mutex> lock(shard.lock);
+        shard.version++;
+        Record record;
+        record.exists = true;
+        record.password = password;
+        store(shard, username, record);
+    }
+
+    void clear()
+    {
+        for (Shard &shard : shards)
+        {
+            lock_guard<mutex> lock(shard.lock);
+            shard.version++;
+            shard.index.clear();
+            shard.lru.clear();
+            shard.bytes = 0;
+        }
+    }
+
+    uint64_t hits()
+    {
+        return sum(&Shard::hits);
+    }
+
+    uint64_t misses()
+    {
+        return sum(&Shard::misses);
+    }
+
+private:
+    struct Shard
+    {
+        mutex lock;
+        list<pair<string, Record>> lru;
+        unordered_map<string, list<pair<string, Record>>::iterator> index;
+        size_t bytes = 0;
+        uint64_t version = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+    size_t shard_budget;
+    Shard shards[SHARDS];
+
+    Shard &shardOf(const string &username)
+    {
+        return shards[hash<string>()(username) & (SHARDS - 1)];
+    }
+
+    // 一条记录的大致开销：键存两份（链表和索引）、密码，再加上链表节点和哈希桶
+    static size_t cost(const string &username, const Record &record)
+    {
+        return 2 * username.size() + record.password.size() + 128;
+    }
+
+    void store(Shard &shard, const string &username, const Record &record)
+    {
+        auto it = shard.index.find(username);
+        if (it != shard.index.end())
+        {
+            shard.bytes -= cost(username, it->second->second);
+            it->second->second = record;
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        }
+        else
+        {
+            shard.lru.emplace_front(username, record);
+            shard.index[username] = shard.lru.begin();
+        }
+        shard.bytes += cost(username, record);
+        while (shard.bytes > shard_budget && shard.lru.size() > 1)
+        {
+            auto &victim = shard.lru.back();
+            shard.bytes -= cost(victim.first, victim.second);
+            shard.index.erase(victim.first);
+            shard.lru.pop_back();
+        }
+    }
+
+    uint64_t sum(uint64_t Shard::*counter)
+    {
+        uint64_t total = 0;
+        for (Shard &shard : shards)
+        {
+            lock_guard<mutex> lock(shard.lock);
+            total += shard.*counter;
+        }
+        return total;
+    }
+};
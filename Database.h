@@ -1,55 +1,315 @@
 #pragma once
 #include <string>
 #include <iostream>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <optional>
 #include <sqlite3.h>
 #include "Logger.h"
+#include "Metrics.h"
+#include "CredentialCache.h"
 using namespace std;
 
 class database{
     private:
-        sqlite3* db;
-    public:
-        database(const string& path)
+        // 一个SQLite连接和它预编译好的语句，同一时刻只被一个线程租用
+        struct Connection
+        {
+            sqlite3 * db = nullptr;
+            sqlite3_stmt * insert_stmt = nullptr;
+            sqlite3_stmt * select_stmt = nullptr;
+
+            ~Connection()
+            {
+                sqlite3_finalize(insert_stmt);
+                sqlite3_finalize(select_stmt);
+                sqlite3_close(db);
+            }
+        };
+
+        // RAII租约：析构时把连接还回池里，并把语句复位以便下次复用
+        class Lease
+        {
+            public:
+                Lease(database& owner) : owner(owner), conn(owner.acquire()) {}
+                ~Lease()
+                {
+                    sqlite3_reset(conn->insert_stmt);
+                    sqlite3_clear_bindings(conn->insert_stmt);
+                    sqlite3_reset(conn->select_stmt);
+                    sqlite3_clear_bindings(conn->select_stmt);
+                    owner.release(conn);
+                }
+                Connection* operator->() const { return conn; }
+            private:
+                database& owner;
+                Connection* conn;
+        };
+
+        vector<unique_ptr<Connection>> connections;
+        vector<Connection*> idle;
+        mutex pool_mutex;
+        condition_variable pool_cv;
+
+        // 一条等待写入的注册，放在调用者的栈上，写线程提交后填好结果
+        struct PendingWrite
+        {
+            const string* username;
+            const string* password;
+            bool ok = false;
+            bool done = false;
+        };
+
+        /*
+        组提交：并发的注册先排队，写线程攒够max_batch条或者第一条已经等了batch_window，
+        就在一个事务里逐条INSERT然后一次COMMIT，每条的主键冲突单独返回给自己的调用者。
+        */
+        unique_ptr<Connection> writer;
+        vector<PendingWrite*> write_queue;
+        mutex write_mutex;
+        condition_variable write_cv;  // 写线程等新的注册
+        condition_variable done_cv;   // 调用者等自己的结果
+        chrono::microseconds batch_window{0};
+        size_t max_batch = 256;
+        bool stopping = false;
+        thread writer_thread;
+
+        // 登录先查缓存，注册成功后由写线程更新
+        CredentialCache credentials;
+
+        static void exec(sqlite3* db, const char* sql)
         {
-            if(sqlite3_open(path.c_str(), &db) != SQLITE_OK)
+            char * errmsg = nullptr;
+            if(sqlite3_exec(db, sql, 0, 0, &errmsg) != SQLITE_OK)
+            {
+                string message = errmsg ? errmsg : "unknown error";
+                sqlite3_free(errmsg);
+                throw runtime_error("Failed to execute \"" + string(sql) + "\": " + message);
+            }
+        }
+
+        // 打开一个连接：WAL模式下读者之间、读者与写者之间互不阻塞，语句只在这里编译一次
+        static unique_ptr<Connection> openConnection(const string& path)
+        {
+            unique_ptr<Connection> conn(new Connection());
+            // 每个连接只由租用它的线程使用，不需要SQLite内部的互斥锁
+            int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
+            if(sqlite3_open_v2(path.c_str(), &conn->db, flags, nullptr) != SQLITE_OK)
                 throw runtime_error("Failed to open database");
-            
+            // 写者互相竞争时等待而不是立即返回SQLITE_BUSY
+            sqlite3_busy_timeout(conn->db, 5000);
+            exec(conn->db, "PRAGMA journal_mode=WAL");
+            exec(conn->db, "PRAGMA synchronous=NORMAL");   // WAL下NORMAL只在检查点时fsync
+            exec(conn->db, "PRAGMA cache_size=-16384");    // 每个连接16MB页缓存
+            exec(conn->db, "PRAGMA mmap_size=268435456");  // 256MB内存映射读
+            exec(conn->db, "PRAGMA temp_store=MEMORY");
+
             //create the table of users
-            const char * sql = "CREATE TABLE IF NOT EXISTS users(username TEXT PRIMARY KEY, password TEXT)";
-            char * errmsg;
-            if(sqlite3_exec(db, sql, 0, 0, &errmsg) != SQLITE_OK)
+            exec(conn->db, "CREATE TABLE IF NOT EXISTS users(username TEXT PRIMARY KEY, password TEXT)");
+
+            const char * insert_sql = "INSERT INTO users (username, password) VALUES (?, ?);";
+            const char * select_sql = "SELECT password FROM users WHERE username = ?;";
+            if(sqlite3_prepare_v3(conn->db, insert_sql, -1, SQLITE_PREPARE_PERSISTENT, &conn->insert_stmt, nullptr) != SQLITE_OK ||
+               sqlite3_prepare_v3(conn->db, select_sql, -1, SQLITE_PREPARE_PERSISTENT, &conn->select_stmt, nullptr) != SQLITE_OK)
+                throw runtime_error("Failed to prepare statements: " + string(sqlite3_errmsg(conn->db)));
+            return conn;
+        }
+
+        Connection* acquire()
+        {
+            unique_lock<mutex> lock(pool_mutex);
+            pool_cv.wait(lock, [this] { return !idle.empty(); });
+            Connection* conn = idle.back();
+            idle.pop_back();
+            return conn;
+        }
+
+        void release(Connection* conn)
+        {
+            {
+                lock_guard<mutex> lock(pool_mutex);
+                idle.push_back(conn);
+            }
+            pool_cv.notify_one();
+        }
+
+        void writerLoop()
+        {
+            vector<PendingWrite*> batch;
+            unique_lock<mutex> lock(write_mutex);
+            while(true)
+            {
+                write_cv.wait(lock, [this] { return stopping || !write_queue.empty(); });
+                if(write_queue.empty())
+                    return;
+                // 从第一条到达开始计时，窗口到了或者攒满就提交
+                auto deadline = chrono::steady_clock::now() + batch_window;
+                write_cv.wait_until(lock, deadline, [this] { return stopping || write_queue.size() >= max_batch; });
+                size_t count = min(write_queue.size(), max_batch);
+                batch.assign(write_queue.begin(), write_queue.begin() + count);
+                write_queue.erase(write_queue.begin(), write_queue.begin() + count);
+                lock.unlock();
+
+                commitBatch(batch);
+
+                lock.lock();
+                for(PendingWrite* write : batch)
+                    write->done = true;
+                done_cv.notify_all();
+            }
+        }
+
+        void commitBatch(const vector<PendingWrite*>& batch)
+        {
+            sqlite3_stmt* stmt = writer->insert_stmt;
+            bool in_transaction = false;
+            if(batch.size() > 1)
+            {
+                in_transaction = sqlite3_exec(writer->db, "BEGIN IMMEDIATE", 0, 0, 0) == SQLITE_OK;
+                // 每条语句自动提交，结果仍然准确，只是每行一次同步
+                if(!in_transaction)
+                    LOG_WARNING("BEGIN failed, committing %zu registrations one by one: %s", batch.size(), sqlite3_errmsg(writer->db));
+            }
+            for(PendingWrite* write : batch)
+            {
+                sqlite3_bind_text(stmt, 1, write->username->c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, write->password->c_str(), -1, SQLITE_STATIC);
+                // 主键冲突只让这一条语句失败，事务里的其他行不受影响；
+                // SQLITE_FULL、IOERR这类错误可能让SQLite自动回滚整个事务，这时回到了自动提交模式
+                write->ok = sqlite3_step(stmt) == SQLITE_DONE;
+                bool rolled_back = !write->ok && in_transaction && sqlite3_get_autocommit(writer->db);
+                if(rolled_back)
+                    LOG_ERROR("Transaction of %zu registrations rolled back: %s", batch.size(), sqlite3_errmsg(writer->db));
+                sqlite3_reset(stmt);
+                sqlite3_clear_bindings(stmt);
+                if(rolled_back)
+                {
+                    // 之前插入的行已经撤销，剩下的不再执行，否则它们会在自动提交模式下逐条提交，和COMMIT的结果对不上
+                    for(PendingWrite* w : batch)
+                        w->ok = false;
+                    in_transaction = false;
+                    break;
+                }
+            }
+            if(in_transaction && sqlite3_exec(writer->db, "COMMIT", 0, 0, 0) != SQLITE_OK)
+            {
+                LOG_ERROR("Failed to commit %zu registrations: %s", batch.size(), sqlite3_errmsg(writer->db));
+                // COMMIT失败（例如SQLITE_BUSY）时事务可能还在，回滚后整批都没有写入
+                if(!sqlite3_get_autocommit(writer->db))
+                    sqlite3_exec(writer->db, "ROLLBACK", 0, 0, 0);
+                for(PendingWrite* write : batch)
+                    write->ok = false;
+            }
+            // 在调用者拿到结果之前更新缓存，注册返回后登录一定能看到这个用户
+            for(PendingWrite* write : batch)
+            {
+                if(write->ok)
+                    credentials.put(*write->username, *write->password);
+            }
+        }
+
+        // 从数据库读一个用户的记录，出错时返回false
+        bool lookup(const string& username, CredentialCache::Record& record)
+        {
+            Lease conn(*this);
+            sqlite3_bind_text(conn->select_stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+            int rc = sqlite3_step(conn->select_stmt);
+            if(rc == SQLITE_DONE)
             {
-                throw runtime_error("Failed to create table: " + string(errmsg));
+                record.exists = false;
+                return true;
             }
-            
+            if(rc != SQLITE_ROW)
+            {
+                LOG_ERROR("Failed to look up user %s: %s", username.c_str(), sqlite3_errmsg(conn->db));
+                return false;
+            }
+            // 密码为NULL的行不可能登录成功，按不存在处理
+            const char * stored_password = reinterpret_cast<const char*>(sqlite3_column_text(conn->select_stmt, 0));
+            record.exists = stored_password != nullptr;
+            if(record.exists)
+                record.password.assign(stored_password, sqlite3_column_bytes(conn->select_stmt, 0));
+            return true;
+        }
+
+        bool checkPassword(const string& username, const string& password, const CredentialCache::Record& record)
+        {
+            if (!record.exists)
+            {
+                // 如果用户名不存在，记录日志并返回false
+                LOG_INFO("User not found: %s" , username.c_str());
+                return false;
+            }
+            //compare with the password stored
+            if(record.password != password)
+            {
+                LOG_INFO("Failed to login for user: %s", username.c_str());
+                return false;
+            }
+
+            LOG_INFO("User login : %s", username.c_str());
+            return true;
         }
+
+    public:
+        // pool_size: 连接池大小，通常与工作线程数相同，0表示按CPU核数
+        database(const string& path, size_t pool_size = 0)
+        {
+            if(pool_size == 0)
+                pool_size = max(1u, thread::hardware_concurrency());
+            for(size_t i = 0; i < pool_size; i++)
+            {
+                connections.push_back(openConnection(path));
+                idle.push_back(connections.back().get());
+            }
+            // 写入全部走专用连接，读连接池不会和它抢写锁
+            writer = openConnection(path);
+            writer_thread = thread(&database::writerLoop, this);
+        }
+
         ~database()
         {
-            sqlite3_close(db);
+            {
+                lock_guard<mutex> lock(write_mutex);
+                stopping = true;
+            }
+            write_cv.notify_one();
+            writer_thread.join();
+        }
+
+        // 组提交窗口：window为0时只合并写线程忙的时候到达的注册，max_batch为1时相当于逐条自动提交
+        void setWriteBatching(chrono::microseconds window, size_t batch)
+        {
+            lock_guard<mutex> lock(write_mutex);
+            batch_window = window;
+            max_batch = max<size_t>(batch, 1);
         }
 
         //function for users to register
         bool registerUser(const string& username, const string& password)
         {
-            //prepare sql
-            string sql = "INSERT INTO users (username, password) VALUES (?, ?);";
-            sqlite3_stmt * stmt;
-            if(sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+            // 耗时包含在队列里等待组提交的时间
+            uint64_t start = Metrics::now();
+            PendingWrite write;
+            write.username = &username;
+            write.password = &password;
             {
-                LOG_INFO("Failed to prepare register sql for user: %s", username.c_str());
-                return false;
+                unique_lock<mutex> lock(write_mutex);
+                write_queue.push_back(&write);
+                if(write_queue.size() == 1 || write_queue.size() >= max_batch)
+                    write_cv.notify_one();
+                done_cv.wait(lock, [&write] { return write.done; });
             }
-            //bind
-            sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 2, password.c_str(), -1, SQLITE_STATIC);
-            //exec
-            if(sqlite3_step(stmt) != SQLITE_DONE)
+            Metrics::recordStage(Metrics::DB, start);
+            if(!write.ok)
             {
                 LOG_INFO("Failed to excecute sql for user: %s", username.c_str());
-                sqlite3_finalize(stmt);
                 return false;
             }
-            sqlite3_finalize(stmt);
             LOG_INFO("User registered: %s with password: %s", username.c_str(), password.c_str());
             return true;
             //username is the primary key, so it is unique
@@ -59,35 +319,41 @@ class database{
         //function for users to login
         bool loginUser(const string& username, const string& password)
         {
-            string sql = "SELECT password FROM users WHERE username = ?;";
-            sqlite3_stmt * stmt;
-            if(sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
-            {
-                LOG_INFO("Failed to prepare login sql for user: %s", username.c_str());
-                return false;
-            }
-            sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
-            if (sqlite3_step(stmt) != SQLITE_ROW)
-            {
-                // 如果用户名不存在，记录日志，清理资源并返回false
-                LOG_INFO("User not found: %s" , username.c_str());
-                sqlite3_finalize(stmt);
-                return false;
-            }
-            //get the password stored
-            const char * stored_password = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-            string password_str = string(stored_password, sqlite3_column_bytes(stmt, 0));
-            sqlite3_finalize(stmt);
-            if(stored_password == nullptr || password_str != password)
-            {
-                LOG_INFO("Failed to login for user: %s", username);
+            uint64_t version;
+            optional<bool> cached = loginCached(username, password, version);
+            return cached ? *cached : loginStored(username, password, version);
+        }
+
+        // 登录的前半段，只查凭据缓存不会阻塞：没命中时返回nullopt，再用loginStored去数据库查
+        optional<bool> loginCached(const string& username, const string& password, uint64_t& version)
+        {
+            CredentialCache::Record record;
+            if(!credentials.get(username, record, version))
+                return nullopt;
+            return checkPassword(username, password, record);
+        }
+
+        // 登录的后半段，查数据库并填进缓存；version来自loginCached
+        bool loginStored(const string& username, const string& password, uint64_t version)
+        {
+            CredentialCache::Record record;
+            uint64_t start = Metrics::now();
+            bool found = lookup(username, record);
+            Metrics::recordStage(Metrics::DB, start);
+            if(!found)
                 return false;
-            }
+            credentials.fill(username, record, version);
+            return checkPassword(username, password, record);
+        }
 
-            LOG_INFO("User login : %s", username);
-            return true;
+        uint64_t cacheHits()
+        {
+            return credentials.hits();
         }
-    
-};
 
+        uint64_t cacheMisses()
+        {
+            return credentials.misses();
+        }
 
+};
@@ -0,0 +1,184 @@
+#pragma once
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include "IoBackend.h"
+#include "Logger.h"
+#include "Metrics.h"
+using namespace std;
+
+/*
+epoll后端：连接以EPOLLET|EPOLLONESHOT注册，每次事件只交给一个工作线程，
+工作线程自己读到EAGAIN、自己发送，处理完用EPOLL_CTL_MOD重新打开通知（epoll_ctl本身是线程安全的）。
+监听套接字也是边沿触发：accept因为fd用完等原因出错时，监听队列里剩下的连接不会再有通知，由poll在退避结束后重新accept。
+*/
+class EpollBackend : public IoBackend
+{
+public:
+    EpollBackend(int max_events) : max_events(max_events), events(max_events) {}
+
+    ~EpollBackend()
+    {
+        if (epollfd != -1)
+            close(epollfd);
+    }
+
+    const char *name() const override
+    {
+        return "epoll";
+    }
+
+    bool open(int listen, int wakeup, IoHandler *h) override
+    {
+        listen_fd = listen;
+        wakeup_fd = wakeup;
+        handler = h;
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollfd == -1)
+            return false;
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = nullptr; // 监听套接字的data.ptr为空，eventfd的指向wakeup_fd，连接的data.ptr指向Connection
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1)
+            return false;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wakeup_fd;
+        return epoll_ctl(epollfd, EPOLL_CTL_ADD, wakeup_fd, &ev) == 0;
+    }
+
+    void poll(int timeout_ms) override
+    {
+        if (accept_retry_ms != 0)
+        {
+            int64_t wait = max<int64_t>(accept_retry_ms - steadyMs(), 0);
+            if (timeout_ms < 0 || wait < timeout_ms)
+                timeout_ms = int(min<int64_t>(wait, INT_MAX));
+        }
+        int nfds = epoll_wait(epollfd, events.data(), max_events, timeout_ms);
+        if (nfds == -1 && errno != EINTR)
+            LOG_ERROR("epoll_wait failed");
+        for (int i = 0; i < nfds; ++i)
+        {
+            if (events[i].data.ptr == nullptr) // new connection arrive
+            {
+                // 退避期间不提前重试，到时间后一起accept
+                if (accept_retry_ms == 0)
+                    acceptAll();
+            }
+            else if (events[i].data.ptr == &wakeup_fd)
+                handler->onWakeup();
+            else
+                handler->onReadable(static_cast<Connection *>(events[i].data.ptr));
+        }
+        if (accept_retry_ms != 0 && steadyMs() >= accept_retry_ms)
+            acceptAll();
+    }
+
+    bool add(Connection *conn) override
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        return epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->fd, &ev) == 0;
+    }
+
+    bool armFromAnyThread() const override
+    {
+        return true;
+    }
+
+    // 处理完一轮请求后重新打开连接上的事件通知；还有响应没发完时改为等待可写
+    bool arm(Connection *conn, bool want_write) override
+    {
+        struct epoll_event ev = {};
+        ev.events = (want_write ? EPOLLOUT : EPOLLIN) | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1)
+        {
+            LOG_ERROR("epoll_ctl: rearm socket %d", conn->fd);
+            return false;
+        }
+        return true;
+    }
+
+    // 关闭fd会自动把它从epoll中移除
+    void release(Connection *conn) override
+    {
+        close(conn->fd);
+        handler->onReleased(conn);
+    }
+
+    // 边缘触发：读到EAGAIN为止，数据直接读进连接自己的输入缓冲区
+    RecvResult receive(Connection *conn) override
+    {
+        ssize_t bytes_read;
+        size_t total = 0;
+        while (true)
+        {
+            // 一次最多读MAX_READ，大的上传分批交给处理函数，输入缓冲区不会涨到整个请求体那么大。
+            // 没读完的数据在rearm(EPOLL_CTL_MOD)时会被重新报告为可读
+            if (total >= MAX_READ)
+                return RECV_OK;
+            char *dst = conn->input.prepare(MIN_READ);
+            bytes_read = read(conn->fd, dst, min(conn->input.writable(), MAX_READ - total));
+            if (bytes_read <= 0)
+                break;
+            conn->input.commit(bytes_read);
+            total += bytes_read;
+        }
+        if (bytes_read == 0)
+            return RECV_EOF;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return RECV_ERROR;
+        return RECV_OK;
+    }
+
+    bool send(Connection *conn) override
+    {
+        return conn->output.flush(conn->fd);
+    }
+
+private:
+    static constexpr size_t MIN_READ = 1024; // 输入缓冲区剩余空间不足这么多时先腾出空间再读
+    static constexpr size_t MAX_READ = 256 * 1024; // 一次receive最多读这么多
+
+    int max_events;
+    vector<struct epoll_event> events;
+    int epollfd = -1, listen_fd = -1, wakeup_fd = -1;
+    IoHandler *handler = nullptr;
+    int64_t accept_retry_ms = 0; // 非0时accept在退避，到这个时间（steadyMs）再acceptAll
+
+    // 边沿触发，必须一直accept到EAGAIN；出错时退避，否则队列里剩下的连接要等下一个新连接到来才会被处理
+    void acceptAll()
+    {
+        accept_retry_ms = 0;
+        struct sockaddr_in address;
+        socklen_t addlen = sizeof(address);
+        // accept阶段的耗时：从accept调用开始到新连接注册进epoll
+        uint64_t t = Metrics::now();
+        while (true)
+        {
+            int new_socket = accept4(listen_fd, (struct sockaddr *)&address, &addlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (new_socket >= 0)
+            {
+                handler->onAccept(new_socket, address.sin_addr.s_addr);
+                addlen = sizeof(address);
+                t = Metrics::recordStage(Metrics::ACCEPT, t);
+                accept_backoff_ms = 0;
+                continue;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue; // 这一个连接已经被对端重置，接着accept下一个
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            acceptFailed(errno);
+            accept_retry_ms = steadyMs() + accept_backoff_ms;
+            return;
+        }
+    }
+};
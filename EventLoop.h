@@ -0,0 +1,462 @@
+#pragma once
+#include <sys/socket.h> // socket/bind/listen
+#include <sys/eventfd.h> // 跨线程唤醒loop
+#include <fcntl.h>      // fcntl()
+#include <netinet/in.h> // sockaddr_in
+#include <unistd.h>     // close
+#include <cerrno>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "Logger.h"
+#include "Connection.h"
+#include "TimerWheel.h"
+#include "BufferPool.h"
+#include "Metrics.h"
+#include "IoBackend.h"
+#include "EpollBackend.h"
+#include "UringBackend.h"
+#include "Task.h"
+#include "CpuTopology.h"
+using namespace std;
+
+/*
+一个EventLoop就是一个reactor：拥有自己的I/O后端（epoll或io_uring）、自己的SO_REUSEPORT监听套接字和自己的线程。
+内核在所有监听同一端口的套接字之间分发新连接，被某个loop接受的连接只会留在这个loop上，
+因此accept和事件分发不再经过单一线程。
+每个loop还有一个分层定时轮管理自己连接的超时，等待事件的超时取自最近的定时器。
+它也是自己连接上异步处理函数的Scheduler：异步操作完成后协程在loop线程里恢复。
+可以绑定到一个CPU上（setCpu），这时再由setAcceptSteering让内核把新连接交给收到它的那个CPU上的loop。
+*/
+class EventLoop : private IoHandler, public Scheduler
+{
+public:
+    // 连接可读（或等待中的可写）时的回调。事件是一次性的，接手的连接之后必须rearm或closeConnection；
+    // 返回false表示现在不接手（工作线程排队已满），loop暂时不读这个连接，稍后按顺序重试
+    using EventCallback = function<bool(Connection *)>;
+    // 连接超时时在loop线程里调用，随后连接被关闭
+    using TimeoutCallback = function<void(Connection *, TimeoutKind)>;
+    using Functor = function<void()>;
+
+    // backend应该是resolveBackend的结果（EPOLL或IO_URING）
+    EventLoop(int id, int port, int max_events, IoBackend::Kind backend_kind = IoBackend::EPOLL)
+        : id(id), PORT(port), MAX_EVENTS(max_events), server_fd(-1), wakeup_fd(-1), backend_kind(backend_kind), wakeup_pending(false){};
+
+    ~EventLoop()
+    {
+        backend.reset();
+        if (server_fd != -1)
+            close(server_fd);
+        if (wakeup_fd != -1)
+            close(wakeup_fd);
+    }
+
+    // 启动时选定后端：AUTO在内核支持io_uring时选它；要求io_uring但内核不支持时退回epoll
+    static IoBackend::Kind resolveBackend(IoBackend::Kind requested)
+    {
+        if (requested == IoBackend::EPOLL)
+            return IoBackend::EPOLL;
+        if (UringBackend::available())
+            return IoBackend::IO_URING;
+        if (requested == IoBackend::IO_URING)
+            LOG_WARNING("io_uring is not supported by this kernel, falling back to epoll");
+        return IoBackend::EPOLL;
+    }
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    void setEventCallback(EventCallback cb)
+    {
+        onEvent = move(cb);
+    }
+
+    void setTimeoutCallback(TimeoutCallback cb)
+    {
+        onTimeout = move(cb);
+    }
+
+    void setTimeouts(const Timeouts &t)
+    {
+        timeouts = t;
+    }
+
+    const Timeouts &getTimeouts() const
+    {
+        return timeouts;
+    }
+
+    // 在start之前调用：loop线程绑定到这个CPU上，监听套接字设置SO_INCOMING_CPU
+    void setCpu(int cpu_id)
+    {
+        cpu = cpu_id;
+    }
+
+    int getCpu() const
+    {
+        return cpu;
+    }
+
+    // 在start之前调用，只需要设在第一个启动的loop上：loop_of_cpu[c]是CPU c上的loop编号（启动顺序），-1表示没有
+    void setAcceptSteering(vector<int> loop_of_cpu)
+    {
+        steering = move(loop_of_cpu);
+    }
+
+    // 绑定了CPU时，接受的连接里数据包由本CPU处理的（local）和由其他CPU处理的
+    uint64_t acceptedOnCpu(bool local) const
+    {
+        return (local ? accepted_local : accepted_remote).load(memory_order_relaxed);
+    }
+
+    // 在loop线程中执行cb，可以从任意线程调用
+    void queueInLoop(Functor cb)
+    {
+        {
+            lock_guard<mutex> lock(pending_mutex);
+            pending.push_back(move(cb));
+        }
+        wakeup();
+    }
+
+    // 创建监听套接字和I/O后端，并在独立线程中运行事件循环
+    void start()
+    {
+        setupServerSocket();
+        // 其他线程通过eventfd唤醒loop执行queueInLoop提交的任务
+        wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_fd == -1)
+        {
+            LOG_ERROR("eventfd setup failed on loop %d", id);
+            exit(EXIT_FAILURE);
+        }
+        if (backend_kind == IoBackend::IO_URING)
+            backend.reset(new UringBackend());
+        else
+            backend.reset(new EpollBackend(MAX_EVENTS));
+        worker = thread([this]
+                        {
+            // 后端的环和连接缓冲区都在loop线程里第一次写入，先绑定，它们就分配在本地节点上
+            if (cpu >= 0 && !CpuTopology::pinCurrentThread(cpu))
+                LOG_WARNING("Cannot pin loop %d to CPU %d", id, cpu);
+            this->loop(); });
+    }
+
+    void join()
+    {
+        if (worker.joinable())
+            worker.join();
+    }
+
+    int getId() const
+    {
+        return id;
+    }
+
+    // 调用者所在的loop，不是loop线程时为nullptr
+    static EventLoop *current()
+    {
+        return current_loop;
+    }
+
+    const char *backendName() const
+    {
+        return backend_kind == IoBackend::IO_URING ? "io_uring" : "epoll";
+    }
+
+    // 处理完一轮请求后重新等待连接上的事件；还有响应没发完时改为发送/等待可写。可以从任意线程调用
+    void rearm(Connection *conn, bool want_write = false)
+    {
+        if (!backend->armFromAnyThread())
+        {
+            {
+                lock_guard<mutex> lock(pending_mutex);
+                pending_arms.push_back({conn, want_write});
+            }
+            wakeup();
+            return;
+        }
+        if (!backend->arm(conn, want_write))
+            closeConnection(conn);
+    }
+
+    // 工作线程读取连接上的新数据
+    RecvResult receive(Connection *conn)
+    {
+        return backend->receive(conn);
+    }
+
+    // 工作线程发送conn->output，返回false表示连接出错
+    bool send(Connection *conn)
+    {
+        return backend->send(conn);
+    }
+
+    // 在loop线程里恢复协程，可以从任意线程调用
+    void schedule(coroutine_handle<> handle) override
+    {
+        queueInLoop([this, handle]
+                    {
+            Scheduler::Scope scope(this);
+            handle.resume(); });
+    }
+
+    // 连接上挂起的异步处理函数完成了，像有新数据一样重新交给工作线程。可以从任意线程调用
+    void redispatch(Connection *conn)
+    {
+        queueInLoop([this, conn]
+                    { this->onReadable(conn); });
+    }
+
+    // 连接的定时节点属于loop线程，所以真正的关闭和释放交给loop线程执行；可以从任意线程调用
+    void closeConnection(Connection *conn)
+    {
+        queueInLoop([this, conn]
+                    { this->destroyConnection(conn); });
+    }
+
+private:
+    int id, PORT, MAX_EVENTS;
+    int server_fd, wakeup_fd;
+    IoBackend::Kind backend_kind;
+    unique_ptr<IoBackend> backend;
+    EventCallback onEvent;
+    TimeoutCallback onTimeout;
+    Timeouts timeouts;
+    TimerWheel timers;
+    BufferPool buffers; // 本loop上连接的输入缓冲区和arena
+    mutex pending_mutex;
+    vector<Functor> pending;
+    vector<pair<Connection *, bool>> pending_arms; // 后端不能跨线程arm时由工作线程转交过来
+    // runPending和上面两个交换，执行完清空但保留容量，转交任务不需要分配内存
+    vector<Functor> running;
+    vector<pair<Connection *, bool>> running_arms;
+    deque<Connection *> parked; // 有数据但回调暂时不接手的连接，按到达顺序重试
+    atomic<bool> wakeup_pending;
+    thread worker;
+    int cpu = -1;         // 绑定的CPU，-1表示不绑定
+    vector<int> steering; // 见setAcceptSteering
+    atomic<uint64_t> accepted_local{0};
+    atomic<uint64_t> accepted_remote{0};
+    static inline thread_local EventLoop *current_loop = nullptr;
+
+    // 已经有一个未处理的唤醒时不再重复写eventfd
+    void wakeup()
+    {
+        if (!wakeup_pending.exchange(true))
+        {
+            uint64_t one = 1;
+            ssize_t n = write(wakeup_fd, &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    // 只在loop线程调用。后端关闭fd，进行中的操作都结束后回调onReleased释放连接
+    void destroyConnection(Connection *conn)
+    {
+        timers.cancel(&conn->timer);
+        backend->release(conn);
+    }
+
+    int64_t shortestTimeout() const
+    {
+        return min(min(timeouts.idle_ms, timeouts.header_ms), min(timeouts.body_ms, timeouts.write_ms));
+    }
+
+    void runPending()
+    {
+        wakeup_pending.store(false);
+        {
+            lock_guard<mutex> lock(pending_mutex);
+            running.swap(pending);
+            running_arms.swap(pending_arms);
+        }
+        for (auto &arm : running_arms)
+        {
+            if (!backend->arm(arm.first, arm.second))
+                destroyConnection(arm.first);
+        }
+        for (auto &f : running)
+            f();
+        running_arms.clear();
+        running.clear();
+    }
+
+    // 定时节点到期：deadline被推后了就重新挂上，连接正在被工作线程处理就稍后再看，真正超时才关闭
+    void expire(TimerNode *node)
+    {
+        Connection *conn = static_cast<Connection *>(node->data);
+        int64_t now = TimerWheel::nowMs();
+        int64_t deadline = conn->deadline.load(memory_order_acquire);
+        if (deadline == 0)
+        {
+            timers.arm(node, now + shortestTimeout());
+            return;
+        }
+        if (deadline > now)
+        {
+            timers.arm(node, deadline);
+            return;
+        }
+        TimeoutKind kind = TimeoutKind(conn->timeout_kind.load(memory_order_relaxed));
+        if (onTimeout)
+            onTimeout(conn, kind);
+        destroyConnection(conn);
+    }
+
+    void loop()
+    {
+        current_loop = this;
+        if (!backend->open(server_fd, wakeup_fd, this))
+        {
+            LOG_ERROR("%s backend setup failed on loop %d", backendName(), id);
+            exit(EXIT_FAILURE);
+        }
+        while (true)
+        {
+            // 有暂停的连接时每毫秒重试一次
+            int timeout = timers.nextTimeoutMs();
+            if (!parked.empty() && (timeout < 0 || timeout > 1))
+                timeout = 1;
+            backend->poll(timeout);
+            runPending();
+            dispatchParked();
+            timers.advance([this](TimerNode *node)
+                           { this->expire(node); });
+        }
+    }
+
+    void onAccept(int fd, uint32_t peer_ip) override
+    {
+        // 新连接留在接受它的这个loop上，之后的事件都只在这里分发
+        if (cpu >= 0)
+        {
+            // 只有loop线程写
+            atomic<uint64_t> &count = CpuTopology::incomingCpu(fd) == cpu ? accepted_local : accepted_remote;
+            count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        }
+        Connection *conn = new Connection(fd, this);
+        conn->peer_ip = peer_ip;
+        conn->attachBuffers(&buffers);
+        int64_t now = TimerWheel::nowMs();
+        conn->setDeadline(IDLE_TIMEOUT, now + timeouts.idle_ms);
+        timers.arm(&conn->timer, now + timeouts.idle_ms);
+        if (!backend->add(conn))
+        {
+            LOG_ERROR("%s: cannot add socket %d", backendName(), fd);
+            destroyConnection(conn);
+            return;
+        }
+        LOG_INFO("New connection accepted on loop %d", id);
+    }
+
+    void onReadable(Connection *conn) override
+    {
+        // 交给工作线程期间不计超时，工作线程rearm前会设置新的deadline。
+        // 新的deadline不会早于旧的deadline和now+最短超时中较早的那个，定时节点先挂在那里，到期再按实际deadline调整
+        int64_t previous = conn->deadline.exchange(0, memory_order_relaxed);
+        int64_t earliest = TimerWheel::nowMs() + shortestTimeout();
+        timers.arm(&conn->timer, previous != 0 && previous < earliest ? previous : earliest);
+        conn->ready_at = Metrics::now();
+        // 已经有连接在等时排到后面，不插队
+        if (!parked.empty() || !onEvent(conn))
+            parked.push_back(conn);
+    }
+
+    void dispatchParked()
+    {
+        while (!parked.empty() && onEvent(parked.front()))
+            parked.pop_front();
+    }
+
+    bool onDrained(Connection *conn) override
+    {
+        // 分块响应还没产生完：像可读一样交给工作线程接着产生
+        if (conn->stream)
+        {
+            onReadable(conn);
+            return false;
+        }
+        if (conn->close_after_write)
+        {
+            destroyConnection(conn);
+            return false;
+        }
+        conn->setReadDeadline(timeouts);
+        return true;
+    }
+
+    void onBroken(Connection *conn) override
+    {
+        destroyConnection(conn);
+    }
+
+    void onWakeup() override
+    {
+        uint64_t count;
+        ssize_t n = read(wakeup_fd, &count, sizeof(count));
+        (void)n;
+    }
+
+    // 缓冲区在析构时还给buffers
+    void onReleased(Connection *conn) override
+    {
+        delete conn;
+    }
+
+    void setupServerSocket()
+    {
+        // create socket
+        server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd == -1)
+        {
+            LOG_ERROR("socket failed on loop %d", id);
+            exit(EXIT_FAILURE);
+        }
+        // 每个loop绑定同一端口，由内核在它们之间做负载均衡
+        int opt = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+        {
+            LOG_ERROR("setsockopt SO_REUSEPORT failed on loop %d", id);
+            exit(EXIT_FAILURE);
+        }
+        // 内核优先把数据包由这个CPU处理的连接交给这个套接字
+        if (cpu >= 0)
+            setsockopt(server_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+        // initialize server addresss
+        struct sockaddr_in address = {};
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_family = AF_INET;
+        address.sin_port = htons(PORT);
+        // bind socket
+        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+        {
+            LOG_ERROR("bind failed on PORT %d", PORT);
+            exit(EXIT_FAILURE);
+        }
+        // epoll边缘触发下需要循环accept直到EAGAIN，所以监听套接字也必须是非阻塞的
+        setNonBlocking(server_fd);
+        // listen on socket
+        listen(server_fd, SOMAXCONN);
+        // listen之后套接字才加入reuseport组，程序挂在组上，对之后加入的套接字同样有效
+        if (!steering.empty() && !CpuTopology::steerAcceptsByCpu(server_fd, steering))
+            LOG_WARNING("SO_ATTACH_REUSEPORT_CBPF failed on loop %d, connections are spread by hash", id);
+        LOG_INFO("Loop %d listening on PORT %d", id, PORT);
+    }
+
+    // 设置文件描述符为非阻塞模式的方法
+    static void setNonBlocking(int sock)
+    {
+        int flags = fcntl(sock, F_GETFL, 0);
+        flags |= O_NONBLOCK;
+        fcntl(sock, F_SETFL, flags);
+    }
+};
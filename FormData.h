@@ -0,0 +1,171 @@
+#pragma once
+#include <string_view>
+#include <memory_resource>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstring>
+#include "CharScan.h"
+#include "RequestArena.h"
+using namespace std;
+
+/*
+application/x-www-form-urlencoded请求体的键值对。
+没有转义（'%'或'+'）的键和值直接指向请求体，不拷贝；有转义的才解码到一块和请求体一样大的缓冲区里（解码只会变短）。
+字段列表和缓冲区从构造时的内存资源分配（默认RequestArena::current()），返回的string_view在请求体和这个对象都有效时可用
+*/
+class FormData
+{
+public:
+    using Field = pair<string_view, string_view>;
+
+    explicit FormData(string_view body, pmr::memory_resource *resource = RequestArena::current())
+        : fields(resource), resource(resource)
+    {
+        parse(body);
+    }
+
+    FormData(FormData &&other) noexcept
+        : fields(move(other.fields)), resource(other.resource), buffer(exchange(other.buffer, nullptr)),
+          capacity(exchange(other.capacity, 0)), used(other.used) {}
+
+    FormData(const FormData &) = delete;
+    FormData &operator=(const FormData &) = delete;
+    FormData &operator=(FormData &&) = delete;
+
+    ~FormData()
+    {
+        if (buffer != nullptr)
+            resource->deallocate(buffer, capacity, 1);
+    }
+
+    // 解码后的值，同名字段取第一个；不存在时返回空
+    string_view get(string_view name) const
+    {
+        for (const Field &field : fields)
+        {
+            if (field.first == name)
+                return field.second;
+        }
+        return {};
+    }
+
+    bool has(string_view name) const
+    {
+        for (const Field &field : fields)
+        {
+            if (field.first == name)
+                return true;
+        }
+        return false;
+    }
+
+    string_view operator[](string_view name) const
+    {
+        return get(name);
+    }
+
+    // 按出现的顺序遍历
+    pmr::vector<Field>::const_iterator begin() const
+    {
+        return fields.begin();
+    }
+
+    pmr::vector<Field>::const_iterator end() const
+    {
+        return fields.end();
+    }
+
+    size_t size() const
+    {
+        return fields.size();
+    }
+
+    /*
+    URL解码：'+'变空格，"%XX"变一个字节，不合法的'%'原样保留。out至少in.size()字节，返回写入的字节数。
+    两次转义之间的普通字符整段拷贝，查找转义每次比较16字节
+    */
+    static size_t percentDecode(string_view in, char *out)
+    {
+        const char *p = in.data();
+        const char *end = p + in.size();
+        char *o = out;
+        while (true)
+        {
+            const char *escape = findChar2(p, end, '%', '+');
+            memcpy(o, p, escape - p);
+            o += escape - p;
+            if (escape == end)
+                break;
+            if (*escape == '+')
+            {
+                *o++ = ' ';
+                p = escape + 1;
+                continue;
+            }
+            int high = end - escape > 2 ? hexValue(escape[1]) : -1;
+            int low = high >= 0 ? hexValue(escape[2]) : -1;
+            if (low < 0)
+            {
+                *o++ = '%';
+                p = escape + 1;
+                continue;
+            }
+            *o++ = char(high << 4 | low);
+            p = escape + 3;
+        }
+        return o - out;
+    }
+
+    static bool needsDecoding(string_view s)
+    {
+        return findChar2(s.data(), s.data() + s.size(), '%', '+') != s.data() + s.size();
+    }
+
+private:
+    pmr::vector<Field> fields;
+    pmr::memory_resource *resource;
+    char *buffer = nullptr; // 解码结果，只在有转义时分配
+    size_t capacity = 0;
+    size_t used = 0;
+
+    void parse(string_view body)
+    {
+        if (needsDecoding(body))
+        {
+            capacity = body.size();
+            buffer = static_cast<char *>(resource->allocate(capacity, 1));
+        }
+        fields.reserve(count(body.begin(), body.end(), '&') + 1);
+        while (!body.empty())
+        {
+            size_t amp = body.find('&');
+            string_view pair = body.substr(0, amp);
+            body = amp == string_view::npos ? string_view() : body.substr(amp + 1);
+            size_t eq = pair.find('=');
+            if (eq == string_view::npos)
+                continue;
+            fields.emplace_back(decode(pair.substr(0, eq)), decode(pair.substr(eq + 1)));
+        }
+    }
+
+    string_view decode(string_view s)
+    {
+        if (buffer == nullptr || !needsDecoding(s))
+            return s;
+        char *out = buffer + used;
+        size_t n = percentDecode(s, out);
+        used += n;
+        return string_view(out, n);
+    }
+
+    static int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        c |= 0x20;
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        return -1;
+    }
+};
@@ -0,0 +1,186 @@
+#pragma once
+#include <string_view>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+using namespace std;
+
+// 分块响应的输出端，由服务器实现。每次write成为一个chunk（HTTP/1.0客户端则是原样的字节）
+class ChunkWriter
+{
+public:
+    virtual ~ChunkWriter() = default;
+    virtual void write(string_view data) = 0;
+};
+
+/*
+逐步产生的响应体，用HttpResponse::setChunkedBody设置，响应以Transfer-Encoding: chunked发送。
+服务器在发送队列积压不多时在工作线程里调用produce，每次可以write任意次，返回false表示已经写完。
+同一时刻只有一个线程调用，两次调用之间可能换了线程。
+*/
+class ChunkedBody
+{
+public:
+    virtual ~ChunkedBody() = default;
+    virtual bool produce(ChunkWriter &out) = 0;
+};
+
+/*
+流式接收请求体的处理器，用Router::addBodyRoute注册。请求头收全后由工厂函数创建，
+请求体每到一段调用一次onData（已经去掉chunked编码），全部收完后调用onComplete生成响应。
+请求体超过服务器上限时不会调用onComplete，服务器直接回413。
+*/
+class BodyHandler
+{
+public:
+    virtual ~BodyHandler() = default;
+    virtual void onData(string_view chunk) = 0;
+    virtual HttpResponse onComplete(const HttpRequest &request) = 0;
+};
+
+using BodyHandlerFactory = function<unique_ptr<BodyHandler>(const HttpRequest &)>;
+
+/*
+请求体解码器：Content-Length或者chunked，数据可以分多次喂进来。
+chunk大小行和结尾的trailer按行处理，一行不完整时不消耗，等下次连同新数据一起再解析。
+*/
+class BodyDecoder
+{
+public:
+    enum Status
+    {
+        MORE,      // 需要更多数据
+        DONE,      // 请求体结束，consumed之后是下一个请求
+        INVALID,   // chunked格式错误
+        TOO_LARGE  // 超过max_size
+    };
+
+    static constexpr size_t MAX_LINE = 4096; // chunk大小行（含扩展）和trailer行的长度上限
+
+    void reset(bool is_chunked, uint64_t content_length, uint64_t max)
+    {
+        chunked = is_chunked;
+        max_size = max;
+        total = 0;
+        remaining = content_length;
+        state = chunked ? SIZE_LINE : (content_length > max ? LENGTH_TOO_LARGE : DATA);
+    }
+
+    // 解码data开头的请求体，数据交给sink(string_view)，consumed为用掉的字节数
+    template <class Sink>
+    Status decode(string_view data, size_t &consumed, Sink &&sink)
+    {
+        const char *p = data.data();
+        const char *end = p + data.size();
+        consumed = 0;
+        while (true)
+        {
+            switch (state)
+            {
+            case LENGTH_TOO_LARGE:
+                return TOO_LARGE;
+            case DATA:
+            {
+                size_t n = size_t(min<uint64_t>(remaining, uint64_t(end - p)));
+                if (n > 0)
+                {
+                    sink(string_view(p, n));
+                    p += n;
+                    remaining -= n;
+                    total += n;
+                }
+                consumed = p - data.data();
+                if (remaining > 0)
+                    return MORE;
+                if (!chunked)
+                    return DONE;
+                state = DATA_END;
+                break;
+            }
+            case SIZE_LINE:
+            case DATA_END:
+            case TRAILER:
+            {
+                const char *lf = static_cast<const char *>(memchr(p, '\n', end - p));
+                if (lf == nullptr)
+                    return size_t(end - p) > MAX_LINE ? INVALID : MORE;
+                const char *eol = (lf > p && lf[-1] == '\r') ? lf - 1 : lf;
+                Status status = line(string_view(p, eol - p));
+                if (status != MORE)
+                    return status;
+                p = lf + 1;
+                consumed = p - data.data();
+                if (state == FINISHED)
+                    return DONE;
+                break;
+            }
+            case FINISHED:
+                return DONE;
+            }
+        }
+    }
+
+    uint64_t bodyBytes() const
+    {
+        return total;
+    }
+
+private:
+    enum State
+    {
+        DATA,
+        SIZE_LINE,
+        DATA_END, // chunk数据后面的CRLF
+        TRAILER,
+        FINISHED,
+        LENGTH_TOO_LARGE
+    };
+
+    bool chunked = false;
+    uint64_t max_size = 0;
+    uint64_t total = 0;
+    uint64_t remaining = 0;
+    State state = FINISHED;
+
+    // 处理一个完整的行，返回MORE表示继续
+    Status line(string_view text)
+    {
+        if (state == DATA_END)
+        {
+            if (!text.empty())
+                return INVALID;
+            state = SIZE_LINE;
+            return MORE;
+        }
+        if (state == TRAILER)
+        {
+            // trailer字段直接忽略，空行表示整个请求结束
+            if (text.empty())
+                state = FINISHED;
+            return MORE;
+        }
+        uint64_t size = 0;
+        size_t digits = 0;
+        for (; digits < text.size(); digits++)
+        {
+            char c = text[digits];
+            int value = (c >= '0' && c <= '9') ? c - '0' : ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') ? (c | 0x20) - 'a' + 10 : -1;
+            if (value < 0)
+                break;
+            if (size > (UINT64_MAX >> 4))
+                return INVALID;
+            size = size * 16 + value;
+        }
+        // 大小后面只允许空白和";扩展"
+        if (digits == 0 || (digits < text.size() && text[digits] != ';' && text[digits] != ' ' && text[digits] != '\t'))
+            return INVALID;
+        if (size > max_size - total)
+            return TOO_LARGE;
+        remaining = size;
+        state = size == 0 ? TRAILER : DATA;
+        return MORE;
+    }
+};
@@ -0,0 +1,239 @@
+#pragma once
+#include <string_view>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+using namespace std;
+
+/*
+常用头名的编号。请求头在解析时、响应头在设置时查一次编号，之后按编号访问，不再比较字符串。
+编号用编译期找到的完美哈希查：头名的长度、首字符、中间字符、末字符（折叠成小写）乘一个种子取高位，
+种子保证所有常用头名落在不同的槽里，查表之后只需要和一个候选名比较一次
+*/
+struct HttpHeader
+{
+    enum Id : uint8_t
+    {
+        HOST,
+        CONNECTION,
+        CONTENT_LENGTH,
+        CONTENT_TYPE,
+        TRANSFER_ENCODING,
+        EXPECT,
+        ACCEPT,
+        ACCEPT_ENCODING,
+        ACCEPT_LANGUAGE,
+        USER_AGENT,
+        COOKIE,
+        AUTHORIZATION,
+        CACHE_CONTROL,
+        IF_NONE_MATCH,
+        IF_MODIFIED_SINCE,
+        RANGE,
+        ORIGIN,
+        REFERER,
+        X_FORWARDED_FOR,
+        ETAG,
+        LAST_MODIFIED,
+        ACCEPT_RANGES,
+        CONTENT_RANGE,
+        CONTENT_ENCODING,
+        VARY,
+        ALLOW,
+        RETRY_AFTER,
+        LOCATION,
+        SET_COOKIE,
+        SERVER,
+        OTHER // 不在上面的头，按名字存取
+    };
+
+    static constexpr size_t COUNT = OTHER;
+
+    // 规范写法，响应头按这个输出
+    static constexpr string_view NAMES[COUNT] = {
+        "Host",
+        "Connection",
+        "Content-Length",
+        "Content-Type",
+        "Transfer-Encoding",
+        "Expect",
+        "Accept",
+        "Accept-Encoding",
+        "Accept-Language",
+        "User-Agent",
+        "Cookie",
+        "Authorization",
+        "Cache-Control",
+        "If-None-Match",
+        "If-Modified-Since",
+        "Range",
+        "Origin",
+        "Referer",
+        "X-Forwarded-For",
+        "ETag",
+        "Last-Modified",
+        "Accept-Ranges",
+        "Content-Range",
+        "Content-Encoding",
+        "Vary",
+        "Allow",
+        "Retry-After",
+        "Location",
+        "Set-Cookie",
+        "Server",
+    };
+
+    static constexpr string_view name(Id id)
+    {
+        return NAMES[id];
+    }
+
+    // 头名对应的编号，不是常用头时返回OTHER；不区分大小写
+    static Id lookup(string_view name);
+
+    // 头名是否只由RFC 9110的tchar组成（不能有空白、控制字符和分隔符）
+    static bool isToken(string_view name);
+
+    // 只把'A'..'Z'折叠成小写，其他字节原样比较（|0x20会让'\r'等于'-'）；8字节以上每次比较8字节，最后一次和前面重叠
+    static bool equalsIgnoreCase(string_view a, string_view b)
+    {
+        if (a.size() != b.size())
+            return false;
+        size_t n = a.size();
+        if (n < 8)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                if (toLower(a[i]) != toLower(b[i]))
+                    return false;
+            }
+            return true;
+        }
+        for (size_t i = 0;; i += 8)
+        {
+            if (i + 8 > n)
+                i = n - 8;
+            if (toLower8(load8(a.data() + i)) != toLower8(load8(b.data() + i)))
+                return false;
+            if (i + 8 == n)
+                return true;
+        }
+    }
+
+    static constexpr char toLower(char c)
+    {
+        return c >= 'A' && c <= 'Z' ? char(c | 0x20) : c;
+    }
+
+private:
+    static constexpr uint64_t ONES = 0x0101010101010101ull;
+    static constexpr uint64_t HIGH = 0x8080808080808080ull;
+
+    // 8个字节同时转小写：低7位加上偏移后最高位表示是否>='A'、是否>'Z'，每个字节最多到0xBE，不会进位到下一个字节；
+    // 最高位本来就是1的字节不是ASCII字母
+    static uint64_t toLower8(uint64_t v)
+    {
+        uint64_t ascii = v & ~HIGH;
+        uint64_t at_least_a = ascii + (0x80 - 'A') * ONES;
+        uint64_t above_z = ascii + (0x80 - 'Z' - 1) * ONES;
+        uint64_t upper = at_least_a & ~above_z & ~v & HIGH;
+        return v | upper >> 2;
+    }
+
+    static uint64_t load8(const char *p)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+};
+
+namespace header_detail
+{
+    constexpr int TABLE_BITS = 7;
+    constexpr size_t TABLE_SIZE = size_t(1) << TABLE_BITS;
+
+    constexpr uint32_t key(string_view s)
+    {
+        return uint32_t(uint8_t(HttpHeader::toLower(s[0]))) | uint32_t(uint8_t(HttpHeader::toLower(s[s.size() / 2]))) << 8 |
+               uint32_t(uint8_t(HttpHeader::toLower(s.back()))) << 16 | uint32_t(s.size()) << 24;
+    }
+
+    constexpr size_t slot(uint32_t seed, string_view s)
+    {
+        return uint32_t(key(s) * seed) >> (32 - TABLE_BITS);
+    }
+
+    // 第一个让所有常用头名互不冲突的奇数种子，找不到返回0
+    constexpr uint32_t findSeed()
+    {
+        for (uint32_t seed = 0x9E3779B1u; seed < 0x9E3779B1u + (1u << 20); seed += 2)
+        {
+            bool used[TABLE_SIZE] = {};
+            bool ok = true;
+            for (size_t i = 0; i < HttpHeader::COUNT && ok; i++)
+            {
+                size_t s = slot(seed, HttpHeader::NAMES[i]);
+                ok = !used[s];
+                used[s] = true;
+            }
+            if (ok)
+                return seed;
+        }
+        return 0;
+    }
+
+    constexpr uint32_t SEED = findSeed();
+    static_assert(SEED != 0, "no perfect hash seed for the well-known header names");
+
+    constexpr array<HttpHeader::Id, TABLE_SIZE> buildTable()
+    {
+        array<HttpHeader::Id, TABLE_SIZE> table{};
+        for (auto &id : table)
+            id = HttpHeader::OTHER;
+        for (size_t i = 0; i < HttpHeader::COUNT; i++)
+            table[slot(SEED, HttpHeader::NAMES[i])] = HttpHeader::Id(i);
+        return table;
+    }
+
+    constexpr array<HttpHeader::Id, TABLE_SIZE> TABLE = buildTable();
+
+    constexpr array<bool, 256> TCHAR = []
+    {
+        array<bool, 256> table{};
+        for (int c = '0'; c <= '9'; c++)
+            table[c] = true;
+        for (int c = 'a'; c <= 'z'; c++)
+            table[c] = table[c - 'a' + 'A'] = true;
+        for (char c : string_view("!#$%&'*+-.^_`|~"))
+            table[uint8_t(c)] = true;
+        return table;
+    }();
+
+    constexpr size_t MAX_NAME = []
+    {
+        size_t longest = 0;
+        for (string_view name : HttpHeader::NAMES)
+            longest = name.size() > longest ? name.size() : longest;
+        return longest;
+    }();
+}
+
+inline HttpHeader::Id HttpHeader::lookup(string_view name)
+{
+    if (name.empty() || name.size() > header_detail::MAX_NAME)
+        return OTHER;
+    Id id = header_detail::TABLE[header_detail::slot(header_detail::SEED, name)];
+    return id != OTHER && equalsIgnoreCase(NAMES[id], name) ? id : OTHER;
+}
+
+inline bool HttpHeader::isToken(string_view name)
+{
+    for (char c : name)
+    {
+        if (!header_detail::TCHAR[uint8_t(c)])
+            return false;
+    }
+    return true;
+}
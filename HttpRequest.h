@@ -1,8 +1,16 @@
 #pragma once
 
 #include <string>
-#include <unordered_map>
-#include <sstream>
+#include <string_view>
+#include <memory_resource>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include "RequestArena.h"
+#include "CharScan.h"
+#include "HttpHeaders.h"
+#include "FormData.h"
+#include "JsonReader.h"
 using namespace std;
 class HttpRequest
 {
@@ -35,111 +43,416 @@ public:
         BODY,
         FINISH
     };
-    HttpRequest() : method(UNKNOWN), state(REQUEST_LINE){};
+    enum ParseResult
+    {
+        NEED_MORE, // 数据不完整，等待更多字节后用同一个缓冲区再次调用parse
+        COMPLETE,  // 一个完整请求已解析，consumed为它占用的字节数
+        HEADERS_COMPLETE, // 请求头已收全，请求体还没到齐或者是chunked编码，consumed为请求头占用的字节数
+        INVALID    // 请求格式错误或超出限制
+    };
+
+    static const size_t MAX_HEADER_BYTES = 64 * 1024;
+    static const size_t MAX_PARAMS = 8;
+
+    HttpRequest() { reset(); };
 
-    // parse the entire request
-    bool parse(string request)
+    /*
+    可恢复的解析：data必须从请求的第一个字节开始，每次调用可以比上一次更长（同一个连接缓冲区追加了数据）。
+    已经解析过的行不会重复扫描。解析结果只保存相对请求起点的偏移，访问器返回指向最近一次传入缓冲区的string_view，
+    所以缓冲区扩容搬家后只要再调用一次parse即可，在处理完请求之前不要修改缓冲区。
+    请求头收全而请求体不完整时返回一次HEADERS_COMPLETE，调用方可以据此决定是否流式读取请求体；
+    不流式读取的话继续调用parse，等Content-Length长的请求体到齐后返回COMPLETE。
+    chunked请求体总是由调用方读取（见BodyDecoder），处于BODY状态时parse每次都返回HEADERS_COMPLETE。
+    */
+    ParseResult parse(string_view data, size_t &consumed)
     {
-        istringstream iss(request);
-        string line;
-        bool result = true;
-        // read the request by lines, and handle each line according to current state
-        while (getline(iss, line) && line != "\r")
+        base = data.data();
+        const char *end = data.data() + data.size();
+        consumed = 0;
+        while (state != FINISH)
         {
-            if (state == REQUEST_LINE)
+            if (state == BODY)
             {
-                result = parseRequestLine(line);
+                if (chunked)
+                {
+                    consumed = body.off;
+                    return HEADERS_COMPLETE;
+                }
+                if (data.size() - body.off < body.len)
+                    return NEED_MORE;
+                state = FINISH;
+                break;
             }
-            else if (state == HEADERS)
+            // 请求行和请求头都按行处理，一次扫描同时定位':'和'\n'
+            const char *line = base + pos;
+            const char *colon = nullptr;
+            const char *lf = findChar2(line, end, '\n', ':');
+            if (lf != end && *lf == ':')
             {
-                result = parseHeader(line);
+                colon = lf;
+                // 值里的CR只能是行尾CRLF的一部分；单独的CR有的代理当成换行，和这里对行的理解不一致（RFC 9110 5.5）。
+                // 冒号之前的CR由头名的tchar检查拒绝，请求行由parseRequestLine检查
+                lf = findChar2(colon + 1, end, '\n', '\r');
+                if (lf != end && *lf == '\r')
+                {
+                    if (lf + 1 == end)
+                        lf = end;
+                    else if (lf[1] != '\n')
+                        return INVALID;
+                    else
+                        lf++;
+                }
+            }
+            if (lf == end)
+            {
+                if (data.size() > MAX_HEADER_BYTES)
+                    return INVALID;
+                return NEED_MORE;
+            }
+            const char *eol = (lf > line && lf[-1] == '\r') ? lf - 1 : lf;
+            pos = lf + 1 - base;
+            bool ok = state == REQUEST_LINE ? parseRequestLine(line, eol) : parseHeader(line, colon, eol);
+            if (!ok)
+                return INVALID;
+            if (state == BODY && (chunked || data.size() - body.off < body.len))
+            {
+                consumed = body.off;
+                return HEADERS_COMPLETE;
             }
         }
-        if (method == POST)
-        {
-            body = request.substr(request.find("\r\n\r\n") + 4);
-        }
+        consumed = body.off + body.len;
+        return COMPLETE;
+    }
 
-        return result;
+    // 复用同一个对象解析连接上的下一个请求
+    void reset()
+    {
+        method = UNKNOWN;
+        state = REQUEST_LINE;
+        base = nullptr;
+        pos = 0;
+        content_length = 0;
+        chunked = false;
+        has_content_length = false;
+        decoded_body = nullptr;
+        http11 = false;
+        keep_alive = false;
+        path = query = version = body = {0, 0};
+        headers.clear();
+        memset(known, 0, sizeof(known));
+        param_count = 0;
     }
 
-    // 解析表单形式的请求体，返回键值对字典
-    unordered_map<string, string> parseFormBody() const
+    // 解析表单形式的请求体。键和值都指向请求缓冲区，只有带转义的才解码拷贝一份；字段列表从RequestArena::current()分配
+    FormData parseFormBody() const
     {
-        unordered_map<string, string> params;
-        if (method != POST)
-            return params;
+        return FormData(getBody());
+    }
 
-        istringstream stream(body);
-        string pair;
+    // Content-Type: application/json，请求体用JsonReader读
+    bool hasJsonBody() const
+    {
+        return JsonReader::isJson(getHeader(HttpHeader::CONTENT_TYPE));
+    }
+
+    // 当前解析到的位置，BODY表示请求头已收全、正在等请求体
+    ParseState getState() const
+    {
+        return state;
+    }
+
+    Method getMethod() const
+    {
+        return method;
+    }
+
+    static const char *methodName(Method m)
+    {
+        switch (m)
+        {
+        case GET: return "GET";
+        case POST: return "POST";
+        case HEAD: return "HEAD";
+        case PUT: return "PUT";
+        case DELETE: return "DELETE";
+        case TRACE: return "TRACE";
+        case OPTIONS: return "OPTIONS";
+        case CONNECT: return "CONNECT";
+        case PATCH: return "PATCH";
+        default: return "UNKNOWN";
+        }
+    }
 
-        while (getline(stream, pair, '&'))
+    static Method parseMethod(string_view m)
+    {
+        switch (m.size())
         {
-            size_t pos = pair.find('=');
-            if (pos == string::npos)
-                continue;
-            string key = pair.substr(0, pos);
-            string value = pair.substr(pos + 1);
-            params[key] = value;
+        case 3:
+            if (m == "GET") return GET;
+            if (m == "PUT") return PUT;
+            break;
+        case 4:
+            if (m == "POST") return POST;
+            if (m == "HEAD") return HEAD;
+            break;
+        case 5:
+            if (m == "TRACE") return TRACE;
+            if (m == "PATCH") return PATCH;
+            break;
+        case 6:
+            if (m == "DELETE") return DELETE;
+            break;
+        case 7:
+            if (m == "OPTIONS") return OPTIONS;
+            if (m == "CONNECT") return CONNECT;
+            break;
         }
-        return params;
+        return UNKNOWN;
     }
 
     string getMethodString() const
     {
-        switch (method)
+        return methodName(method);
+    }
+
+    // 不含查询串的路径
+    string_view getPath() const
+    {
+        return view(path);
+    }
+
+    // '?'之后的查询串，没有则为空
+    string_view getQuery() const
+    {
+        return view(query);
+    }
+
+    string_view getVersion() const
+    {
+        return view(version);
+    }
+
+    string_view getBody() const
+    {
+        return decoded_body != nullptr ? string_view(decoded_body, body.len) : view(body);
+    }
+
+    // 请求体不在请求缓冲区里时（chunked解码后的结果）由服务器设置，body需要活到请求处理完
+    void setBody(string_view decoded)
+    {
+        decoded_body = decoded.data();
+        body.len = uint32_t(decoded.size());
+    }
+
+    // 请求行和请求头搬到了另一个缓冲区（内容相同），之后的访问器都指向那里
+    void rebase(const char *new_base)
+    {
+        base = new_base;
+    }
+
+    // 常用头按编号直接取，不比较字符串；同名的头出现多次时取第一个，不存在时返回空
+    string_view getHeader(HttpHeader::Id id) const
+    {
+        uint16_t index = id < HttpHeader::COUNT ? known[id] : 0;
+        return index != 0 ? view(headers[index - 1].value) : string_view();
+    }
+
+    // 按名字查找请求头，HTTP头名不区分大小写；不存在时返回空
+    string_view getHeader(string_view name) const
+    {
+        HttpHeader::Id id = HttpHeader::lookup(name);
+        if (id != HttpHeader::OTHER)
+            return getHeader(id);
+        for (const Header &header : headers)
         {
-        case GET:
-            return "GET";
-        case POST:
-            return "POST";
+            if (header.id == HttpHeader::OTHER && equalsIgnoreCase(view(header.name), name))
+                return view(header.value);
+        }
+        return {};
+    }
+
 
-        default:
-            return "UNKNOWN";
+    // 路由匹配到的路径参数，如"/users/:id"中的id；不存在时返回空
+    string_view getParam(string_view name) const
+    {
+        for (size_t i = 0; i < param_count && i < MAX_PARAMS; i++)
+        {
+            if (params[i].first == name)
+                return view(params[i].second);
         }
+        return {};
+    }
+
+    // 由Router在匹配时调用，name指向路由树里的字符串，value必须是getPath()的一部分；超过MAX_PARAMS的参数被忽略
+    void addParam(string_view name, string_view value)
+    {
+        if (param_count < MAX_PARAMS)
+            params[param_count] = {name, slice(value.data(), value.data() + value.size())};
+        param_count++;
+    }
+
+    size_t getParamCount() const
+    {
+        return param_count;
+    }
+
+    void truncateParams(size_t count)
+    {
+        param_count = count;
     }
 
-    const string &getPath() const
+    size_t getContentLength() const
     {
-        return path;
+        return content_length;
+    }
+
+    // Transfer-Encoding: chunked，请求体长度事先未知
+    bool isChunked() const
+    {
+        return chunked;
+    }
+
+    // HTTP/1.1默认保持连接，除非Connection: close；HTTP/1.0只有显式keep-alive才保持。请求头收全时就已经算好
+    bool keepAlive() const
+    {
+        return keep_alive;
+    }
+
+    static bool equalsIgnoreCase(string_view a, string_view b)
+    {
+        return HttpHeader::equalsIgnoreCase(a, b);
     }
 
 private:
+    // 相对请求起点的一段字节
+    struct Slice
+    {
+        uint32_t off, len;
+    };
+
+    struct Header
+    {
+        HttpHeader::Id id;
+        Slice name;
+        Slice value;
+    };
+
     Method method;
-    string path;
-    string version;
-    unordered_map<string, string> headers;
     ParseState state;
-    string body;
+    const char *base; // 最近一次parse传入的缓冲区
+    size_t pos;       // 下一行的起点
+    size_t content_length;
+    bool has_content_length;
+    bool chunked;
+    bool http11;
+    bool keep_alive;
+    const char *decoded_body; // setBody设置的请求体，长度在body.len里
+    Slice path;
+    Slice query;
+    Slice version;
+    Slice body;
+    vector<Header> headers;               // 按收到的顺序
+    uint16_t known[HttpHeader::COUNT];    // 常用头第一次出现在headers中的下标+1，0表示没有
+    pair<string_view, Slice> params[MAX_PARAMS];
+    size_t param_count;
 
-    bool parseRequestLine(const string &line)
+    string_view view(Slice s) const
     {
-        istringstream iss(line);
-        string method_str;
-        iss >> method_str;
-        if (method_str == "GET")
-            method = GET;
-        else if (method_str == "POST")
-            method = POST;
-        else
-            method = UNKNOWN;
+        return s.len ? string_view(base + s.off, s.len) : string_view();
+    }
 
-        iss >> path;
-        iss >> version;
+    Slice slice(const char *from, const char *to) const
+    {
+        return {uint32_t(from - base), uint32_t(to - from)};
+    }
+
+    bool parseRequestLine(const char *line, const char *eol)
+    {
+        // RFC 7230允许请求行之前出现空行
+        if (line == eol)
+            return true;
+        if (findChar2(line, eol, '\r', '\r') != eol)
+            return false;
+        const char *sp1 = static_cast<const char *>(memchr(line, ' ', eol - line));
+        if (sp1 == nullptr)
+            return false;
+        const char *target = sp1 + 1;
+        const char *sp2 = static_cast<const char *>(memchr(target, ' ', eol - target));
+        if (sp2 == nullptr || sp2 == target)
+            return false;
+        method = parseMethod(string_view(line, sp1 - line));
+        const char *question = static_cast<const char *>(memchr(target, '?', sp2 - target));
+        if (question != nullptr)
+        {
+            path = slice(target, question);
+            query = slice(question + 1, sp2);
+        }
+        else
+        {
+            path = slice(target, sp2);
+        }
+        version = slice(sp2 + 1, eol);
+        http11 = string_view(sp2 + 1, eol - sp2 - 1) == "HTTP/1.1";
         state = HEADERS;
         return true;
     }
 
-    bool parseHeader(const string &line)
+    bool parseHeader(const char *line, const char *colon, const char *eol)
     {
-        size_t pos = line.find(": ");
-        if (pos == string::npos)
+        // 空行表示请求头结束，按Content-Length或chunked决定是否还有请求体（与方法无关）
+        if (line == eol)
         {
+            // 两者同时出现时无法确定请求体边界（请求走私），直接拒绝
+            if (chunked && has_content_length)
+                return false;
+            string_view connection = getHeader(HttpHeader::CONNECTION);
+            keep_alive = http11 ? !equalsIgnoreCase(connection, "close") : equalsIgnoreCase(connection, "keep-alive");
+            body = {uint32_t(pos), uint32_t(content_length)};
+            state = content_length || chunked ? BODY : FINISH;
+            return true;
+        }
+        if (colon == nullptr || colon > eol || colon == line)
             return false;
+        // 头名和冒号之间不能有空白（RFC 9112 5.1），头名只能由tchar组成；否则代理可能把它当成别的头
+        if (!HttpHeader::isToken(string_view(line, colon - line)))
+            return false;
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t'))
+            value++;
+        const char *value_end = eol;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            value_end--;
+        HttpHeader::Id id = HttpHeader::lookup(string_view(line, colon - line));
+        headers.push_back({id, slice(line, colon), slice(value, value_end)});
+        if (id != HttpHeader::OTHER && known[id] == 0 && headers.size() <= UINT16_MAX)
+            known[id] = uint16_t(headers.size());
+        if (id == HttpHeader::CONTENT_LENGTH)
+        {
+            if (value == value_end)
+                return false;
+            size_t length = 0;
+            for (const char *p = value; p < value_end; p++)
+            {
+                if (*p < '0' || *p > '9')
+                    return false;
+                length = length * 10 + (*p - '0');
+                // 请求体的位置和长度按32位保存
+                if (length > UINT32_MAX)
+                    return false;
+            }
+            // 重复的Content-Length值不同时无法确定请求体边界（RFC 9112 6.3），和代理理解不一致就是请求走私
+            if (has_content_length && length != content_length)
+                return false;
+            content_length = length;
+            has_content_length = true;
+        }
+        else if (id == HttpHeader::TRANSFER_ENCODING)
+        {
+            // 只支持单独的chunked，gzip等其他编码服务器解不开，当作错误请求
+            if (!equalsIgnoreCase(string_view(value, value_end - value), "chunked"))
+                return false;
+            chunked = true;
         }
-        string key = line.substr(0, pos);
-        string value = line.substr(pos + 2);
-        headers[key] = value;
         return true;
     }
-};
\ No newline at end of file
+};
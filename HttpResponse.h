@@ -1,64 +1,366 @@
 #pragma once
 #include <string>
-#include <unordered_map>
-#include <sstream>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <memory_resource>
+#include <charconv>
+#include <cstring>
+#include <ctime>
+#include "RequestArena.h"
+#include "HttpHeaders.h"
 using namespace std;
 
+struct StaticFile;
+class ChunkedBody;
+
+// 序列化好、可以反复发送的响应：状态行和响应头（不含Connection和Date），后面紧跟响应体。见ResponseCache
+struct PreparedResponse
+{
+    string bytes;
+    size_t head_size = 0;
+    int status = 200;
+    string etag;
+
+    string_view head() const
+    {
+        return string_view(bytes.data(), head_size);
+    }
+
+    string_view body() const
+    {
+        return string_view(bytes).substr(head_size);
+    }
+};
+
+// 头和响应体从RequestArena::current()分配，在请求处理中构造的响应不经过malloc
 class HttpResponse{
 public:
-    HttpResponse(int code = 200) : statusCode(code) {}
+    HttpResponse(int code = 200)
+        : statusCode(code), headers(RequestArena::current()), body(RequestArena::current()) {}
 
     void setStatusCode(int code)
     {
         statusCode = code;
     }
+
+    int getStatusCode() const
+    {
+        return statusCode;
+    }
     
-    void setHeader(const string& name, const string& value)
+    // 同名的头（不区分大小写）只保留最后一次设置的值，输出顺序与第一次设置的顺序相同。常用头按规范写法输出
+    void setHeader(string_view name, string_view value)
+    {
+        HttpHeader::Id id = HttpHeader::lookup(name);
+        if(id != HttpHeader::OTHER)
+        {
+            setHeader(id, value);
+            return;
+        }
+        for(auto& header : headers)
+        {
+            if(header.id == HttpHeader::OTHER && HttpHeader::equalsIgnoreCase(header.name, name))
+            {
+                header.value.assign(value.data(), value.size());
+                return;
+            }
+        }
+        append(id, name, value);
+    }
+
+    // 常用头按编号设置，不比较字符串
+    void setHeader(HttpHeader::Id id, string_view value)
     {
-        headers[name] = value;
+        for(auto& header : headers)
+        {
+            if(header.id == id)
+            {
+                header.value.assign(value.data(), value.size());
+                return;
+            }
+        }
+        append(id, string_view(), value);
     }
 
-    void setBody(const std::string& b) {
-        body = b;
+    void setBody(string_view b) {
+        body.assign(b.data(), b.size());
     }
 
-    string toString() const
+    string_view getBody() const
+    {
+        return prepared ? prepared->body() : string_view(body);
+    }
+
+    const shared_ptr<const PreparedResponse> &getPrepared() const
+    {
+        return prepared;
+    }
+
+    // 响应体是否在resource分配的内存里；短的响应体放在对象自己里面（SSO），不算
+    bool bodyAllocatedFrom(pmr::memory_resource *resource) const
+    {
+        const char *p = body.data();
+        bool inside = p >= reinterpret_cast<const char *>(this) && p < reinterpret_cast<const char *>(this + 1);
+        return !prepared && !inside && body.get_allocator().resource() == resource;
+    }
+
+    // 发送缓存里序列化好的响应，只再加上这里设置的头（Connection）和Date
+    void setPrepared(shared_ptr<const PreparedResponse> p)
+    {
+        statusCode = p->status;
+        prepared = move(p);
+        body.clear();
+    }
+
+    // 序列化成PreparedResponse供缓存反复发送，只用于响应体在内存里的响应
+    shared_ptr<PreparedResponse> prepare() const
+    {
+        shared_ptr<PreparedResponse> result = make_shared<PreparedResponse>();
+        string &out = result->bytes;
+        out.reserve(statusLine(statusCode).size() + 256 + body.size());
+        out += statusLine(statusCode);
+        for(const auto& header : headers)
+        {
+            out += header.getName();
+            out += ": ";
+            out.append(header.value.data(), header.value.size());
+            out += "\r\n";
+        }
+        out += CONTENT_LENGTH;
+        out += to_string(body.size());
+        out += "\r\n";
+        result->head_size = out.size();
+        result->status = statusCode;
+        out.append(body.data(), body.size());
+        return result;
+    }
+
+    // 响应体直接来自静态文件的[offset, offset+length)，发送时不经过用户态缓冲区
+    void setFile(shared_ptr<const StaticFile> f, size_t offset, size_t length)
+    {
+        file = move(f);
+        file_offset = offset;
+        file_length = length;
+        body.clear();
+    }
+
+    const shared_ptr<const StaticFile>& getFile() const
+    {
+        return file;
+    }
+
+    size_t getFileOffset() const
+    {
+        return file_offset;
+    }
+
+    size_t getContentLength() const
+    {
+        return file ? file_length : getBody().size();
+    }
+
+    // 响应体由body分批产生，以Transfer-Encoding: chunked发送，不需要事先知道长度（见HttpBody.h）
+    void setChunkedBody(shared_ptr<ChunkedBody> b)
+    {
+        chunked_body = move(b);
+        body.clear();
+    }
+
+    const shared_ptr<ChunkedBody>& getChunkedBody() const
+    {
+        return chunked_body;
+    }
+
+    // HTTP/1.0客户端不认识chunked：既不带Content-Length也不带Transfer-Encoding，响应体原样发送，关闭连接表示结束
+    void disableChunkedFraming()
+    {
+        chunked_framing = false;
+    }
+
+    bool chunkedFraming() const
+    {
+        return chunked_framing;
+    }
+
+    // HEAD请求：保留Content-Length，但不发送响应体
+    void omitBody()
+    {
+        omit_body = true;
+    }
+
+    bool bodyOmitted() const
+    {
+        return omit_body;
+    }
+
+    // 状态行和响应头（以空行结尾）的字节数
+    size_t headersSize() const
     {
-        ostringstream oss;
-        oss << "HTTP/1.1 " << statusCode << " " << getStatusMessage() << "\r\n";
+        size_t size = (prepared ? prepared->head() : string_view(statusLine(statusCode))).size() + framingSize() +
+                      dateHeader().size() + 2;
+        for(const auto& header : headers)
+            size += header.getName().size() + header.value.size() + 4;
+        return size;
+    }
+
+    // 把状态行和响应头写到out（至少headersSize()字节），返回写完的位置
+    char* writeHeaders(char* out) const
+    {
+        out = put(out, prepared ? prepared->head() : string_view(statusLine(statusCode)));
         for(const auto& header : headers)
         {
-            oss << header.first << ": " << header.second << "\r\n";
+            out = put(out, header.getName());
+            out = put(out, ": ");
+            out = put(out, header.value);
+            out = put(out, "\r\n");
         }
-        oss << "\r\n" << body;
-        return oss.str();
+        out = writeFraming(out);
+        out = put(out, dateHeader());
+        return put(out, "\r\n");
+    }
+
+    // 把状态行和响应头追加到out，以空行结尾，不含响应体
+    void serializeHeaders(string& out) const
+    {
+        size_t old_size = out.size();
+        out.resize(old_size + headersSize());
+        writeHeaders(&out[old_size]);
+    }
+
+    // 整个响应的字节；静态文件响应的文件内容不包含在内
+    string toString() const
+    {
+        string out;
+        serializeHeaders(out);
+        out.append(getBody());
+        return out;
+    }
+
+    // 提前格式化本线程的Date头，线程发送第一个响应时不用分配
+    static void prepareThread()
+    {
+        dateHeader();
     }
 
-    static HttpResponse makeErrorResponse(int code, const string& message)
+    static HttpResponse makeErrorResponse(int code, string_view message)
     {
         HttpResponse response(code);
         response.setBody(message);
         return response;
     }
 
-    static HttpResponse makeOkResponse(const string& message)
+    static HttpResponse makeOkResponse(string_view message)
     {
         HttpResponse response(200);
         response.setBody(message);
         return response;
     }
 private:
+    static constexpr string_view CONTENT_LENGTH = "Content-Length: ";
+    static constexpr string_view TRANSFER_ENCODING = "Transfer-Encoding: chunked\r\n";
+
+    // name只有OTHER的头才保存，常用头的名字来自HttpHeader::NAMES
+    struct Header
+    {
+        HttpHeader::Id id;
+        pmr::string name;
+        pmr::string value;
+
+        string_view getName() const
+        {
+            return id != HttpHeader::OTHER ? HttpHeader::name(id) : string_view(name);
+        }
+    };
+
     int statusCode;
-    unordered_map<string, string> headers;
-    string body;
-    string getStatusMessage() const{
+    pmr::vector<Header> headers; // 按设置的顺序输出
+    pmr::string body;
+    shared_ptr<const StaticFile> file;
+    size_t file_offset = 0;
+    size_t file_length = 0;
+    bool omit_body = false;
+    shared_ptr<ChunkedBody> chunked_body;
+    bool chunked_framing = true;
+    shared_ptr<const PreparedResponse> prepared;
+    // 保持连接时客户端依靠Content-Length或者chunked的结尾确定响应边界。
+    // 缓存的响应头里已经有Content-Length；304没有响应体，Content-Length只能是原响应的长度，干脆不写
+    size_t framingSize() const
+    {
+        if(prepared || statusCode == 304)
+            return 0;
+        if(chunked_body)
+            return chunked_framing ? TRANSFER_ENCODING.size() : 0;
+        char digits[24];
+        return CONTENT_LENGTH.size() + (to_chars(digits, digits + sizeof(digits), getContentLength()).ptr - digits) + 2;
+    }
+
+    char* writeFraming(char* out) const
+    {
+        if(prepared || statusCode == 304)
+            return out;
+        if(chunked_body)
+            return chunked_framing ? put(out, TRANSFER_ENCODING) : out;
+        out = put(out, CONTENT_LENGTH);
+        out = to_chars(out, out + 24, getContentLength()).ptr;
+        return put(out, "\r\n");
+    }
+
+    // 头的字符串和headers用同一个内存资源
+    void append(HttpHeader::Id id, string_view name, string_view value)
+    {
+        pmr::memory_resource* resource = headers.get_allocator().resource();
+        headers.push_back(Header{id, pmr::string(name, resource), pmr::string(value, resource)});
+    }
+
+    static char* put(char* out, string_view s)
+    {
+        memcpy(out, s.data(), s.size());
+        return out + s.size();
+    }
+
+    // 完整的状态行，每个状态码只拼接一次
+    static const string& statusLine(int code)
+    {
+        static const vector<string> lines = []
+        {
+            vector<string> table(600);
+            for(int c = 100; c < 600; c++)
+                table[c] = "HTTP/1.1 " + to_string(c) + " " + getStatusMessage(c) + "\r\n";
+            return table;
+        }();
+        static const string unknown = "HTTP/1.1 500 Internal Server Error\r\n";
+        return (code >= 100 && code < 600) ? lines[code] : unknown;
+    }
+
+    // Date头每个线程每秒只格式化一次
+    static const string& dateHeader()
+    {
+        static thread_local time_t cached_second = 0;
+        static thread_local string line;
+        time_t now = time(nullptr);
+        if(now != cached_second)
+        {
+            char buf[64];
+            struct tm tm_time;
+            gmtime_r(&now, &tm_time);
+            size_t n = strftime(buf, sizeof(buf), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm_time);
+            line.assign(buf, n);
+            cached_second = now;
+        }
+        return line;
+    }
+
+    static const char* getStatusMessage(int statusCode){
         switch (statusCode)
         {
+            case 100: return "Continue"; // 客户端可以继续发送请求体。
             case 200: return "OK"; // 请求成功，一切正常。
             case 404: return "Not Found"; // 找不到所请求的资源。
             // ... 其他状态码 ...
             case 201: return "Created"; // 请求成功并且创建了新资源。
             case 204: return "No Content"; // 请求已成功处理，但没有内容返回。
+            case 206: return "Partial Content"; // 返回了Range请求的部分内容。
             case 301: return "Moved Permanently"; // 资源已被永久移动到新的URL。
             case 302: return "Found"; // 资源临时重定向。
             case 304: return "Not Modified"; // 资源未被修改，使用缓存即可。
@@ -67,6 +369,10 @@ private:
             case 401: return "Unauthorized"; // 未授权，需要有效的身份验证凭证。
             case 403: return "Forbidden"; // 禁止访问，即使有身份验证也可能拒绝访问。
             case 405: return "Method Not Allowed"; // 不允许使用请求的方法（如GET、POST）访问资源。
+            case 408: return "Request Timeout"; // 服务器等待请求超时。
+            case 413: return "Payload Too Large"; // 请求体超过服务器允许的大小。
+            case 416: return "Range Not Satisfiable"; // Range请求的范围超出了资源大小。
+            case 429: return "Too Many Requests"; // 客户端在一段时间内发送的请求太多，被限流。
 
             case 500: return "Internal Server Error"; // 服务器遇到了一个未曾预期的情况，导致无法完成请求。
             case 503: return "Service Unavailable"; // 服务器暂时无法处理请求，通常由于过载或维护。
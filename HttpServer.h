@@ -5,17 +5,24 @@
 #include <netinet/in.h>   // 引入IPv4地址族的网络编程接口，如sockaddr_in结构体
 #include <unistd.h>       // 引入Unix标准函数库，提供close、read、write等基本系统调用
 #include <cstring>        // 引入C字符串操作函数库
-#include "ThreadPool.h"   // 引入线程池模块，用于并发处理客户端连接请求
+#include <memory>
+#include <charconv>
+#include <optional>
+#include "WorkStealingPool.h" // 引入工作窃取线程池，用于并发处理客户端连接请求
+#include "EventLoop.h"    // 引入事件循环模块，每个reactor一个epoll实例
 #include "Router.h"       // 引入路由模块，根据HTTP请求的方法和路径分发到不同的处理器
 #include "HttpRequest.h"  // 引入HTTP请求解析类，用于解析客户端发送过来的请求数据
 #include "HttpResponse.h" // 引入HTTP响应构建类，用于构建服务端返回给客户端的响应数据
 #include "Database.h"     // 引入库，提供与数据库交互的功能
+#include "AdmissionQueue.h" // 事件循环和工作线程之间的准入控制
+#include "BlockingExecutor.h" // 异步处理函数里的阻塞操作（SQLite）在这里执行
 
 class HttpServer
 {
 public:
-    HttpServer(int port, int max_events, database &db)
-        : server_fd(-1), epollfd(-1), PORT(port), MAX_EVENTS(max_events), db(db){};
+    // reactors: 事件循环(epoll实例+监听套接字)的数量，通常取CPU核数
+    HttpServer(int port, int max_events, int reactors, database &db)
+        : PORT(port), MAX_EVENTS(max_events), REACTORS(reactors > 0 ? reactors : 1), db(db){};
 
     void setupRoutes()
     {
@@ -26,149 +33,668 @@ public:
             return response;
         });
         
-        router.setupDatabaseRoutes(db);
+        // Prometheus抓取入口，合并所有线程的指标
+        router.addRoute("GET", "/metrics", [this](const HttpRequest &) {
+            HttpResponse response(200);
+            response.setHeader(HttpHeader::CONTENT_TYPE, "text/plain; version=0.0.4");
+            string body = Metrics::render();
+            body += "# HELP credential_cache_lookups_total Login lookups served by the credential cache.\n";
+            body += "# TYPE credential_cache_lookups_total counter\n";
+            body += "credential_cache_lookups_total{result=\"hit\"} " + to_string(db.cacheHits()) + "\n";
+            body += "credential_cache_lookups_total{result=\"miss\"} " + to_string(db.cacheMisses()) + "\n";
+            body += "# HELP http_admission_queue_depth Connections waiting for a worker.\n";
+            body += "# TYPE http_admission_queue_depth gauge\n";
+            body += "http_admission_queue_depth " + to_string(admission.depth()) + "\n";
+            body += "# HELP http_shed_total Requests answered with 503 by admission control.\n";
+            body += "# TYPE http_shed_total counter\n";
+            body += "http_shed_total{reason=\"queue_full\"} " + to_string(admission.shedCount(AdmissionQueue::QUEUE_FULL)) + "\n";
+            body += "http_shed_total{reason=\"codel\"} " + to_string(admission.shedCount(AdmissionQueue::LATE)) + "\n";
+            body += "# HELP http_response_cache_total Lookups in route response caches; not_modified counts 304s among them.\n";
+            body += "# TYPE http_response_cache_total counter\n";
+            body += "http_response_cache_total{result=\"hit\"} " + to_string(ResponseCache::total(ResponseCache::HIT)) + "\n";
+            body += "http_response_cache_total{result=\"miss\"} " + to_string(ResponseCache::total(ResponseCache::MISS)) + "\n";
+            body += "http_response_cache_total{result=\"coalesced\"} " + to_string(ResponseCache::total(ResponseCache::COALESCED)) + "\n";
+            body += "http_response_cache_total{result=\"not_modified\"} " + to_string(ResponseCache::total(ResponseCache::NOT_MODIFIED)) + "\n";
+            body += "# HELP http_rate_limit_total Rate limiter outcomes: limited answered 429, evicted reused an idle client's bucket, table_full let a new client through untracked.\n";
+            body += "# TYPE http_rate_limit_total counter\n";
+            body += "http_rate_limit_total{result=\"limited\"} " + to_string(RateLimiter::total(RateLimiter::LIMITED)) + "\n";
+            body += "http_rate_limit_total{result=\"evicted\"} " + to_string(RateLimiter::total(RateLimiter::EVICTED)) + "\n";
+            body += "http_rate_limit_total{result=\"table_full\"} " + to_string(RateLimiter::total(RateLimiter::TABLE_FULL)) + "\n";
+            if (placement.pin)
+            {
+                uint64_t local = 0, remote = 0;
+                for (auto &loop : loops)
+                {
+                    local += loop->acceptedOnCpu(true);
+                    remote += loop->acceptedOnCpu(false);
+                }
+                body += "# HELP http_accepted_connections_total Connections accepted by pinned loops, by whether the loop's CPU processed their packets.\n";
+                body += "# TYPE http_accepted_connections_total counter\n";
+                body += "http_accepted_connections_total{cpu=\"local\"} " + to_string(local) + "\n";
+                body += "http_accepted_connections_total{cpu=\"remote\"} " + to_string(remote) + "\n";
+            }
+            response.setBody(body);
+            return response;
+        });
+
+        // 最近追踪的请求，Chrome trace-event JSON（chrome://tracing或Perfetto打开）
+        router.addRoute("GET", "/debug/traces", [](const HttpRequest &) {
+            HttpResponse response(200);
+            response.setHeader(HttpHeader::CONTENT_TYPE, "application/json");
+            response.setBody(Trace::renderChrome());
+            return response;
+        });
+
+        router.setupDatabaseRoutes(db, db_executor);
+        // 文档根目录下的静态资源
+        router.addStaticRoute("/static/", "www");
     }
 
     void start()
     {
-        setupServerSocket();
-        setupEpoll();
-        ThreadPool pool(16);
-        struct epoll_event events[MAX_EVENTS];
-        while (true)
+        // 绑定CPU时每个可用CPU一个loop和workers_per_cpu个工作线程，第i个loop和第i、i+n、i+2n...个工作线程在第i个CPU上
+        int reactors = REACTORS;
+        size_t workers = 16;
+        vector<CpuTopology::Cpu> cpus;
+        if (placement.pin)
         {
-            int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
-            for (int i = 0; i < nfds; i++)
+            CpuTopology topology = CpuTopology::detect();
+            for (size_t i = 0; i < topology.size(); i++)
+                cpus.push_back(topology[i]);
+            placement.workers_per_cpu = max(placement.workers_per_cpu, 1);
+            reactors = int(cpus.size());
+            workers = cpus.size() * size_t(placement.workers_per_cpu);
+            LOG_INFO("Pinning %d loops and %zu workers to %zu CPUs on %d NUMA nodes", reactors, workers, cpus.size(), topology.nodes());
+        }
+        // 事件循环不需要任务结果，用无分配的submit代替返回future的enqueue
+        WorkStealingPool pool(workers, cpus);
+        Metrics::toNs(0); // 在开始服务前完成TSC校准
+        // 工作线程的指标数据和Date头也在开始服务前建好，第一次处理请求时不用分配
+        pool.runOnEachThread([]
+                             { Metrics::prepareThread(); HttpResponse::prepareThread(); });
+        IoBackend::Kind backend = EventLoop::resolveBackend(io_backend);
+        vector<int> loop_of_cpu;
+        for (int i = 0; i < reactors; i++)
+        {
+            loops.emplace_back(new EventLoop(i, PORT, MAX_EVENTS, backend));
+            loops.back()->setTimeouts(timeouts);
+            loops.back()->setTimeoutCallback(onTimeout);
+            int home = placement.pin ? i : -1;
+            loops.back()->setEventCallback([this, &pool, home](Connection *conn)
+                                              { return this->admit(conn, pool, home); });
+            if (placement.pin)
             {
-                if (events[i].data.fd == server_fd) // new connection arrive
-                {
-                    acceptConnection();
-                }
-                else
-                {
-                    int client_fd = events[i].data.fd;
-                    pool.enqueue([client_fd, this]()
-                                 { this->handleConnection(client_fd); });
-                }
+                loops.back()->setCpu(cpus[i].id);
+                if (loop_of_cpu.size() <= size_t(cpus[i].id))
+                    loop_of_cpu.resize(cpus[i].id + 1, -1);
+                loop_of_cpu[cpus[i].id] = i;
             }
         }
+        if (placement.pin && placement.steer_accepts)
+            loops[0]->setAcceptSteering(loop_of_cpu);
+        for (auto &loop : loops)
+        {
+            loop->start();
+        }
+        LOG_INFO("Server started with %d reactors using %s", reactors, loops[0]->backendName());
+        for (auto &loop : loops)
+        {
+            loop->join();
+        }
+    }
+
+    // 在start之前调用，用来注册setupRoutes之外的路由（例如addBodyRoute的流式上传）
+    Router &getRouter()
+    {
+        return router;
+    }
+
+    // 异步路由可以用它执行自己的阻塞操作
+    BlockingExecutor &getBlockingExecutor()
+    {
+        return db_executor;
+    }
+
+    // 在start之前调用，见CpuTopology.h
+    void setCpuPlacement(const CpuPlacement &options)
+    {
+        placement = options;
+    }
+
+    // 在start之前调用，见Trace.h；抽样的追踪从GET /debug/traces导出
+    void setTracing(const Trace::Options &options)
+    {
+        Trace::configure(options);
+    }
+
+    // 在start之前调用
+    void setTimeouts(const Timeouts &t)
+    {
+        timeouts = t;
+    }
+
+    // 在start之前调用
+    void setAdmission(const AdmissionQueue::Options &options)
+    {
+        admission.setOptions(options);
+    }
+
+    // 在start之前调用。请求体的上限（字节），超过时回413并关闭连接；流式路由的请求体也受它限制
+    void setMaxBodySize(size_t bytes)
+    {
+        max_body_size = bytes;
+    }
+
+    // 在start之前调用，默认AUTO：内核支持时用io_uring，否则epoll
+    void setIoBackend(IoBackend::Kind kind)
+    {
+        io_backend = kind;
     }
 
 private:
-    int server_fd, epollfd, PORT, MAX_EVENTS;
+    int PORT, MAX_EVENTS, REACTORS;
+    Timeouts timeouts;
+    IoBackend::Kind io_backend = IoBackend::AUTO;
+    CpuPlacement placement;
+    size_t max_body_size = 16 * 1024 * 1024;
+    static constexpr size_t STREAM_HIGH_WATER = 256 * 1024; // 分块响应在发送队列里最多积压这么多就先去发送
+    AdmissionQueue admission;
     Router router;
     database &db;
+    BlockingExecutor db_executor{8, 1024};
+    vector<unique_ptr<EventLoop>> loops;
 
-    void setupServerSocket()
+    // Connection::async_state
+    enum AsyncState
     {
-        // create socket
-        server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        LOG_INFO("Socket created!");
-        // initialize server addresss
-        struct sockaddr_in address;
-        int addlen = sizeof(address);
-        address.sin_addr.s_addr = INADDR_ANY;
-        address.sin_family = AF_INET;
-        address.sin_port = htons(PORT);
-        // bind socket
-        bind(server_fd, (struct sockaddr *)&address, addlen);
-        // listen on socket
-        listen(server_fd, 3);
-        LOG_INFO("Listening on PORT %d", PORT);
-    }
+        TASK_IDLE,
+        TASK_RUNNING,   // 工作线程正在执行协程
+        TASK_SUSPENDED, // 工作线程已经放手，连接归协程
+        TASK_COMPLETED
+    };
 
-    void setupEpoll()
+    /*
+    loop线程：连接有事件时决定是否交给工作线程。排队满时开启了backpressure就返回false让loop先不读它，否则直接回503。
+    工作线程取到任务后由CoDel按排队时间决定是否丢弃；还有响应没发完的连接不丢弃，否则会把503插进半个响应里。
+    绑定了CPU时home是loop的编号，连接轮流交给和loop在同一CPU上的工作线程；否则home为-1，按池的轮转分配。
+    */
+    bool admit(Connection *conn, WorkStealingPool &pool, int home)
     {
-        struct epoll_event ev;
-        // create epoll instance
-        epollfd = epoll_create1(0);
-        if (epollfd == -1)
+        if (!admission.tryEnter())
         {
-            LOG_ERROR("epoll_create -1");
-            exit(EXIT_FAILURE);
+            if (admission.getOptions().backpressure)
+                return false;
+            admission.countShed(AdmissionQueue::QUEUE_FULL);
+            shed(conn);
+            return true;
         }
-        ev.events = EPOLLIN | EPOLLET;
-        ev.data.fd = server_fd;
-        /*
-        使用epoll_ctl函数将刚刚配置好的事件注册到epoll实例中。这里的参数意义如下：
-        epollfd: 是之前创建的epoll实例的文件描述符；
-        EPOLL_CTL_ADD: 指令标识，表示向epoll实例添加一个新的需要监控的文件描述符及其事件；
-        server_fd: 需要监控的文件描述符，也就是服务器监听套接字；
-        &ev: 指向包含事件类型和其他相关信息的epoll_event结构体的指针。
-        */
-        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, server_fd, &ev) == -1)
+        auto work = [conn, this]()
         {
-            LOG_ERROR("epoll_ctl: server_fd %d", server_fd);
-            exit(EXIT_FAILURE);
+            uint64_t start = Metrics::recordStage(Metrics::QUEUE_WAIT, conn->ready_at);
+            uint64_t sojourn = start > conn->ready_at ? Metrics::toNs(start - conn->ready_at) : 0;
+            if (admission.leave(sojourn, Metrics::toNs(start)) && !conn->midResponse())
+            {
+                admission.countShed(AdmissionQueue::LATE);
+                shed(conn);
+                return;
+            }
+            this->handleConnection(conn, start);
+        };
+        if (home < 0)
+        {
+            pool.submit(work);
+            return true;
         }
+        // 只在这个loop的线程里调用
+        static thread_local size_t turn = 0;
+        pool.submitTo(size_t(home) + (turn++ % size_t(placement.workers_per_cpu)) * loops.size(), work);
+        return true;
     }
 
-    // 设置文件描述符为非阻塞模式的方法
-    void setNonBlocking(int sock)
+    // 回503并关闭连接。先把已经到达的请求读掉：关闭时接收缓冲区里还有数据会发RST，客户端可能收不到503
+    static void shed(Connection *conn)
     {
-        // 获取当前文件描述符的标志位
-        int flags = fcntl(sock, F_GETFL, 0);
-
-        // 设置O_NONBLOCK标志位
-        flags |= O_NONBLOCK;
-
-        // 更新文件描述符的标志位
-        fcntl(sock, F_SETFL, flags);
+        conn->loop->receive(conn);
+        HttpResponse response = HttpResponse::makeErrorResponse(503, "Service Unavailable");
+        response.setHeader(HttpHeader::RETRY_AFTER, "1");
+        sendNow(conn, move(response));
+        conn->loop->closeConnection(conn);
     }
 
-    void acceptConnection()
+    // 读取请求、路由分发、生成响应并发送回客户端。picked_at是工作线程取到这个连接的时间
+    void handleConnection(Connection *conn, uint64_t picked_at)
     {
-        int new_socket;
-        struct sockaddr_in address;
-        socklen_t addlen = sizeof(address);
-        // accept connection
-        while ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addlen)) > 0)
+        // 抽中追踪的请求在处理期间作为本线程的Metrics::TraceHook，各阶段耗时记到它名下；追踪关闭时只有这一次判断
+        optional<TraceContext::Scope> trace_scope;
+        if (__builtin_expect(Trace::enabled(), 0))
+        {
+            beginTrace(conn, picked_at);
+            if (conn->trace.id != 0 && !conn->trace.ended)
+                trace_scope.emplace(&conn->trace);
+        }
+
+        // 挂起的异步处理函数完成后重新分发过来：它的响应排进队列后接着处理后面的流水线请求，最后一起发送
+        bool resumed = false;
+        if (conn->task)
+        {
+            if (!finishTask(conn))
+                return;
+            resumed = true;
+        }
+
+        // 先把上次没发完的响应发出去，发不完就继续等可写
+        if (!resumed && !conn->output.empty())
+        {
+            uint64_t send_start = Metrics::now();
+            bool sent = conn->loop->send(conn);
+            Metrics::recordStage(Metrics::SEND, send_start);
+            if (!sent)
+            {
+                conn->loop->closeConnection(conn);
+                return;
+            }
+            if (!conn->output.empty())
+            {
+                // 每次有进展都重新计时，写超时限制的是停滞时间而不是总时间
+                conn->setDeadline(WRITE_TIMEOUT, TimerWheel::nowMs() + timeouts.write_ms);
+                conn->loop->rearm(conn, true);
+                return;
+            }
+            if (conn->close_after_write && !conn->stream)
+            {
+                conn->loop->closeConnection(conn);
+                return;
+            }
+        }
+
+        // 分块响应还没产生完：接着产生一批去发送，产生完之前不处理后面的请求
+        if (conn->stream)
+        {
+            {
+                RequestArena::Scope arena_scope(conn->output.arena);
+                pumpStream(conn);
+            }
+            if (conn->stream || conn->close_after_write || conn->input.empty())
+            {
+                finishRound(conn, conn->close_after_write, Metrics::now());
+                return;
+            }
+            // 产生完了，输入缓冲区里还有流水线请求，接着往下处理
+        }
+
+        // 新数据追加到连接自己的输入缓冲区（epoll下在这里读到EAGAIN，io_uring下loop已经收好）
+        uint64_t t = Metrics::now();
+        RecvResult received = conn->loop->receive(conn);
+        t = Metrics::recordStage(Metrics::READ, t);
+        bool peer_closed = received == RECV_EOF;
+        // 如果读取错误，则打印错误信息
+        if (received == RECV_ERROR)
+        {
+            LOG_ERROR("Error reading from socket %d", conn->fd);
+            conn->loop->closeConnection(conn);
+            return;
+        }
+
+        // 按顺序处理缓冲区中所有完整的请求（流水线），响应头和响应体排进发送队列。
+        // 处理期间HttpResponse、表单参数等都从发送队列的arena分配，响应发完时一起释放
+        bool keep_alive = true;
+        size_t pos = 0;
+        RequestArena::Scope arena_scope(conn->output.arena);
+        while (keep_alive && !conn->stream && pos < conn->input.size())
         {
-            setNonBlocking(new_socket);
-            // 初始化一个新的epoll事件结构体ev，设置监听新连接的可读事件和边缘触发模式
-            struct epoll_event ev = {};
-            ev.events = EPOLLIN | EPOLLET;
-            ev.data.fd = new_socket;
-            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, new_socket, &ev) == -1)
+            HttpRequest &request = conn->request;
+            if (!conn->reading_body)
             {
-                LOG_ERROR("epoll_ctl: new socket %d", new_socket);
-                exit(EXIT_FAILURE);
+                size_t consumed = 0;
+                HttpRequest::ParseResult result = request.parse(conn->input.view().substr(pos), consumed);
+                t = Metrics::recordStage(Metrics::PARSE, t);
+                if (result == HttpRequest::NEED_MORE)
+                    break; // 请求还没收全，等下一次可读事件
+                if (result == HttpRequest::INVALID || request.getContentLength() > max_body_size)
+                {
+                    rejectRequest(conn, result == HttpRequest::INVALID ? 400 : 413);
+                    keep_alive = false;
+                    break;
+                }
+                if (result == HttpRequest::HEADERS_COMPLETE)
+                {
+                    if (!startBody(conn, pos, consumed))
+                        break; // 普通路由：等整个请求体到齐，请求体留在输入缓冲区里不用拷贝
+                    pos += consumed;
+                    continue;
+                }
+                pos += consumed;
             }
             else
             {
-                LOG_INFO("New connection accepted, socket added to epoll");
+                // 请求头已经处理过，只解码请求体
+                BodyDecoder::Status status = readBody(conn, pos);
+                t = Metrics::recordStage(Metrics::PARSE, t);
+                if (status == BodyDecoder::MORE)
+                    break;
+                if (status != BodyDecoder::DONE)
+                {
+                    rejectRequest(conn, status == BodyDecoder::TOO_LARGE ? 413 : 400);
+                    keep_alive = false;
+                    break;
+                }
+                if (!conn->body_handler)
+                    request.setBody(conn->body);
+            }
+
+            // 根据HttpRequest对象通过Router对象获取对应的HttpResponse对象
+            keep_alive = request.keepAlive();
+            HttpResponse response;
+            if (conn->body_handler)
+            {
+                response = router.completeBody(*conn->body_handler, request, conn->body_route);
+            }
+            else
+            {
+                uint64_t route_start = Metrics::now();
+                int route = Metrics::UNMATCHED;
+                uint32_t client_ip = router.hasRateLimits() ? conn->peerAddress() : 0;
+                Task<HttpResponse> task = router.routeAsync(request, response, route, client_ip);
+                if (task)
+                {
+                    // 请求还指向输入缓冲区，协程完成前不丢掉；之前的响应也留在队列里，发完会释放协程还在用的arena
+                    conn->task = move(task);
+                    conn->async_route = route;
+                    conn->async_start = route_start;
+                    conn->async_bytes = pos;
+                    conn->async_close = peer_closed;
+                    if (!runTask(conn))
+                        return; // 挂起了，连接现在归协程，不能再碰
+                    response = takeResult(conn);
+                }
             }
+            respond(conn, request, response, keep_alive);
+            t = Metrics::now();
+            endRequest(conn);
+        }
+        conn->input.consume(pos);
+        finishRound(conn, !keep_alive || peer_closed, t);
+    }
+
+    // 在当前线程启动conn->task，返回true表示已经完成；返回false时协程挂起了，完成时会把连接重新分发给工作线程
+    static bool runTask(Connection *conn)
+    {
+        conn->async_state.store(TASK_RUNNING);
+        {
+            // 协程里co_await的异步操作完成后回到连接所属的loop继续
+            Scheduler::Scope scope(conn->loop);
+            conn->task.start(onTaskDone, conn);
+        }
+        return conn->async_state.exchange(TASK_SUSPENDED) == TASK_COMPLETED;
+    }
+
+    // 协程完成时在完成它的线程上调用。启动它的工作线程还没放手时由那边接着处理
+    static void onTaskDone(void *arg)
+    {
+        Connection *conn = static_cast<Connection *>(arg);
+        if (conn->async_state.exchange(TASK_COMPLETED) == TASK_SUSPENDED)
+            conn->loop->redispatch(conn);
+    }
+
+    // 取出完成的协程的响应并销毁协程帧，计入路由指标
+    static HttpResponse takeResult(Connection *conn)
+    {
+        HttpResponse response = conn->task.result();
+        conn->task = Task<HttpResponse>();
+        conn->async_state.store(TASK_IDLE, memory_order_relaxed);
+        Metrics::recordRoute(conn->async_route, response.getStatusCode(), conn->async_start);
+        return response;
+    }
+
+    // 挂起过的协程完成后：响应排进队列，丢掉这个请求及之前的输入。要关闭连接或者开始了分块响应时直接finishRound并返回false
+    bool finishTask(Connection *conn)
+    {
+        RequestArena::Scope arena_scope(conn->output.arena);
+        HttpRequest &request = conn->request;
+        bool keep_alive = request.keepAlive();
+        HttpResponse response = takeResult(conn);
+        respond(conn, request, response, keep_alive);
+        endRequest(conn);
+        conn->input.consume(conn->async_bytes);
+        if (keep_alive && !conn->async_close && !conn->stream)
+            return true;
+        finishRound(conn, !keep_alive || conn->async_close, Metrics::now());
+        return false;
+    }
+
+    // 空闲的连接按抽样决定是否追踪下一个请求；正在追踪的请求记下这次在队列里等的时间
+    static void beginTrace(Connection *conn, uint64_t picked_at)
+    {
+        TraceContext &trace = conn->trace;
+        bool idle = conn->request.getState() == HttpRequest::REQUEST_LINE && !conn->reading_body && !conn->task && !conn->stream;
+        if (trace.id == 0 && idle && Trace::sample())
+            trace.begin(conn->ready_at);
+        if (trace.id != 0 && !trace.ended)
+            trace.span(Metrics::QUEUE_WAIT, conn->ready_at, picked_at);
+    }
+
+    // 发送这一轮排进队列的数据，然后按情况等可写、关闭连接或者等下一个请求
+    void finishRound(Connection *conn, bool close, uint64_t t)
+    {
+        bool sent = conn->loop->send(conn);
+        uint64_t sent_at = Metrics::recordStage(Metrics::SEND, t);
+        if (conn->trace.ended)
+        {
+            // 追踪的请求到响应第一次发送为止
+            conn->trace.span(Metrics::SEND, t, sent_at);
+            conn->trace.finish(sent_at);
+        }
+        if (!sent)
+        {
+            conn->loop->closeConnection(conn);
+            return;
+        }
+        if (conn->midResponse())
+        {
+            // 慢客户端：剩下的部分等EPOLLOUT再发，不占着工作线程；分块响应等队列排空后再继续产生
+            conn->close_after_write = close;
+            conn->setDeadline(WRITE_TIMEOUT, TimerWheel::nowMs() + timeouts.write_ms);
+            conn->loop->rearm(conn, true);
+            return;
         }
-        if (new_socket == -1 && (errno != EAGAIN && errno != EWOULDBLOCK))
+        if (close)
         {
-            LOG_ERROR("Error accepting new connection");
+            conn->loop->closeConnection(conn);
+            return;
         }
+        // 连接保持打开，按当前所处阶段设置超时，重新注册EPOLLONESHOT等待下一个请求
+        conn->setReadDeadline(timeouts);
+        conn->loop->rearm(conn);
     }
-    // 读取请求、路由分发、生成响应并发送回客户端
-    void handleConnection(int fd)
+
+    /*
+    请求头收全而请求体没到齐（或者是chunked）时决定怎么读请求体。流式路由和chunked请求体改为逐段解码，返回true；
+    普通路由的Content-Length请求体返回false，继续在输入缓冲区里攒齐，处理时不用拷贝
+    */
+    bool startBody(Connection *conn, size_t head_pos, size_t head_len)
     {
-        char buffer[4096];
-        ssize_t bytes_read;
-        while ((bytes_read = read(fd, buffer, sizeof(buffer) - 1)) > 0)
+        HttpRequest &request = conn->request;
+        // 客户端等服务器同意后才发请求体（curl上传较大的数据时默认这样做）
+        if (HttpRequest::equalsIgnoreCase(request.getHeader(HttpHeader::EXPECT), "100-continue"))
         {
-            buffer[bytes_read] = '\0';
+            static constexpr string_view CONTINUE = "HTTP/1.1 100 Continue\r\n\r\n";
+            memcpy(conn->output.append(CONTINUE.size()), CONTINUE.data(), CONTINUE.size());
+        }
+        int route = Metrics::UNMATCHED;
+        const BodyHandlerFactory *factory = router.findBodyRoute(request, route);
+        if (factory == nullptr && !request.isChunked())
+            return false;
+        // 输入缓冲区接下来随请求体一起被消耗，请求行和请求头先拷一份
+        conn->head.assign(conn->input.data() + head_pos, head_len);
+        request.rebase(conn->head.data());
+        conn->body_handler = factory != nullptr ? (*factory)(request) : nullptr;
+        conn->body_route = route;
+        conn->body.clear();
+        conn->body_decoder.reset(request.isChunked(), request.getContentLength(), max_body_size);
+        conn->reading_body = true;
+        return true;
+    }
 
-            // create HttpRequest instance
-            HttpRequest request;
-            if (request.parse(buffer))
+    // 解码输入缓冲区pos之后的请求体，交给流式处理器或者攒进conn->body
+    static BodyDecoder::Status readBody(Connection *conn, size_t &pos)
+    {
+        size_t used = 0;
+        BodyDecoder::Status status = conn->body_decoder.decode(conn->input.view().substr(pos), used, [conn](string_view chunk)
+                                                                 {
+            if (conn->body_handler)
+                conn->body_handler->onData(chunk);
+            else
+                conn->body.append(chunk.data(), chunk.size()); });
+        pos += used;
+        return status;
+    }
+
+    // 一个请求处理完，连接回到等待下一个请求的状态
+    static void endRequest(Connection *conn)
+    {
+        if (conn->trace.id != 0 && !conn->trace.ended)
+        {
+            // 同一轮里后面的流水线请求不再记到它名下
+            conn->trace.endRequest(conn->request.getMethodString(), conn->request.getPath());
+            Metrics::setTraceHook(nullptr);
+        }
+        conn->request.reset();
+        conn->request_start_ms = 0;
+        conn->body_start_ms = 0;
+        if (!conn->reading_body)
+            return;
+        conn->reading_body = false;
+        conn->body_handler.reset();
+        // 偶尔一次的大请求体不一直占着内存
+        conn->body.clear();
+        if (conn->body.capacity() > 64 * 1024)
+            conn->body.shrink_to_fit();
+    }
+
+    // 格式错误或请求体太大：回错误响应，随后关闭连接，剩下的数据不再读
+    static void rejectRequest(Connection *conn, int code)
+    {
+        HttpResponse response = HttpResponse::makeErrorResponse(code, code == 413 ? "Payload Too Large" : "Bad Request");
+        response.setHeader(HttpHeader::CONNECTION, "close");
+        queueResponse(conn, response);
+    }
+
+    // 路由生成的响应排进发送队列。分块响应先产生第一批，产生完之前不处理后面的请求
+    static void respond(Connection *conn, const HttpRequest &request, HttpResponse &response, bool &keep_alive)
+    {
+        bool chunked = response.getChunkedBody() != nullptr;
+        if (chunked && request.getVersion() != "HTTP/1.1")
+        {
+            // HTTP/1.0客户端靠连接关闭判断响应结束
+            response.disableChunkedFraming();
+            keep_alive = false;
+        }
+        response.setHeader(HttpHeader::CONNECTION, keep_alive ? "keep-alive" : "close");
+        if (request.getMethod() == HttpRequest::HEAD)
+            response.omitBody();
+        queueResponse(conn, response);
+        if (!chunked || response.bodyOmitted())
+            return;
+        conn->stream = response.getChunkedBody();
+        conn->stream_framed = response.chunkedFraming();
+        conn->close_after_write = !keep_alive;
+        pumpStream(conn);
+    }
+
+    // 每次write在发送队列末尾追加一个chunk
+    class StreamWriter : public ChunkWriter
+    {
+    public:
+        StreamWriter(OutputQueue &output, bool framed) : output(output), framed(framed) {}
+
+        void write(string_view data) override
+        {
+            // 长度为0的chunk表示响应体结束，只能由finish写
+            if (data.empty())
+                return;
+            if (!framed)
             {
-                // 根据HttpRequest对象通过Router对象获取对应的HttpResponse对象
-                HttpResponse response = router.routeRequest(request);
-                string response_str = response.toString();
-                send(fd, response_str.c_str(), response_str.length(), 0);
+                memcpy(output.append(data.size()), data.data(), data.size());
+                return;
             }
+            char size_line[24];
+            char *end = to_chars(size_line, size_line + 16, data.size(), 16).ptr;
+            *end++ = '\r';
+            *end++ = '\n';
+            size_t line_len = end - size_line;
+            char *out = output.append(line_len + data.size() + 2);
+            memcpy(out, size_line, line_len);
+            memcpy(out + line_len, data.data(), data.size());
+            memcpy(out + line_len + data.size(), "\r\n", 2);
         }
-        // 如果读取错误且错误原因不是EAGAIN，则打印错误信息
-        if (bytes_read == -1 && errno != EAGAIN) {
-            LOG_ERROR("Error reading from socket %d", fd);
+
+        void finish()
+        {
+            if (framed)
+                memcpy(output.append(5), "0\r\n\r\n", 5);
         }
 
-        // 处理完请求后关闭客户端连接
-        close(fd);
+    private:
+        OutputQueue &output;
+        bool framed;
+    };
+
+    // 产生分块响应的下一批数据，直到发送队列里积压了STREAM_HIGH_WATER字节或者产生完
+    static void pumpStream(Connection *conn)
+    {
+        StreamWriter writer(conn->output, conn->stream_framed);
+        while (conn->stream && conn->output.pending() < STREAM_HIGH_WATER)
+        {
+            size_t before = conn->output.pending();
+            if (!conn->stream->produce(writer))
+            {
+                writer.finish();
+                conn->stream.reset();
+            }
+            else if (conn->output.pending() == before)
+            {
+                break; // 这次什么也没产生，先把已有的发出去，等下一次可写再问
+            }
+        }
+    }
+
+    // 在loop线程里调用，之后连接被关闭；请求收了一半时尽量回一个408
+    static void onTimeout(Connection *conn, TimeoutKind kind)
+    {
+        static const char *names[] = {"idle", "header", "body", "write"};
+        LOG_INFO("Connection %d %s timeout", conn->fd, names[kind]);
+        if ((kind == HEADER_TIMEOUT || kind == BODY_TIMEOUT) && !conn->midResponse())
+            sendNow(conn, HttpResponse::makeErrorResponse(408, "Request Timeout"));
+    }
+
+    // 不经过发送队列直接发一个带Connection: close的响应，发不出去就算了，调用方随后关闭连接
+    static void sendNow(Connection *conn, HttpResponse response)
+    {
+        response.setHeader(HttpHeader::CONNECTION, "close");
+        string bytes = response.toString();
+        ssize_t n = send(conn->fd, bytes.data(), bytes.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        (void)n;
+    }
+
+    // 比这短的响应体拷到响应头后面合成一段，比多一个iovec便宜
+    static const size_t COPY_BODY_LIMIT = 1024;
+
+    // 响应头和内存里的响应体一起写进发送队列，文件内容另起一段
+    static void queueResponse(Connection *conn, const HttpResponse &response)
+    {
+        bool file = response.getFile() != nullptr;
+        string_view body = response.bodyOmitted() || file ? string_view() : response.getBody();
+        // 长的响应体不拷贝，单独一段和响应头一起writev：缓存的响应由段持有PreparedResponse；
+        // 请求处理期间构造的响应体本来就在队列的arena里，队列排空才释放。loop线程上完成的异步响应体不在arena里，照样拷贝
+        bool by_reference = body.size() >= COPY_BODY_LIMIT &&
+                            (response.getPrepared() || response.bodyAllocatedFrom(conn->output.arena.get()));
+        char *out = conn->output.append(response.headersSize() + (by_reference ? 0 : body.size()));
+        out = response.writeHeaders(out);
+        if (by_reference)
+            conn->output.pushView(body, response.getPrepared());
+        else
+            memcpy(out, body.data(), body.size());
+        if (file && !response.bodyOmitted())
+            conn->output.pushFile(response.getFile(), response.getFileOffset(), response.getContentLength());
     }
 };
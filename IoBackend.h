@@ -0,0 +1,109 @@
+#pragma once
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "Connection.h"
+#include "Logger.h"
+using namespace std;
+
+// 工作线程读取连接数据的结果
+enum RecvResult
+{
+    RECV_OK,    // 读到了数据（或者暂时没有更多数据）
+    RECV_EOF,   // 对端关闭了写方向
+    RECV_ERROR  // 连接出错
+};
+
+// 后端把事件交给EventLoop处理，所有回调都在loop线程里调用
+class IoHandler
+{
+public:
+    virtual ~IoHandler() = default;
+    // peer_ip是客户端的IPv4地址（网络字节序），后端拿不到时为0
+    virtual void onAccept(int fd, uint32_t peer_ip) = 0;
+    // 连接上有新数据（或对端关闭），需要交给工作线程处理
+    virtual void onReadable(Connection *conn) = 0;
+    // 由后端代发的响应已经全部发出。返回false表示后端不再为它等待数据（连接已关闭，或者交回了工作线程）
+    virtual bool onDrained(Connection *conn) = 0;
+    // 后端在loop线程里发现连接出错，需要关闭
+    virtual void onBroken(Connection *conn) = 0;
+    virtual void onWakeup() = 0;
+    // 连接上不再有进行中的操作，fd已经关闭，可以释放
+    virtual void onReleased(Connection *conn) = 0;
+};
+
+/*
+事件循环的I/O后端。EventLoop负责连接的生命周期、超时和跨线程任务，后端只负责等待事件和收发数据：
+- EpollBackend：就绪通知。工作线程自己read/sendmsg，连接以EPOLLONESHOT重新注册
+- UringBackend：完成通知。loop提交accept/recv/send，一次io_uring_enter处理一批操作，
+  工作线程拿到的是已经收好的数据，响应交回loop提交发送
+*/
+class IoBackend
+{
+public:
+    enum Kind
+    {
+        AUTO,    // 内核支持时用io_uring，否则epoll
+        EPOLL,
+        IO_URING
+    };
+
+    virtual ~IoBackend() = default;
+
+    virtual const char *name() const = 0;
+
+    // 在loop线程里调用一次，注册监听套接字和唤醒用的eventfd
+    virtual bool open(int listen_fd, int wakeup_fd, IoHandler *handler) = 0;
+
+    // 等待事件并分发给handler，timeout_ms为-1时一直等
+    virtual void poll(int timeout_ms) = 0;
+
+    // 新连接开始等待数据（loop线程）
+    virtual bool add(Connection *conn) = 0;
+
+    // arm能否在工作线程里直接调用；不能的话由EventLoop转交到loop线程
+    virtual bool armFromAnyThread() const = 0;
+
+    // 工作线程处理完之后再次等待：want_write为true时发送conn->output（或等待可写），否则等待新数据。
+    // 返回false表示失败，由调用者关闭连接
+    virtual bool arm(Connection *conn, bool want_write) = 0;
+
+    // 关闭连接（loop线程）。进行中的操作都结束后调用handler->onReleased
+    virtual void release(Connection *conn) = 0;
+
+    // 工作线程读取新数据追加到conn->input
+    virtual RecvResult receive(Connection *conn) = 0;
+
+    // 工作线程发送conn->output，返回false表示连接出错。发不完（或者后端要由loop发送）时output保持非空
+    virtual bool send(Connection *conn) = 0;
+
+protected:
+    // accept出错时退避一段时间再试，期间新连接留在监听队列里
+    static const int ACCEPT_BACKOFF_MIN_MS = 10;
+    static const int ACCEPT_BACKOFF_MAX_MS = 1000;
+
+    int accept_backoff_ms = 0;          // 连续accept出错时的退避时间，成功后归零
+    int64_t accept_error_logged_ms = 0; // 出错日志每秒最多一条
+    uint64_t accept_errors_suppressed = 0;
+
+    static int64_t steadyMs()
+    {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // EMFILE、ENFILE、ENOBUFS这类错误马上重试还是一样，指数退避；日志每秒最多一条，带上期间省略的次数
+    void acceptFailed(int error)
+    {
+        accept_backoff_ms = accept_backoff_ms == 0 ? ACCEPT_BACKOFF_MIN_MS : min(accept_backoff_ms * 2, ACCEPT_BACKOFF_MAX_MS);
+        int64_t now = steadyMs();
+        if (now - accept_error_logged_ms < 1000)
+        {
+            accept_errors_suppressed++;
+            return;
+        }
+        LOG_ERROR("%s accept failed: %s (%llu similar errors suppressed), retrying in %d ms", name(), strerror(error),
+                  (unsigned long long)accept_errors_suppressed, accept_backoff_ms);
+        accept_error_logged_ms = now;
+        accept_errors_suppressed = 0;
+    }
+};
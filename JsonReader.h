@@ -0,0 +1,468 @@
+#pragma once
+#include <string_view>
+#include <memory_resource>
+#include <forward_list>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include "CharScan.h"
+#include "RequestArena.h"
+using namespace std;
+
+class JsonReader;
+
+/*
+JSON文本中的一个值，只是指向原文的位置，访问时才解析（按需解析，不建DOM）。
+查找对象字段或数组元素时从头扫描，跳过不需要的值只检查括号和字符串边界，不检查里面的内容；
+取值的访问器（getString、getInt等）会完整检查自己那个值。找不到或者格式不对时得到的值exists()为false，所有访问器都返回false
+*/
+class JsonValue
+{
+public:
+    enum Type
+    {
+        MISSING,
+        NULL_VALUE,
+        BOOL,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    };
+
+    JsonValue() = default;
+
+    Type type() const
+    {
+        if (p == nullptr || p == end)
+            return MISSING;
+        switch (*p)
+        {
+        case '{': return OBJECT;
+        case '[': return ARRAY;
+        case '"': return STRING;
+        case 't':
+        case 'f': return BOOL;
+        case 'n': return NULL_VALUE;
+        default: return (*p == '-' || (*p >= '0' && *p <= '9')) ? NUMBER : MISSING;
+        }
+    }
+
+    bool exists() const
+    {
+        return type() != MISSING;
+    }
+
+    // 没有转义时直接指向原文；有转义时解码到JsonReader持有的内存里，和JsonReader一样长寿
+    bool getString(string_view &out) const;
+
+    bool getInt(int64_t &out) const
+    {
+        string_view token = numberToken();
+        if (token.empty())
+            return false;
+        from_chars_result r = from_chars(token.data(), token.data() + token.size(), out);
+        return r.ec == errc() && r.ptr == token.data() + token.size();
+    }
+
+    bool getDouble(double &out) const
+    {
+        string_view token = numberToken();
+        if (token.empty())
+            return false;
+        from_chars_result r = from_chars(token.data(), token.data() + token.size(), out);
+        return r.ec == errc() && r.ptr == token.data() + token.size();
+    }
+
+    bool getBool(bool &out) const
+    {
+        if (literal("true"))
+            out = true;
+        else if (literal("false"))
+            out = false;
+        else
+            return false;
+        return true;
+    }
+
+    bool isNull() const
+    {
+        return literal("null");
+    }
+
+    // 对象里名为key的字段，同名字段取第一个
+    JsonValue operator[](string_view key) const
+    {
+        JsonValue found;
+        forEachField([&](string_view name, const JsonValue &value)
+                     {
+            if (name != key)
+                return true;
+            found = value;
+            return false; });
+        return found;
+    }
+
+    // 数组的第index个元素
+    JsonValue at(size_t index) const
+    {
+        JsonValue found;
+        size_t i = 0;
+        forEachElement([&](const JsonValue &value)
+                       {
+            if (i++ != index)
+                return true;
+            found = value;
+            return false; });
+        return found;
+    }
+
+    /*
+    按顺序遍历对象的字段，f(string_view name, const JsonValue &value)返回false时停止。
+    不是对象或者格式错误时返回false。字段名有转义时解码后再交给f
+    */
+    template <class F>
+    bool forEachField(F &&f) const
+    {
+        if (type() != OBJECT)
+            return false;
+        const char *q = skipSpace(p + 1);
+        if (q < end && *q == '}')
+            return true;
+        while (q < end && *q == '"')
+        {
+            JsonValue key(q, end, owner);
+            const char *after_key = skipString(q);
+            string_view name;
+            if (after_key == nullptr || !key.getString(name))
+                return false;
+            q = skipSpace(after_key);
+            if (q == end || *q != ':')
+                return false;
+            JsonValue value(skipSpace(q + 1), end, owner);
+            const char *after = skipValue(value.p);
+            if (after == nullptr)
+                return false;
+            if (!f(name, value))
+                return true;
+            q = skipSpace(after);
+            if (q < end && *q == '}')
+                return true;
+            if (q == end || *q != ',')
+                return false;
+            q = skipSpace(q + 1);
+        }
+        return false;
+    }
+
+    // 按顺序遍历数组元素，f(const JsonValue &value)返回false时停止。不是数组或者格式错误时返回false
+    template <class F>
+    bool forEachElement(F &&f) const
+    {
+        if (type() != ARRAY)
+            return false;
+        const char *q = skipSpace(p + 1);
+        if (q < end && *q == ']')
+            return true;
+        while (q < end)
+        {
+            JsonValue value(q, end, owner);
+            const char *after = skipValue(q);
+            if (after == nullptr)
+                return false;
+            if (!f(value))
+                return true;
+            q = skipSpace(after);
+            if (q < end && *q == ']')
+                return true;
+            if (q == end || *q != ',')
+                return false;
+            q = skipSpace(q + 1);
+        }
+        return false;
+    }
+
+    // 这个值在原文中的全部字节，格式错误时为空
+    string_view raw() const
+    {
+        const char *after = p != nullptr ? skipValue(p) : nullptr;
+        return after != nullptr ? string_view(p, after - p) : string_view();
+    }
+
+private:
+    friend class JsonReader;
+
+    const char *p = nullptr;   // 值的第一个字节
+    const char *end = nullptr; // 整个文本的末尾
+    JsonReader *owner = nullptr;
+
+    JsonValue(const char *p, const char *end, JsonReader *owner) : p(p), end(end), owner(owner) {}
+
+    const char *skipSpace(const char *q) const
+    {
+        while (q < end && (*q == ' ' || *q == '\n' || *q == '\r' || *q == '\t'))
+            q++;
+        return q;
+    }
+
+    // q指向开头的'"'，返回结尾'"'之后的位置；没有结尾时返回nullptr。每次比较16字节找引号和反斜杠
+    const char *skipString(const char *q) const
+    {
+        q++;
+        while (true)
+        {
+            q = findChar2(q, end, '"', '\\');
+            if (q == end)
+                return nullptr;
+            if (*q == '"')
+                return q + 1;
+            if (end - q < 2)
+                return nullptr;
+            q += 2;
+        }
+    }
+
+    // 返回值之后的位置，格式错误时返回nullptr。对象和数组只数括号，不递归
+    const char *skipValue(const char *q) const
+    {
+        if (q == end)
+            return nullptr;
+        switch (*q)
+        {
+        case '"':
+            return skipString(q);
+        case '{':
+        case '[':
+        {
+            char stack[64]; // 括号嵌套太深的文本当作格式错误
+            size_t depth = 0;
+            while (q < end)
+            {
+                char c = *q;
+                if (c == '"')
+                {
+                    q = skipString(q);
+                    if (q == nullptr)
+                        return nullptr;
+                    continue;
+                }
+                if (c == '{' || c == '[')
+                {
+                    if (depth == sizeof(stack))
+                        return nullptr;
+                    stack[depth++] = c == '{' ? '}' : ']';
+                }
+                else if (c == '}' || c == ']')
+                {
+                    if (depth == 0 || stack[--depth] != c)
+                        return nullptr;
+                    if (depth == 0)
+                        return q + 1;
+                }
+                q++;
+            }
+            return nullptr;
+        }
+        case 't':
+            return literalEnd(q, "true");
+        case 'f':
+            return literalEnd(q, "false");
+        case 'n':
+            return literalEnd(q, "null");
+        default:
+        {
+            const char *start = q;
+            while (q < end && ((*q >= '0' && *q <= '9') || *q == '-' || *q == '+' || *q == '.' || *q == 'e' || *q == 'E'))
+                q++;
+            return q != start ? q : nullptr;
+        }
+        }
+    }
+
+    const char *literalEnd(const char *q, string_view word) const
+    {
+        if (size_t(end - q) < word.size() || memcmp(q, word.data(), word.size()) != 0)
+            return nullptr;
+        return q + word.size();
+    }
+
+    bool literal(string_view word) const
+    {
+        return p != nullptr && literalEnd(p, word) != nullptr;
+    }
+
+    // JSON数字：可选的'-'，整数部分不能有多余的前导0，不允许'+'开头
+    string_view numberToken() const
+    {
+        if (type() != NUMBER)
+            return {};
+        const char *after = skipValue(p);
+        const char *digits = *p == '-' ? p + 1 : p;
+        if (after - digits > 1 && digits[0] == '0' && digits[1] >= '0' && digits[1] <= '9')
+            return {};
+        return string_view(p, after - p);
+    }
+};
+
+/*
+application/json请求体的按需读取器：JsonReader json(request.getBody()); json.root()["username"].getString(name)。
+不拷贝原文，原文需要比它和它给出的JsonValue活得长。字符串里有转义时解码结果从构造时的内存资源分配，由它持有；
+因为JsonValue指向它，所以不能拷贝或移动
+*/
+class JsonReader
+{
+public:
+    explicit JsonReader(string_view text, pmr::memory_resource *resource = RequestArena::current())
+        : text(text), decoded(resource) {}
+
+    JsonReader(const JsonReader &) = delete;
+    JsonReader &operator=(const JsonReader &) = delete;
+
+    JsonValue root()
+    {
+        JsonValue value(text.data(), text.data() + text.size(), this);
+        value.p = value.skipSpace(value.p);
+        return value;
+    }
+
+    // Content-Type是application/json（可以带参数，例如charset）
+    static bool isJson(string_view content_type)
+    {
+        static constexpr string_view JSON = "application/json";
+        if (content_type.size() < JSON.size())
+            return false;
+        for (size_t i = 0; i < JSON.size(); i++)
+        {
+            if ((content_type[i] | 0x20) != JSON[i])
+                return false;
+        }
+        return content_type.size() == JSON.size() || content_type[JSON.size()] == ';' || content_type[JSON.size()] == ' ';
+    }
+
+private:
+    friend class JsonValue;
+
+    string_view text;
+    pmr::forward_list<pmr::string> decoded; // 节点不会移动，指向里面的string_view一直有效
+
+    // [begin, end)是引号之间带转义的原文，解码成UTF-8；不合法的转义返回false
+    bool unescape(const char *begin, const char *end, string_view &out)
+    {
+        pmr::string &s = decoded.emplace_front();
+        s.reserve(end - begin);
+        for (const char *q = begin; q < end;)
+        {
+            const char *slash = findChar2(q, end, '\\', '\\');
+            s.append(q, slash - q);
+            if (slash == end)
+                break;
+            if (end - slash < 2)
+                return false;
+            char c = slash[1];
+            q = slash + 2;
+            switch (c)
+            {
+            case '"': s += '"'; break;
+            case '\\': s += '\\'; break;
+            case '/': s += '/'; break;
+            case 'b': s += '\b'; break;
+            case 'f': s += '\f'; break;
+            case 'n': s += '\n'; break;
+            case 'r': s += '\r'; break;
+            case 't': s += '\t'; break;
+            case 'u':
+            {
+                uint32_t code;
+                if (!hex4(q, end, code))
+                    return false;
+                q += 4;
+                // 代理对：高位后面必须紧跟低位
+                if (code >= 0xD800 && code <= 0xDBFF)
+                {
+                    uint32_t low;
+                    if (end - q < 6 || q[0] != '\\' || q[1] != 'u' || !hex4(q + 2, end, low) || low < 0xDC00 || low > 0xDFFF)
+                        return false;
+                    q += 6;
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                else if (code >= 0xDC00 && code <= 0xDFFF)
+                {
+                    return false;
+                }
+                appendUtf8(s, code);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        out = s;
+        return true;
+    }
+
+    static bool hex4(const char *q, const char *end, uint32_t &code)
+    {
+        if (end - q < 4)
+            return false;
+        code = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char c = q[i];
+            int v;
+            if (c >= '0' && c <= '9')
+                v = c - '0';
+            else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                v = (c | 0x20) - 'a' + 10;
+            else
+                return false;
+            code = code << 4 | v;
+        }
+        return true;
+    }
+
+    static void appendUtf8(pmr::string &s, uint32_t code)
+    {
+        if (code < 0x80)
+        {
+            s += char(code);
+        }
+        else if (code < 0x800)
+        {
+            s += char(0xC0 | code >> 6);
+            s += char(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000)
+        {
+            s += char(0xE0 | code >> 12);
+            s += char(0x80 | (code >> 6 & 0x3F));
+            s += char(0x80 | (code & 0x3F));
+        }
+        else
+        {
+            s += char(0xF0 | code >> 18);
+            s += char(0x80 | (code >> 12 & 0x3F));
+            s += char(0x80 | (code >> 6 & 0x3F));
+            s += char(0x80 | (code & 0x3F));
+        }
+    }
+};
+
+inline bool JsonValue::getString(string_view &out) const
+{
+    if (type() != STRING)
+        return false;
+    const char *after = skipString(p);
+    if (after == nullptr)
+        return false;
+    const char *begin = p + 1;
+    const char *last = after - 1;
+    // 字符串里不允许出现未转义的控制字符
+    if (findControlChar(begin, last) != last)
+        return false;
+    if (findChar2(begin, last, '\\', '\\') == last)
+    {
+        out = string_view(begin, last - begin);
+        return true;
+    }
+    return owner != nullptr && owner->unescape(begin, last, out);
+}
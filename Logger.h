@@ -1,8 +1,19 @@
-#include <fstream>
+#pragma once
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <chrono>
 #include <ctime>
+#include <cstdio>
 #include <cstdarg> // 引入处理可变参数的头文件
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 using namespace std;
 enum Loglevel{
     INFO,
@@ -10,34 +21,313 @@ enum Loglevel{
     ERROR,
 };
 
-#define LOG_INFO(...) logger::logmessage(INFO, __VA_ARGS__);
-#define LOG_WARNING(...) logger::logmessage(WARNING, __VA_ARGS__);
-#define LOG_ERROR(...) logger::logmessage(ERROR, __VA_ARGS__);
+// 低于最小级别的日志只花一次原子读，参数都不会求值
+#define LOG_INFO(...) do { if (logger::enabled(INFO)) logger::logmessage(INFO, __VA_ARGS__); } while (0)
+#define LOG_WARNING(...) do { if (logger::enabled(WARNING)) logger::logmessage(WARNING, __VA_ARGS__); } while (0)
+#define LOG_ERROR(...) do { if (logger::enabled(ERROR)) logger::logmessage(ERROR, __VA_ARGS__); } while (0)
 
+/*
+异步日志：调用线程只把格式化好的消息写进自己线程的无锁环形缓冲区（定长记录），
+后台线程把所有缓冲区里的记录攒成一大块，用一次write()写进一直打开着的日志文件，超过大小时轮转。
+*/
 class logger{
     public:
+    // 环形缓冲区满了时的处理方式
+    enum FullPolicy
+    {
+        DROP,  // 丢弃这条日志并计数，后台线程会补记一条丢弃了多少条
+        BLOCK, // 等待后台线程腾出空间
+    };
+
+    static bool enabled(Loglevel level)
+    {
+        return level >= minLevel().load(memory_order_relaxed);
+    }
+
+    static void setLevel(Loglevel level)
+    {
+        minLevel().store(level, memory_order_relaxed);
+    }
+
+    /*
+    在第一次写日志之前调用。max_bytes为0表示不轮转；轮转时server.log改名为server.log.1，
+    旧的.1改名为.2，依此类推，最多保留max_files个旧文件。
+    */
+    static void configure(const string& path, size_t max_bytes, int max_files, FullPolicy policy)
+    {
+        Backend& b = backend();
+        lock_guard<mutex> lock(b.config_mutex);
+        b.path = path;
+        b.max_bytes = max_bytes;
+        b.max_files = max_files;
+        b.policy.store(policy);
+    }
+
+    __attribute__((format(printf, 2, 3)))
     static void logmessage(Loglevel level, const char * format, ...)
     {
-        ofstream logfile("server.log", ios::app); // out to server.log
-        // 获取当前时间
-        auto now = std::chrono::system_clock::now();
-        auto now_c = std::chrono::system_clock::to_time_t(now);
-        string levelmess;
-        switch(level)
+        Ring& ring = localRing();
+        size_t tail = ring.tail.load(memory_order_relaxed);
+        while (tail - ring.head.load(memory_order_acquire) >= Ring::CAPACITY)
         {
-            case INFO: levelmess = "INFO"; break;
-            case WARNING: levelmess = "WARNING"; break;
-            case ERROR: levelmess = "ERROR"; break;
-            default: break;
-        };
+            if (backend().policy.load(memory_order_relaxed) == DROP)
+            {
+                backend().dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            backend().wakeup.notify_one();
+            this_thread::yield();
+        }
 
+        Record& record = ring.records[tail & (Ring::CAPACITY - 1)];
+        record.time = chrono::system_clock::now();
+        record.level = level;
         va_list args;
         va_start(args, format);
-        char buffer[2048];
-        vsnprintf(buffer, sizeof(buffer), format, args);
+        int n = vsnprintf(record.text, sizeof(record.text), format, args);
         va_end(args);
+        record.length = n < 0 ? 0 : min<size_t>(n, sizeof(record.text) - 1);
+        ring.tail.store(tail + 1, memory_order_release);
+    }
+
+    // 阻塞到调用之前写入的日志都落到文件里
+    static void flush()
+    {
+        Backend& b = backend();
+        unique_lock<mutex> lock(b.flush_mutex);
+        uint64_t target = b.flush_requests.fetch_add(1) + 1;
+        b.wakeup.notify_one();
+        b.flushed.wait(lock, [&b, target] { return b.flush_done >= target; });
+    }
+
+    private:
+    // 定长记录，消息超过text长度时截断
+    struct Record
+    {
+        chrono::system_clock::time_point time;
+        Loglevel level;
+        uint32_t length;
+        char text[496];
+    };
+
+    // 单生产者(写日志的线程)单消费者(后台线程)环形缓冲区
+    struct Ring
+    {
+        static const size_t CAPACITY = 512; // 必须是2的幂
+        alignas(64) atomic<size_t> head{0};
+        alignas(64) atomic<size_t> tail{0};
+        atomic<bool> alive{true}; // 所属线程退出后置为false，后台线程排空后回收
+        Record records[CAPACITY];
+    };
+
+    struct Backend
+    {
+        mutex config_mutex;
+        string path = "server.log";
+        size_t max_bytes = 64 * 1024 * 1024;
+        int max_files = 5;
+        atomic<FullPolicy> policy{DROP};
+
+        mutex rings_mutex; // 只在线程第一次写日志和后台线程每轮扫描时加锁
+        vector<shared_ptr<Ring>> rings;
+        atomic<uint64_t> dropped{0};
+
+        mutex flush_mutex;
+        condition_variable wakeup, flushed;
+        atomic<uint64_t> flush_requests{0};
+        uint64_t flush_done = 0;
+        bool stop = false;
+        thread writer;
+
+        int fd = -1;
+        size_t file_size = 0;
+        string batch;
+        time_t cached_second = 0;
+        char cached_date[32];
+
+        Backend()
+        {
+            batch.reserve(256 * 1024);
+            writer = thread([this] { run(); });
+        }
+
+        ~Backend()
+        {
+            {
+                lock_guard<mutex> lock(flush_mutex);
+                stop = true;
+            }
+            wakeup.notify_one();
+            writer.join();
+            if (fd != -1)
+                close(fd);
+        }
+
+        void run()
+        {
+            uint64_t reported_drops = 0;
+            while (true)
+            {
+                uint64_t requested = flush_requests.load();
+                bool stopping;
+                {
+                    lock_guard<mutex> lock(flush_mutex);
+                    stopping = stop;
+                }
+                drain();
+                uint64_t drops = dropped.load(memory_order_relaxed);
+                if (drops != reported_drops)
+                {
+                    string message = "logger dropped " + to_string(drops - reported_drops) + " messages";
+                    appendLine(chrono::system_clock::now(), WARNING, message.data(), message.size());
+                    reported_drops = drops;
+                }
+                writeBatch();
+                {
+                    lock_guard<mutex> lock(flush_mutex);
+                    flush_done = requested;
+                }
+                flushed.notify_all();
+                if (stopping)
+                    return;
+                unique_lock<mutex> lock(flush_mutex);
+                wakeup.wait_for(lock, chrono::milliseconds(10), [this, requested] {
+                    return stop || flush_requests.load() != requested;
+                });
+            }
+        }
+
+        void drain()
+        {
+            vector<shared_ptr<Ring>> snapshot;
+            {
+                lock_guard<mutex> lock(rings_mutex);
+                snapshot = rings;
+            }
+            for (auto& ring : snapshot)
+            {
+                bool alive = ring->alive.load(memory_order_acquire);
+                size_t head = ring->head.load(memory_order_relaxed);
+                size_t tail = ring->tail.load(memory_order_acquire);
+                for (; head != tail; head++)
+                {
+                    const Record& r = ring->records[head & (Ring::CAPACITY - 1)];
+                    appendLine(r.time, r.level, r.text, r.length);
+                    if (batch.size() >= 192 * 1024)
+                        writeBatch();
+                }
+                ring->head.store(head, memory_order_release);
+                if (!alive)
+                {
+                    lock_guard<mutex> lock(rings_mutex);
+                    for (auto it = rings.begin(); it != rings.end(); ++it)
+                    {
+                        if (*it == ring)
+                        {
+                            rings.erase(it);
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        void appendLine(chrono::system_clock::time_point time, Loglevel level, const char* text, size_t length)
+        {
+            // 日期部分每秒只格式化一次
+            time_t second = chrono::system_clock::to_time_t(time);
+            if (second != cached_second)
+            {
+                struct tm tm_time;
+                localtime_r(&second, &tm_time);
+                strftime(cached_date, sizeof(cached_date), "%Y-%m-%d %H:%M:%S", &tm_time);
+                cached_second = second;
+            }
+            long micros = chrono::duration_cast<chrono::microseconds>(time.time_since_epoch()).count() % 1000000;
+            char prefix[64];
+            const char* levelmess = level == ERROR ? "ERROR" : level == WARNING ? "WARNING" : "INFO";
+            int n = snprintf(prefix, sizeof(prefix), "%s.%06ld [%s] ", cached_date, micros, levelmess);
+            batch.append(prefix, n);
+            batch.append(text, length);
+            batch += '\n';
+        }
+
+        void writeBatch()
+        {
+            if (batch.empty())
+                return;
+            lock_guard<mutex> lock(config_mutex);
+            if (fd == -1 || (max_bytes > 0 && file_size + batch.size() > max_bytes && file_size > 0))
+                openFile(fd != -1);
+            size_t written = 0;
+            while (fd != -1 && written < batch.size())
+            {
+                ssize_t n = write(fd, batch.data() + written, batch.size() - written);
+                if (n <= 0)
+                {
+                    if (n == -1 && errno == EINTR)
+                        continue;
+                    break;
+                }
+                written += n;
+            }
+            file_size += written;
+            batch.clear();
+        }
+
+        void openFile(bool rotate)
+        {
+            if (fd != -1)
+                close(fd);
+            if (rotate && max_files > 0)
+            {
+                for (int i = max_files - 1; i >= 1; i--)
+                    rename((path + "." + to_string(i)).c_str(), (path + "." + to_string(i + 1)).c_str());
+                rename(path.c_str(), (path + ".1").c_str());
+            }
+            else if (rotate)
+            {
+                unlink(path.c_str());
+            }
+            fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+            struct stat st;
+            file_size = (fd != -1 && fstat(fd, &st) == 0) ? st.st_size : 0;
+        }
+    };
 
-        logfile << ctime(&now_c) << " [" << levelmess << "] " << buffer << endl;
-        logfile.close();
+    // 线程退出时只做标记，缓冲区里剩下的日志仍由后台线程写出
+    struct RingHandle
+    {
+        shared_ptr<Ring> ring;
+        ~RingHandle()
+        {
+            if (ring)
+                ring->alive.store(false, memory_order_release);
+        }
+    };
+
+    static atomic<int>& minLevel()
+    {
+        static atomic<int> level(INFO);
+        return level;
+    }
+
+    static Backend& backend()
+    {
+        static Backend instance;
+        return instance;
+    }
+
+    static Ring& localRing()
+    {
+        static thread_local RingHandle handle;
+        if (!handle.ring)
+        {
+            handle.ring = make_shared<Ring>();
+            Backend& b = backend();
+            lock_guard<mutex> lock(b.rings_mutex);
+            b.rings.push_back(handle.ring);
+        }
+        return *handle.ring;
     }
-};
\ No newline at end of file
+};
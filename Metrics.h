@@ -0,0 +1,366 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <cstdio>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+using namespace std;
+
+/*
+常开的运行时指标：每个线程一份直方图和计数器，热路径上只有本线程的relaxed读写，没有共享的原子读改写。
+抓取/metrics时才把所有线程的数据加起来，按Prometheus文本格式输出。
+- 阶段耗时：accept、read、parse、db、send，以及任务在工作线程池中的排队时间
+- 每条路由（Router里注册的方法+路径）的处理耗时和按状态码分类的请求数
+计时用TSC（启动时按steady_clock校准一次），每个采样点只有一次rdtsc、一次乘法和几次本线程内存写。
+*/
+class Metrics
+{
+public:
+    enum Stage
+    {
+        ACCEPT,
+        READ,
+        PARSE,
+        DB,
+        SEND,
+        QUEUE_WAIT,
+        STAGE_COUNT
+    };
+
+    static constexpr int MAX_ROUTES = 1024;
+    static constexpr int UNMATCHED = 0; // 404/405以及超出MAX_ROUTES的路由
+
+    // 对数-线性直方图（HDR风格）：每个2的幂区间再分8个子桶，相对误差不超过12.5%，覆盖1ns到约18分钟
+    class Histogram
+    {
+    public:
+        static const int SUB_BITS = 3;
+        static const int SUB = 1 << SUB_BITS;
+        static const int MAX_EXP = 40;
+        static const int BUCKETS = (MAX_EXP - SUB_BITS + 1) * SUB;
+
+        // 只由所属线程调用
+        void record(uint64_t ns)
+        {
+            bump(buckets[bucketOf(ns)], 1);
+            bump(count, 1);
+            bump(sum, ns);
+        }
+
+        static int bucketOf(uint64_t ns)
+        {
+            if (ns < SUB)
+                return int(ns);
+            int exp = 63 - __builtin_clzll(ns);
+            if (exp >= MAX_EXP)
+                return BUCKETS - 1;
+            int shift = exp - SUB_BITS;
+            return (shift + 1) * SUB + int((ns >> shift) & (SUB - 1));
+        }
+
+        atomic<uint64_t> buckets[BUCKETS] = {};
+        atomic<uint64_t> count{0};
+        atomic<uint64_t> sum{0};
+    };
+
+    struct RouteStats
+    {
+        Histogram latency;
+        atomic<uint64_t> status[6] = {}; // 下标为状态码/100，0放无法归类的
+    };
+
+    // 正在被追踪的请求（见Trace.h）。本线程设置了它时阶段耗时和路由结果也交给它。
+    // 追踪关闭时热路径上只多一次对全局标志的判断，不读线程局部的钩子
+    class TraceHook
+    {
+    public:
+        virtual void span(int stage, uint64_t start, uint64_t end) = 0;
+        virtual void routed(int route, int status, uint64_t start, uint64_t end) = 0;
+
+    protected:
+        ~TraceHook() = default;
+    };
+
+    static TraceHook *traceHook()
+    {
+        return tracing() ? trace_hook : nullptr;
+    }
+
+    static void setTraceHook(TraceHook *hook)
+    {
+        trace_hook = hook;
+    }
+
+    // 是否开启了追踪，由Trace::configure设置
+    static bool tracing()
+    {
+        return tracing_enabled.load(memory_order_relaxed);
+    }
+
+    static void setTracing(bool enabled)
+    {
+        tracing_enabled.store(enabled, memory_order_relaxed);
+    }
+
+    // 当前时间（TSC周期，非x86上为纳秒）
+    static uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static uint64_t toNs(uint64_t ticks)
+    {
+        return uint64_t((unsigned __int128)ticks * clock().mult >> 32);
+    }
+
+    // 记录从start到现在的阶段耗时，返回现在的时间，方便下一个阶段接着计时
+    static uint64_t recordStage(Stage stage, uint64_t start)
+    {
+        uint64_t end = now();
+        local().stages[stage].record(end > start ? toNs(end - start) : 0);
+        if (__builtin_expect(tracing(), 0) && trace_hook != nullptr)
+            trace_hook->span(stage, start, end);
+        return end;
+    }
+
+    static void recordRoute(int route, int status, uint64_t start)
+    {
+        uint64_t end = now();
+        RouteStats &stats = local().route(route);
+        stats.latency.record(end > start ? toNs(end - start) : 0);
+        bump(stats.status[status >= 100 && status < 600 ? status / 100 : 0], 1);
+        if (__builtin_expect(tracing(), 0) && trace_hook != nullptr)
+            trace_hook->routed(route, status, start, end);
+    }
+
+    // 由Router在注册路由时调用，同名路由（例如多个Router实例）共用一个编号
+    static int registerRoute(const string &name)
+    {
+        Registry &r = registry();
+        lock_guard<mutex> lock(r.lock);
+        auto it = r.route_ids.find(name);
+        if (it != r.route_ids.end())
+            return it->second;
+        if (r.route_names.size() >= MAX_ROUTES)
+            return UNMATCHED;
+        int id = int(r.route_names.size());
+        r.route_names.push_back(name);
+        r.route_ids[name] = id;
+        return id;
+    }
+
+    // 提前创建本线程的数据和已注册路由的统计，线程处理第一个请求时不用分配
+    static void prepareThread()
+    {
+        ThreadData &data = local();
+        size_t routes;
+        {
+            Registry &r = registry();
+            lock_guard<mutex> lock(r.lock);
+            routes = r.route_names.size();
+        }
+        for (size_t id = 0; id < routes; id++)
+            data.route(int(id));
+    }
+
+    // registerRoute分配的编号对应的名字（方法+路径）
+    static string routeName(int route)
+    {
+        Registry &r = registry();
+        lock_guard<mutex> lock(r.lock);
+        return route >= 0 && size_t(route) < r.route_names.size() ? r.route_names[route] : "unmatched";
+    }
+
+    // 合并所有线程的数据，输出Prometheus文本格式
+    static string render()
+    {
+        static const char *stage_names[STAGE_COUNT] = {"accept", "read", "parse", "db", "send", "queue_wait"};
+        static const char *status_names[6] = {"other", "1xx", "2xx", "3xx", "4xx", "5xx"};
+        Registry &r = registry();
+        lock_guard<mutex> lock(r.lock);
+
+        string out;
+        out += "# HELP http_stage_duration_seconds Time spent in each request processing stage.\n";
+        out += "# TYPE http_stage_duration_seconds histogram\n";
+        for (int s = 0; s < STAGE_COUNT; s++)
+        {
+            Merged merged;
+            for (ThreadData *t : r.threads)
+                merged.add(t->stages[s]);
+            merged.write(out, "http_stage_duration_seconds", string("stage=\"") + stage_names[s] + "\"");
+        }
+
+        out += "# HELP http_handler_duration_seconds Time spent in the route handler.\n";
+        out += "# TYPE http_handler_duration_seconds histogram\n";
+        string requests;
+        for (size_t id = 0; id < r.route_names.size(); id++)
+        {
+            Merged merged;
+            uint64_t status[6] = {};
+            for (ThreadData *t : r.threads)
+            {
+                RouteStats *stats = t->routes[id].load(memory_order_acquire);
+                if (stats == nullptr)
+                    continue;
+                merged.add(stats->latency);
+                for (int c = 0; c < 6; c++)
+                    status[c] += stats->status[c].load(memory_order_relaxed);
+            }
+            if (merged.count == 0)
+                continue;
+            string label = "route=\"" + escape(r.route_names[id]) + "\"";
+            merged.write(out, "http_handler_duration_seconds", label);
+            for (int c = 0; c < 6; c++)
+            {
+                if (status[c] != 0)
+                    requests += "http_requests_total{" + label + ",code=\"" + status_names[c] + "\"} " + to_string(status[c]) + "\n";
+            }
+        }
+        out += "# HELP http_requests_total Requests by route and status class.\n";
+        out += "# TYPE http_requests_total counter\n";
+        out += requests;
+        return out;
+    }
+
+private:
+    struct ThreadData
+    {
+        Histogram stages[STAGE_COUNT];
+        atomic<RouteStats *> routes[MAX_ROUTES] = {};
+
+        // 每条路由的统计第一次用到时才分配，由本线程发布，抓取线程acquire读取
+        RouteStats &route(int id)
+        {
+            if (id < 0 || id >= MAX_ROUTES)
+                id = UNMATCHED;
+            RouteStats *stats = routes[id].load(memory_order_relaxed);
+            if (stats == nullptr)
+            {
+                stats = new RouteStats();
+                routes[id].store(stats, memory_order_release);
+            }
+            return *stats;
+        }
+    };
+
+    struct Registry
+    {
+        mutex lock;
+        vector<ThreadData *> threads;
+        vector<string> route_names{"unmatched"};
+        unordered_map<string, int> route_ids{{"unmatched", UNMATCHED}};
+    };
+
+    struct Clock
+    {
+        uint64_t mult; // 纳秒 = 周期 * mult >> 32
+    };
+
+    // 抓取时合并的直方图
+    struct Merged
+    {
+        uint64_t buckets[Histogram::BUCKETS] = {};
+        uint64_t count = 0, sum = 0;
+
+        void add(const Histogram &h)
+        {
+            for (int i = 0; i < Histogram::BUCKETS; i++)
+                buckets[i] += h.buckets[i].load(memory_order_relaxed);
+            count += h.count.load(memory_order_relaxed);
+            sum += h.sum.load(memory_order_relaxed);
+        }
+
+        // 只在2的幂边界（从1.024us到约68.7s）输出累计桶，这些边界与子桶对齐所以是精确的
+        void write(string &out, const char *name, const string &label) const
+        {
+            char line[256];
+            uint64_t cumulative = 0;
+            int bucket = 0;
+            for (int exp = 10; exp <= 36; exp++)
+            {
+                int limit = Histogram::bucketOf(uint64_t(1) << exp);
+                for (; bucket < limit; bucket++)
+                    cumulative += buckets[bucket];
+                snprintf(line, sizeof(line), "%s_bucket{%s,le=\"%.9g\"} %llu\n", name, label.c_str(),
+                         double(uint64_t(1) << exp) / 1e9, (unsigned long long)cumulative);
+                out += line;
+            }
+            snprintf(line, sizeof(line), "%s_bucket{%s,le=\"+Inf\"} %llu\n%s_sum{%s} %.9g\n%s_count{%s} %llu\n",
+                     name, label.c_str(), (unsigned long long)count, name, label.c_str(), sum / 1e9,
+                     name, label.c_str(), (unsigned long long)count);
+            out += line;
+        }
+    };
+
+    static inline thread_local TraceHook *trace_hook = nullptr;
+    static inline atomic<bool> tracing_enabled{false};
+
+    // 只有本线程写，所以用load+store代替fetch_add，避免lock前缀
+    static void bump(atomic<uint64_t> &value, uint64_t delta)
+    {
+        value.store(value.load(memory_order_relaxed) + delta, memory_order_relaxed);
+    }
+
+    static Registry &registry()
+    {
+        static Registry r;
+        return r;
+    }
+
+    // 线程第一次记录时注册自己的数据。线程退出后数据保留，计数器不会倒退
+    static ThreadData &local()
+    {
+        thread_local ThreadData *data = nullptr;
+        if (__builtin_expect(data == nullptr, 0))
+        {
+            data = new ThreadData();
+            Registry &r = registry();
+            lock_guard<mutex> lock(r.lock);
+            r.threads.push_back(data);
+        }
+        return *data;
+    }
+
+    static const Clock &clock()
+    {
+        static const Clock c = calibrate();
+        return c;
+    }
+
+    static Clock calibrate()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        auto wall_start = chrono::steady_clock::now();
+        uint64_t tsc_start = __rdtsc();
+        this_thread::sleep_for(chrono::milliseconds(10));
+        uint64_t tsc_end = __rdtsc();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - wall_start).count();
+        return {uint64_t(ns / double(tsc_end - tsc_start) * 4294967296.0)};
+#else
+        return {uint64_t(1) << 32};
+#endif
+    }
+
+    static string escape(const string &s)
+    {
+        string out;
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+                out += '\\';
+            out += c;
+        }
+        return out;
+    }
+};
@@ -0,0 +1,191 @@
+#pragma once
+#include <string_view>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include "TimerWheel.h"
+using namespace std;
+
+// 路由的限流设置，见Router::setRateLimit
+struct RateLimit
+{
+    double rate = 5;            // 每秒补充的令牌数
+    double burst = 10;          // 桶的容量，一个刚出现的客户端可以连续发这么多个请求
+    bool by_ip = true;          // 每个客户端IP一个桶
+    bool by_username = false;   // 每个用户名一个桶（表单或JSON请求体里的username），和IP的桶同时生效
+    size_t max_clients = 65536; // 同时跟踪的客户端数，超过时新客户端不限流
+};
+
+/*
+一条路由的令牌桶，每个客户端（IP或用户名）一个桶。每个请求取一个令牌，桶空了就拒绝，由调用方回429。
+- 桶放在按键哈希分成SHARDS片的开放寻址表里，槽是两个原子字：键和状态，取令牌是对状态的一次CAS，查找和插入都不加锁
+- 状态按GCRA只存一个时间（理论到达时间）：每放行一个请求往后推一个间隔（1/rate秒），它比现在晚不超过burst-1个间隔时放行，
+  不晚于现在时桶是满的。和令牌桶等价，但不用定时补充，也没有按毫秒补充时的取整损失，长期放行的速率就是rate
+- 表里的键不删除：一个桶补满以后和新桶没有区别，新客户端找不到空槽时直接占用探测范围内已经补满的槽（淘汰空闲的客户端）；
+  探测范围内没有可用的槽时放行并计入TABLE_FULL
+竞争时（两个线程同时为同一个新客户端占槽，或者占用空闲槽时原来的客户端正好回来）可能多给或少给一个令牌
+*/
+class RateLimiter
+{
+public:
+    enum Result
+    {
+        LIMITED,    // 桶空了，回了429
+        EVICTED,    // 新客户端占用了空闲客户端的槽
+        TABLE_FULL, // 表里没有位置，没有限流
+        RESULTS
+    };
+
+    static constexpr size_t SHARDS = 16;
+    static constexpr size_t MAX_PROBE = 32;
+
+    explicit RateLimiter(const RateLimit &limit) : limit(limit), start_ms(TimerWheel::nowMs() - 1)
+    {
+        interval_ns = max<uint64_t>(uint64_t(1e9 / max(limit.rate, MIN_RATE)), 1);
+        tolerance_ns = uint64_t((max(limit.burst, 1.0) - 1) * double(interval_ns));
+        // 负载因子不超过1/2，探测序列短
+        size_t per_shard = 64;
+        while (per_shard * SHARDS < limit.max_clients * 2)
+            per_shard *= 2;
+        mask = per_shard - 1;
+        for (Shard &shard : shards)
+            shard.slots.reset(new Slot[per_shard]);
+    }
+
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter &operator=(const RateLimiter &) = delete;
+
+    const RateLimit &getLimit() const
+    {
+        return limit;
+    }
+
+    // 给key对应的客户端取一个令牌。返回0表示放行，否则是桶里攒够一个令牌还要等的秒数（Retry-After）
+    int acquire(uint64_t key)
+    {
+        return acquire(key, TimerWheel::nowMs());
+    }
+
+    // 同上，now_ms是TimerWheel::nowMs()的时间，测试里用来模拟时间流逝
+    int acquire(uint64_t key, int64_t now_ms)
+    {
+        uint64_t now = uint64_t(now_ms - start_ms) * 1000000;
+        Shard &shard = shards[key >> 60 & (SHARDS - 1)];
+        size_t home = size_t(key) & mask;
+        Slot *reusable = nullptr;
+        for (size_t i = 0; i < MAX_PROBE; i++)
+        {
+            Slot &slot = shard.slots[(home + i) & mask];
+            uint64_t k = slot.key.load(memory_order_acquire);
+            if (k == 0)
+            {
+                // 键从不删除，空槽之后不会再有这个键
+                if (slot.key.compare_exchange_strong(k, key, memory_order_acq_rel) || k == key)
+                    return take(slot, now);
+            }
+            if (k == key)
+                return take(slot, now);
+            if (reusable == nullptr && idle(slot.state.load(memory_order_relaxed), now))
+                reusable = &slot;
+        }
+        if (reusable != nullptr)
+        {
+            // 先把状态换成新桶，再把键换成自己的；失败说明别的线程先占用了，这次不限流
+            uint64_t state = reusable->state.load(memory_order_relaxed);
+            uint64_t old_key = reusable->key.load(memory_order_relaxed);
+            if (idle(state, now) && reusable->state.compare_exchange_strong(state, 0, memory_order_acq_rel) &&
+                reusable->key.compare_exchange_strong(old_key, key, memory_order_acq_rel))
+            {
+                count(EVICTED);
+                return take(*reusable, now);
+            }
+        }
+        count(TABLE_FULL);
+        return 0;
+    }
+
+    // 客户端IP（网络字节序的IPv4地址）和用户名分别对应的键，两者不会相同；0不是合法的键
+    static uint64_t ipKey(uint32_t ip)
+    {
+        return mix(uint64_t(ip) | uint64_t(1) << 32);
+    }
+
+    static uint64_t userKey(string_view username)
+    {
+        uint64_t h = 14695981039346656037ull; // FNV-1a
+        for (char c : username)
+            h = (h ^ uint8_t(c)) * 1099511628211ull;
+        return mix(h ^ uint64_t(2) << 56);
+    }
+
+    static uint64_t total(Result result)
+    {
+        return counters[result].load(memory_order_relaxed);
+    }
+
+private:
+    // 状态：理论到达时间，相对start_ms的纳秒；0表示新桶（满的）
+    static constexpr double MIN_RATE = 1.0 / 256;
+
+    struct Slot
+    {
+        atomic<uint64_t> key{0};
+        atomic<uint64_t> state{0};
+    };
+
+    struct alignas(64) Shard
+    {
+        unique_ptr<Slot[]> slots;
+    };
+
+    RateLimit limit;
+    int64_t start_ms;
+    uint64_t interval_ns;  // 补充一个令牌的时间
+    uint64_t tolerance_ns; // 理论到达时间最多比现在晚多少，对应桶的容量
+    size_t mask;
+    Shard shards[SHARDS];
+
+    static inline atomic<uint64_t> counters[RESULTS] = {};
+
+    static void count(Result result)
+    {
+        counters[result].fetch_add(1, memory_order_relaxed);
+    }
+
+    // 已经补满，和新桶没有区别，可以给别的客户端用
+    static bool idle(uint64_t state, uint64_t now)
+    {
+        return state != 0 && state <= now;
+    }
+
+    int take(Slot &slot, uint64_t now)
+    {
+        uint64_t state = slot.state.load(memory_order_relaxed);
+        while (true)
+        {
+            // 别的线程稍晚读到的时间可能比这里的now大一点，max也处理了这种情况
+            uint64_t arrival = max(state, now);
+            if (arrival - now > tolerance_ns)
+            {
+                // 拒绝时不写状态
+                count(LIMITED);
+                uint64_t wait_ns = arrival - now - tolerance_ns;
+                return int(max<uint64_t>((wait_ns + 999999999) / 1000000000, 1));
+            }
+            if (slot.state.compare_exchange_weak(state, arrival + interval_ns, memory_order_relaxed))
+                return 0;
+        }
+    }
+
+    // 键的高位选分片，低位选槽，两者都要均匀
+    static uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ull;
+        x ^= x >> 33;
+        return x != 0 ? x : 1;
+    }
+};
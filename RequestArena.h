@@ -0,0 +1,90 @@
+#pragma once
+#include <memory_resource>
+#include <optional>
+#include "BufferPool.h"
+using namespace std;
+
+/*
+一个连接上请求处理期间的单调分配区：HttpResponse的头和响应体、表单参数、序列化好的待发送响应都从这里分配。
+单个对象的释放什么都不做，发送队列排空时整体释放一次。初始空间是池里的一块，不够时向堆申请更大的块，整体释放时一并归还。
+工作线程处理请求期间用Scope把它设为本线程的当前分配区，HttpResponse等默认从current()分配；
+不在请求处理中（例如loop线程里的408、基准测试）时current()是普通的new/delete。
+*/
+class RequestArena
+{
+public:
+    RequestArena() = default;
+
+    ~RequestArena()
+    {
+        detach();
+    }
+
+    RequestArena(const RequestArena &) = delete;
+    RequestArena &operator=(const RequestArena &) = delete;
+
+    // 用池里的一块作为初始空间（loop线程）
+    void attach(BufferPool *p)
+    {
+        detach();
+        pool = p;
+        block = pool->acquire();
+        resource.emplace(block, BufferPool::BLOCK_SIZE, pmr::new_delete_resource());
+    }
+
+    void detach()
+    {
+        resource.reset();
+        if (block != nullptr)
+            pool->release(block);
+        pool = nullptr;
+        block = nullptr;
+    }
+
+    pmr::memory_resource *get()
+    {
+        if (!resource)
+            resource.emplace(pmr::new_delete_resource());
+        return &*resource;
+    }
+
+    // 之前分配的一切都失效，回到只有初始块的状态
+    void release()
+    {
+        if (resource)
+            resource->release();
+    }
+
+    static pmr::memory_resource *current()
+    {
+        return current_resource != nullptr ? current_resource : pmr::new_delete_resource();
+    }
+
+    // 作用域内本线程的current()是arena
+    class Scope
+    {
+    public:
+        explicit Scope(RequestArena &arena) : previous(current_resource)
+        {
+            current_resource = arena.get();
+        }
+
+        ~Scope()
+        {
+            current_resource = previous;
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        pmr::memory_resource *previous;
+    };
+
+private:
+    BufferPool *pool = nullptr;
+    char *block = nullptr;
+    optional<pmr::monotonic_buffer_resource> resource;
+
+    static inline thread_local pmr::memory_resource *current_resource = nullptr;
+};
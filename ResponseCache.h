@@ -0,0 +1,363 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <coroutine>
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+#include "TimerWheel.h"
+#include "Task.h"
+#include "WorkStealingPool.h"
+using namespace std;
+
+// 路由的响应缓存设置，见Router::addRoute
+struct CachePolicy
+{
+    int64_t ttl_ms = 1000;     // 缓存的响应多久之后重新生成
+    bool use_query = true;     // 查询串是否参与缓存键
+    vector<string> vary;       // 参与缓存键的请求头，同时写进响应的Vary头
+    size_t max_entries = 1024; // 最多缓存多少个不同的键
+    int64_t coalesce_wait_ms = 100; // 同步调用时最多等别的线程填充多久，超时后自己调用处理函数
+};
+
+/*
+一条GET路由的响应缓存。存的是序列化好的字节（PreparedResponse），命中时既不调用处理函数也不再序列化，
+发送时只在后面补上Connection和Date头。
+- 键是路径、查询串（可选）和选定的请求头。按键的哈希分成SHARDS片，每片一把锁
+- 缓存的响应带强ETag（响应体的哈希），请求的If-None-Match匹配时回304
+- 同一个键同时未命中时只有一个线程调用处理函数，其他请求等它填好；已经有过期的旧响应时其他请求先用旧的，不等待。
+  服务器（带Task的serve）里等待的请求挂起成协程，不占工作线程，填好后由填充的线程把它们交回线程池；
+  同步调用时在条件变量上最多等CachePolicy::coalesce_wait_ms
+- 只缓存响应体在内存里的200响应，静态文件和分块响应每次都调用处理函数
+*/
+class ResponseCache
+{
+public:
+    enum Result
+    {
+        HIT,          // 直接用了缓存的响应（包括正在刷新时用旧的）
+        MISS,         // 调用了处理函数
+        COALESCED,    // 等另一个线程调用处理函数填好后用它的结果
+        NOT_MODIFIED, // 回了304（同时也计入上面三者之一）
+        RESULTS
+    };
+
+    static constexpr size_t SHARDS = 16;
+
+    explicit ResponseCache(const CachePolicy &policy)
+        : policy(policy), shard_capacity(max<size_t>(1, policy.max_entries / SHARDS)) {}
+
+    template <class Handler>
+    HttpResponse serve(const HttpRequest &request, const Handler &handler)
+    {
+        return serve(request, handler, nullptr);
+    }
+
+    // 需要等别的线程填充时，task不为空就把等待的协程放进*task并返回空响应，由调用者启动它
+    template <class Handler>
+    HttpResponse serve(const HttpRequest &request, const Handler &handler, Task<HttpResponse> *task)
+    {
+        pmr::string key(RequestArena::current());
+        makeKey(request, key);
+        uint64_t hash = std::hash<string_view>()(string_view(key));
+        Shard &shard = shards[hash % SHARDS];
+        shared_ptr<const PreparedResponse> cached;
+        {
+            unique_lock<mutex> lock(shard.lock);
+            auto it = shard.slots.find(hash);
+            if (it != shard.slots.end() && string_view(it->second.key) != string_view(key))
+            {
+                // 哈希冲突：不缓存这个键
+                lock.unlock();
+                count(MISS);
+                return handler(request);
+            }
+            int64_t now = TimerWheel::nowMs();
+            if (it != shard.slots.end() && it->second.response && (now < it->second.expires_ms || it->second.filling))
+            {
+                cached = it->second.response;
+                count(HIT);
+            }
+            else if (it != shard.slots.end() && it->second.filling)
+            {
+                if (task != nullptr)
+                {
+                    lock.unlock();
+                    *task = waitForFill(request, &handler, shard, hash);
+                    return HttpResponse();
+                }
+                bool filled = shard.filled.wait_for(lock, chrono::milliseconds(policy.coalesce_wait_ms), [&]
+                                                    { auto found = shard.slots.find(hash);
+                                                      return found == shard.slots.end() || !found->second.filling; });
+                auto found = shard.slots.find(hash);
+                if (!filled || found == shard.slots.end() || !found->second.response)
+                {
+                    // 等超时了，或者填的那个线程得到的响应不能缓存：自己调用处理函数
+                    lock.unlock();
+                    count(MISS);
+                    return handler(request);
+                }
+                cached = found->second.response;
+                count(COALESCED);
+            }
+            else
+            {
+                if (it == shard.slots.end() && !makeRoom(shard, now))
+                {
+                    lock.unlock();
+                    count(MISS);
+                    return handler(request);
+                }
+                Slot &slot = shard.slots[hash];
+                slot.key.assign(key.data(), key.size());
+                slot.filling = true;
+            }
+        }
+        if (!cached)
+        {
+            count(MISS);
+            HttpResponse response;
+            try
+            {
+                response = handler(request);
+            }
+            catch (...)
+            {
+                fill(shard, hash, nullptr);
+                throw;
+            }
+            if (response.getStatusCode() != 200 || response.getFile() || response.getChunkedBody())
+            {
+                fill(shard, hash, nullptr);
+                return response;
+            }
+            cached = prepare(response);
+            fill(shard, hash, cached);
+        }
+        return respond(request, cached);
+    }
+
+    static uint64_t total(Result result)
+    {
+        return counters[result].load(memory_order_relaxed);
+    }
+
+private:
+    struct Slot
+    {
+        string key;
+        shared_ptr<const PreparedResponse> response;
+        int64_t expires_ms = 0;
+        bool filling = false;               // 有线程正在调用处理函数
+        vector<coroutine_handle<>> waiters; // 挂起等它填好的请求
+    };
+
+    struct Shard
+    {
+        mutex lock;
+        condition_variable filled;
+        unordered_map<uint64_t, Slot> slots; // 键的哈希 -> 槽，槽里存完整的键用来发现冲突
+    };
+
+    CachePolicy policy;
+    size_t shard_capacity;
+    Shard shards[SHARDS];
+
+    static inline atomic<uint64_t> counters[RESULTS] = {};
+
+    static void count(Result result)
+    {
+        counters[result].fetch_add(1, memory_order_relaxed);
+    }
+
+    void makeKey(const HttpRequest &request, pmr::string &key) const
+    {
+        key.append(request.getPath());
+        if (policy.use_query)
+        {
+            key += '?';
+            key.append(request.getQuery());
+        }
+        for (const string &name : policy.vary)
+        {
+            key += '\0';
+            key.append(request.getHeader(name));
+        }
+    }
+
+    // 分片满了时先清掉过期的槽，还是满的就不缓存这个键
+    bool makeRoom(Shard &shard, int64_t now)
+    {
+        if (shard.slots.size() < shard_capacity)
+            return true;
+        for (auto it = shard.slots.begin(); it != shard.slots.end();)
+        {
+            if (!it->second.filling && it->second.expires_ms <= now)
+                it = shard.slots.erase(it);
+            else
+                ++it;
+        }
+        return shard.slots.size() < shard_capacity;
+    }
+
+    // 处理函数返回后填槽并唤醒等待的线程。response为空表示这次的结果不能缓存，保留旧的响应（如果有）
+    void fill(Shard &shard, uint64_t hash, shared_ptr<const PreparedResponse> response)
+    {
+        vector<coroutine_handle<>> waiters;
+        {
+            lock_guard<mutex> lock(shard.lock);
+            auto it = shard.slots.find(hash);
+            if (it != shard.slots.end())
+            {
+                it->second.filling = false;
+                waiters.swap(it->second.waiters);
+                if (response)
+                {
+                    it->second.response = move(response);
+                    it->second.expires_ms = TimerWheel::nowMs() + policy.ttl_ms;
+                }
+                else if (!it->second.response)
+                {
+                    shard.slots.erase(it);
+                }
+            }
+        }
+        shard.filled.notify_all();
+        for (coroutine_handle<> waiter : waiters)
+            wake(waiter);
+    }
+
+    // 挂起到槽填好为止；已经填好时不挂起
+    struct FillWait
+    {
+        Shard &shard;
+        uint64_t hash;
+
+        bool await_ready() const
+        {
+            return false;
+        }
+
+        bool await_suspend(coroutine_handle<> handle)
+        {
+            lock_guard<mutex> lock(shard.lock);
+            auto it = shard.slots.find(hash);
+            if (it == shard.slots.end() || !it->second.filling)
+                return false;
+            it->second.waiters.push_back(handle);
+            return true;
+        }
+
+        void await_resume() const {}
+    };
+
+    // 等别的线程填好后用它的结果；它的结果不能缓存时自己调用处理函数
+    template <class Handler>
+    Task<HttpResponse> waitForFill(const HttpRequest &request, const Handler *handler, Shard &shard, uint64_t hash)
+    {
+        shared_ptr<const PreparedResponse> cached;
+        bool filling = true;
+        while (filling)
+        {
+            co_await FillWait{shard, hash};
+            lock_guard<mutex> lock(shard.lock);
+            auto found = shard.slots.find(hash);
+            if (found == shard.slots.end())
+                break;
+            cached = found->second.response;
+            // 刚填完又有线程开始刷新，而且还是没有可用的响应
+            filling = !cached && found->second.filling;
+        }
+        if (!cached)
+        {
+            count(MISS);
+            co_return (*handler)(request);
+        }
+        count(COALESCED);
+        co_return respond(request, cached);
+    }
+
+    // 等待的请求各自交给线程池继续（可能要调用处理函数），不在填充的线程里挨个执行；不在线程池里时直接恢复
+    static void wake(coroutine_handle<> waiter)
+    {
+        if (WorkStealingPool *pool = WorkStealingPool::current())
+            pool->submit([waiter]
+                         { waiter.resume(); });
+        else
+            waiter.resume();
+    }
+
+    // 加上ETag和Vary头后序列化
+    shared_ptr<const PreparedResponse> prepare(HttpResponse &response) const
+    {
+        string etag = makeETag(response.getBody());
+        response.setHeader(HttpHeader::ETAG, etag);
+        if (!policy.vary.empty())
+        {
+            string vary;
+            for (const string &name : policy.vary)
+                vary += (vary.empty() ? "" : ", ") + name;
+            response.setHeader(HttpHeader::VARY, vary);
+        }
+        shared_ptr<PreparedResponse> prepared = response.prepare();
+        prepared->etag = move(etag);
+        return prepared;
+    }
+
+    static HttpResponse respond(const HttpRequest &request, const shared_ptr<const PreparedResponse> &cached)
+    {
+        if (etagMatches(request.getHeader(HttpHeader::IF_NONE_MATCH), cached->etag))
+        {
+            count(NOT_MODIFIED);
+            HttpResponse response(304);
+            response.setHeader(HttpHeader::ETAG, cached->etag);
+            return response;
+        }
+        HttpResponse response;
+        response.setPrepared(cached);
+        return response;
+    }
+
+    // 响应体的64位FNV-1a哈希
+    static string makeETag(string_view body)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : body)
+        {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        char buf[24];
+        snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)hash);
+        return buf;
+    }
+
+    // If-None-Match是逗号分隔的ETag列表或者"*"，按弱比较（忽略W/前缀）
+    static bool etagMatches(string_view header, string_view etag)
+    {
+        while (!header.empty())
+        {
+            size_t comma = header.find(',');
+            string_view tag = header.substr(0, comma);
+            header = comma == string_view::npos ? string_view() : header.substr(comma + 1);
+            while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+                tag.remove_prefix(1);
+            while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+                tag.remove_suffix(1);
+            if (tag.substr(0, 2) == "W/")
+                tag.remove_prefix(2);
+            if (tag == "*" || tag == etag)
+                return true;
+        }
+        return false;
+    }
+};
@@ -1,52 +1,477 @@
+#pragma once
 #include "HttpRequest.h"
 #include "HttpResponse.h"
+#include "HttpBody.h"
+#include "ResponseCache.h"
+#include "RateLimiter.h"
+#include "Task.h"
+#include "BlockingExecutor.h"
 #include "Database.h"
+#include "StaticFile.h"
+#include "Metrics.h"
 #include <functional>
+#include <memory>
+#include <vector>
+#include <stdexcept>
 
 using namespace std;
 using HandlerFunc = function<HttpResponse(const HttpRequest &)>;
+// 异步处理函数：协程，可以co_await BlockingExecutor::run等异步操作；request在协程完成前一直有效
+using AsyncHandlerFunc = function<Task<HttpResponse>(const HttpRequest &)>;
 
+/*
+基数树路由：按路径字符逐段匹配，每个节点按方法(HttpRequest::Method)存放处理函数。
+- 静态段按公共前缀压缩，子节点用首字符索引，查找是O(路径长度)且不分配内存
+- ":name" 匹配到下一个'/'为止的一段，"*name" 匹配剩余的全部路径（只能出现在末尾）
+- 匹配到的参数写进HttpRequest，用req.getParam("name")读取
+- 路径存在但方法不匹配时返回405并带Allow头，路径不存在时返回404
+- 每条路由注册时分配一个指标编号，处理耗时和状态码记在这条路由名下
+- 异步路由的处理函数是协程，等待阻塞操作时不占工作线程；routeRequest会同步等它完成，服务器用routeAsync
+- GET路由可以带CachePolicy注册，响应按键缓存一段时间，命中时不调用处理函数（见ResponseCache）
+- 路由可以按客户端IP或用户名限流（setRateLimit），桶空了回429，不调用处理函数（见RateLimiter）
+*/
 class Router
 {
 public:
+    Router() : root(new Node(Node::STATIC, "")) {}
+
     void addRoute(const string &method, const string &path, HandlerFunc handler)
     {
-        routes[method + "|" + path] = handler;
+        HttpRequest::Method m = HttpRequest::parseMethod(method);
+        if (m == HttpRequest::UNKNOWN)
+            throw invalid_argument("Unknown method " + method + " for route " + path);
+        addRoute(m, path, move(handler));
+    }
+
+    void addRoute(HttpRequest::Method method, const string &path, HandlerFunc handler)
+    {
+        if (path.empty() || path[0] != '/')
+            throw invalid_argument("Route must start with '/': " + path);
+        Node *node = insert(path);
+        node->handlers[method] = move(handler);
+        node->route_ids[method] = Metrics::registerRoute(string(HttpRequest::methodName(method)) + " " + path);
+        node->terminal = true;
+    }
+
+    // 带响应缓存的GET路由，HEAD请求共用同一个缓存
+    void addRoute(const string &method, const string &path, HandlerFunc handler, const CachePolicy &cache)
+    {
+        if (HttpRequest::parseMethod(method) != HttpRequest::GET)
+            throw invalid_argument("Only GET routes can be cached: " + method + " " + path);
+        addRoute(HttpRequest::GET, path, move(handler));
+        insert(path)->caches[HttpRequest::GET].reset(new ResponseCache(cache));
+    }
+
+    // 协程处理函数，和同步的路由可以混用
+    void addAsyncRoute(const string &method, const string &path, AsyncHandlerFunc handler)
+    {
+        HttpRequest::Method m = HttpRequest::parseMethod(method);
+        if (m == HttpRequest::UNKNOWN)
+            throw invalid_argument("Unknown method " + method + " for route " + path);
+        // 同步的调用者（routeRequest）在当前线程等协程完成
+        addRoute(m, path, [handler](const HttpRequest &req)
+                 { return syncWait(handler(req)); });
+        insert(path)->async_handlers[m] = move(handler);
+    }
+
+    /*
+    请求体流式交给BodyHandler的路由，用于大的上传：请求头收全后创建处理器，请求体边到边交给它，服务器不缓存整个请求体。
+    请求体已经全部到达的小请求按普通路由处理，一次onData之后onComplete
+    */
+    void addBodyRoute(const string &method, const string &path, BodyHandlerFactory factory)
+    {
+        HttpRequest::Method m = HttpRequest::parseMethod(method);
+        if (m == HttpRequest::UNKNOWN)
+            throw invalid_argument("Unknown method " + method + " for route " + path);
+        addRoute(m, path, [factory](const HttpRequest &req)
+                 {
+            unique_ptr<BodyHandler> handler = factory(req);
+            if (!req.getBody().empty())
+                handler->onData(req.getBody());
+            return handler->onComplete(req); });
+        insert(path)->body_factories[m] = move(factory);
+    }
+
+    // 按客户端限流，可以在注册路由之前或之后调用；HEAD请求没有单独注册时共用GET的限流
+    void setRateLimit(const string &method, const string &path, const RateLimit &limit)
+    {
+        HttpRequest::Method m = HttpRequest::parseMethod(method);
+        if (m == HttpRequest::UNKNOWN)
+            throw invalid_argument("Unknown method " + method + " for route " + path);
+        if (path.empty() || path[0] != '/')
+            throw invalid_argument("Route must start with '/': " + path);
+        insert(path)->limiters[m].reset(new RateLimiter(limit));
+        rate_limited = true;
+    }
+
+    // 有没有限流的路由；没有时调用者不用取客户端地址
+    bool hasRateLimits() const
+    {
+        return rate_limited;
+    }
+
+    // 把以prefix开头的GET/HEAD请求映射到root目录下的文件，例如addStaticRoute("/static/", "./www")
+    void addStaticRoute(const string &prefix, const string &root)
+    {
+        shared_ptr<StaticRoute> route = make_shared<StaticRoute>(root);
+        string pattern = prefix + (prefix.back() == '/' ? "*path" : "/*path");
+        HandlerFunc handler = [route](const HttpRequest &req)
+        { return route->serve(req, req.getParam("path")); };
+        addRoute(HttpRequest::GET, pattern, handler);
+        addRoute(HttpRequest::HEAD, pattern, handler);
+    }
+
+    // client_ip是网络字节序的IPv4地址，0表示不知道，这时不按IP限流
+    HttpResponse routeRequest(HttpRequest &request, uint32_t client_ip = 0)
+    {
+        uint64_t start = Metrics::now();
+        int route = Metrics::UNMATCHED;
+        HttpResponse response = dispatch(request, route, nullptr, client_ip);
+        Metrics::recordRoute(route, response.getStatusCode(), start);
+        return response;
+    }
+
+    // 匹配到异步路由时返回还没开始执行的协程，route为它的指标编号，由调用者在完成时记录；
+    // 其他情况和routeRequest一样生成response并记录指标，返回空的Task
+    Task<HttpResponse> routeAsync(HttpRequest &request, HttpResponse &response, int &route, uint32_t client_ip = 0)
+    {
+        uint64_t start = Metrics::now();
+        route = Metrics::UNMATCHED;
+        Task<HttpResponse> task;
+        response = dispatch(request, route, &task, client_ip);
+        if (!task)
+            Metrics::recordRoute(route, response.getStatusCode(), start);
+        return task;
+    }
+
+    // 请求头收全时调用：匹配到流式路由时返回它的工厂，路径参数留在request里，route为指标编号；否则返回nullptr
+    const BodyHandlerFactory *findBodyRoute(HttpRequest &request, int &route)
+    {
+        const Node *node = match(root.get(), request.getPath(), request);
+        HttpRequest::Method method = request.getMethod();
+        if (node != nullptr && method != HttpRequest::UNKNOWN && node->body_factories[method])
+        {
+            route = node->route_ids[method];
+            return &node->body_factories[method];
+        }
+        request.truncateParams(0);
+        return nullptr;
+    }
+
+    // 流式路由的请求体收完后生成响应，和routeRequest一样计入这条路由的指标
+    HttpResponse completeBody(BodyHandler &handler, const HttpRequest &request, int route)
+    {
+        uint64_t start = Metrics::now();
+        HttpResponse response = handler.onComplete(request);
+        Metrics::recordRoute(route, response.getStatusCode(), start);
+        return response;
     }
 
-    HttpResponse routeRequest(const HttpRequest &request)
+    // 用户名和密码来自表单，或者移动端发来的JSON对象{"username": ..., "password": ...}
+    static void readCredentials(const HttpRequest &req, string &username, string &password)
     {
-        string key = request.getMethodString() + "|" + request.getPath();
-        if (routes.count(key))
+        string_view user, pass;
+        if (req.hasJsonBody())
         {
-            return routes[key](request);
+            JsonReader json(req.getBody());
+            JsonValue root = json.root();
+            root["username"].getString(user);
+            root["password"].getString(pass);
+            username.assign(user.data(), user.size());
+            password.assign(pass.data(), pass.size());
+            return;
         }
-        return HttpResponse::makeErrorResponse(404, "Not Found");
+        FormData form = req.parseFormBody();
+        user = form.get("username");
+        pass = form.get("password");
+        username.assign(user.data(), user.size());
+        password.assign(pass.data(), pass.size());
     }
 
-    void setupDatabaseRoutes(database &db)
+    // 查数据库的部分交给executor，等待期间不占工作线程；凭据缓存命中的登录不用切换线程
+    void setupDatabaseRoutes(database &db, BlockingExecutor &executor)
     {
-        addRoute("POST", "/register", [&db](const HttpRequest &req){
-            auto res = req.parseFormBody();
-            string username = res["username"];
-            string password = res["password"];
-            if (db.registerUser(username, password))
+        addAsyncRoute("POST", "/register", [&db, &executor](const HttpRequest &req) -> Task<HttpResponse> {
+            string username, password;
+            readCredentials(req, username, password);
+            bool ok = co_await executor.run([&]
+                                            { return db.registerUser(username, password); });
+            if (ok)
             {
-                return HttpResponse::makeOkResponse("Register Success");
+                co_return HttpResponse::makeOkResponse("Register Success");
             }
-            return HttpResponse::makeErrorResponse(400, "Register Failed"); });
+            co_return HttpResponse::makeErrorResponse(400, "Register Failed"); });
 
-        addRoute("POST", "/login", [&db](const HttpRequest &req){
-            auto res = req.parseFormBody();
-            string username = res["username"];
-            string password = res["password"];
-            if (db.loginUser(username, password))
+        addAsyncRoute("POST", "/login", [&db, &executor](const HttpRequest &req) -> Task<HttpResponse> {
+            string username, password;
+            readCredentials(req, username, password);
+            uint64_t version;
+            optional<bool> ok = db.loginCached(username, password, version);
+            if (!ok)
+                ok = co_await executor.run([&]
+                                           { return db.loginStored(username, password, version); });
+            if (*ok)
             {
-                return HttpResponse::makeOkResponse("Login Success");
+                co_return HttpResponse::makeOkResponse("Login Success");
             }
-            return HttpResponse::makeErrorResponse(400, "Login Failed"); });
+            co_return HttpResponse::makeErrorResponse(400, "Login Failed"); });
     }
 
 private:
-    unordered_map<string, HandlerFunc> routes;
-};
\ No newline at end of file
+    struct Node
+    {
+        enum Type
+        {
+            STATIC,
+            PARAM,
+            WILDCARD
+        };
+
+        Node(Type type, const string &prefix) : type(type), prefix(prefix) {}
+
+        Type type;
+        string prefix;                     // 静态节点的字面前缀；参数和通配节点为参数名
+        string indices;                    // 每个静态子节点前缀的首字符，与children一一对应
+        vector<unique_ptr<Node>> children; // 静态子节点
+        unique_ptr<Node> param;            // ":name"子节点
+        unique_ptr<Node> wildcard;         // "*name"子节点
+        HandlerFunc handlers[HttpRequest::UNKNOWN];
+        BodyHandlerFactory body_factories[HttpRequest::UNKNOWN]; // addBodyRoute注册的流式处理器
+        unique_ptr<ResponseCache> caches[HttpRequest::UNKNOWN];   // 带CachePolicy注册的路由的响应缓存
+        AsyncHandlerFunc async_handlers[HttpRequest::UNKNOWN];    // addAsyncRoute注册的协程，handlers里同时有同步等待的版本
+        unique_ptr<RateLimiter> limiters[HttpRequest::UNKNOWN];   // setRateLimit设置的限流
+        int route_ids[HttpRequest::UNKNOWN] = {}; // Metrics中的路由编号
+        bool terminal = false; // 至少有一个方法注册在这里
+    };
+
+    unique_ptr<Node> root;
+    bool rate_limited = false;
+
+    // task不为空时异步路由（以及要等别的线程填充缓存的请求）只创建协程放进task，返回的response没有意义
+    HttpResponse dispatch(HttpRequest &request, int &route, Task<HttpResponse> *task, uint32_t client_ip)
+    {
+        const Node *node = match(root.get(), request.getPath(), request);
+        if (node == nullptr)
+            return HttpResponse::makeErrorResponse(404, "Not Found");
+        HttpRequest::Method method = request.getMethod();
+        // HEAD没有单独注册时使用GET的处理函数，响应体由服务器丢弃
+        if (method == HttpRequest::HEAD && !node->handlers[method])
+            method = HttpRequest::GET;
+        if (method != HttpRequest::UNKNOWN && node->handlers[method])
+        {
+            route = node->route_ids[method];
+            if (node->limiters[method])
+            {
+                int wait = checkRateLimit(*node->limiters[method], request, client_ip);
+                if (wait > 0)
+                {
+                    HttpResponse response = HttpResponse::makeErrorResponse(429, "Too Many Requests");
+                    response.setHeader(HttpHeader::RETRY_AFTER, to_string(wait));
+                    return response;
+                }
+            }
+            if (task != nullptr && node->async_handlers[method])
+            {
+                *task = node->async_handlers[method](request);
+                return HttpResponse();
+            }
+            if (node->caches[method])
+                return node->caches[method]->serve(request, node->handlers[method], task);
+            return node->handlers[method](request);
+        }
+        HttpResponse response = HttpResponse::makeErrorResponse(405, "Method Not Allowed");
+        response.setHeader(HttpHeader::ALLOW, allowHeader(node));
+        return response;
+    }
+
+    // 先取IP的桶再取用户名的桶，都有令牌才放行；返回0或者Retry-After的秒数
+    static int checkRateLimit(RateLimiter &limiter, const HttpRequest &request, uint32_t client_ip)
+    {
+        const RateLimit &limit = limiter.getLimit();
+        if (limit.by_ip && client_ip != 0)
+        {
+            int wait = limiter.acquire(RateLimiter::ipKey(client_ip));
+            if (wait > 0)
+                return wait;
+        }
+        if (limit.by_username)
+        {
+            uint64_t key = usernameKey(request);
+            if (key != 0)
+                return limiter.acquire(key);
+        }
+        return 0;
+    }
+
+    // 请求体里username的键，没有用户名时返回0；JSON的值可能需要反转义，要在reader还在的时候算
+    static uint64_t usernameKey(const HttpRequest &request)
+    {
+        string_view user;
+        if (request.hasJsonBody())
+        {
+            JsonReader json(request.getBody());
+            json.root()["username"].getString(user);
+            return user.empty() ? 0 : RateLimiter::userKey(user);
+        }
+        FormData form = request.parseFormBody();
+        user = form.get("username");
+        return user.empty() ? 0 : RateLimiter::userKey(user);
+    }
+
+    static size_t staticRun(const string &path, size_t from)
+    {
+        size_t end = path.find_first_of(":*", from);
+        return (end == string::npos ? path.size() : end) - from;
+    }
+
+    Node *insert(const string &path)
+    {
+        Node *node = root.get();
+        size_t pos = 0;
+        while (true)
+        {
+            if (node->type == Node::STATIC)
+            {
+                // 与节点前缀求公共部分，不完全匹配时把节点一分为二
+                size_t limit = min(node->prefix.size(), staticRun(path, pos));
+                size_t common = 0;
+                while (common < limit && node->prefix[common] == path[pos + common])
+                    common++;
+                if (common < node->prefix.size())
+                    split(node, common);
+                pos += common;
+            }
+            if (pos == path.size())
+                return node;
+
+            char c = path[pos];
+            if (c == ':' || c == '*')
+            {
+                size_t end = c == ':' ? path.find('/', pos) : path.size();
+                if (end == string::npos)
+                    end = path.size();
+                string name = path.substr(pos + 1, end - pos - 1);
+                if (name.empty())
+                    throw invalid_argument("Unnamed parameter in route " + path);
+                unique_ptr<Node> &child = c == ':' ? node->param : node->wildcard;
+                if (!child)
+                    child.reset(new Node(c == ':' ? Node::PARAM : Node::WILDCARD, name));
+                else if (child->prefix != name)
+                    throw invalid_argument("Conflicting parameter name in route " + path);
+                node = child.get();
+                pos = end;
+                continue;
+            }
+            if (node->type == Node::WILDCARD)
+                throw invalid_argument("Wildcard must be the last segment of route " + path);
+
+            size_t idx = node->indices.find(c);
+            if (idx != string::npos)
+            {
+                node = node->children[idx].get();
+                continue;
+            }
+            node->indices += c;
+            node->children.emplace_back(new Node(Node::STATIC, path.substr(pos, staticRun(path, pos))));
+            node = node->children.back().get();
+        }
+    }
+
+    // 把node的前缀在at处截断，后半部分连同原有的子节点和处理函数下移为唯一的子节点
+    static void split(Node *node, size_t at)
+    {
+        unique_ptr<Node> tail(new Node(Node::STATIC, node->prefix.substr(at)));
+        tail->indices = move(node->indices);
+        tail->children = move(node->children);
+        tail->param = move(node->param);
+        tail->wildcard = move(node->wildcard);
+        for (int m = 0; m < HttpRequest::UNKNOWN; m++)
+        {
+            tail->handlers[m] = move(node->handlers[m]);
+            tail->body_factories[m] = move(node->body_factories[m]);
+            tail->caches[m] = move(node->caches[m]);
+            tail->async_handlers[m] = move(node->async_handlers[m]);
+            tail->limiters[m] = move(node->limiters[m]);
+            tail->route_ids[m] = node->route_ids[m];
+        }
+        tail->terminal = node->terminal;
+
+        node->prefix.resize(at);
+        node->indices.assign(1, tail->prefix[0]);
+        node->children.clear();
+        node->children.push_back(move(tail));
+        node->param.reset();
+        node->wildcard.reset();
+        for (int m = 0; m < HttpRequest::UNKNOWN; m++)
+        {
+            node->handlers[m] = nullptr;
+            node->body_factories[m] = nullptr;
+            node->caches[m].reset();
+            node->async_handlers[m] = nullptr;
+            node->limiters[m].reset();
+            node->route_ids[m] = Metrics::UNMATCHED;
+        }
+        node->terminal = false;
+    }
+
+    // 静态优先，其次参数，最后通配；失败时回溯并撤销已记录的参数
+    static const Node *match(const Node *node, string_view path, HttpRequest &request)
+    {
+        size_t saved = request.getParamCount();
+        if (node->type == Node::STATIC)
+        {
+            if (path.substr(0, node->prefix.size()) != node->prefix)
+                return nullptr;
+            path.remove_prefix(node->prefix.size());
+        }
+        else if (node->type == Node::PARAM)
+        {
+            size_t end = path.find('/');
+            if (end == 0)
+                return nullptr;
+            string_view value = path.substr(0, end);
+            request.addParam(node->prefix, value);
+            path.remove_prefix(value.size());
+        }
+        else
+        {
+            request.addParam(node->prefix, path);
+            return node;
+        }
+
+        if (path.empty() && node->terminal)
+            return node;
+        if (!path.empty())
+        {
+            size_t idx = node->indices.find(path[0]);
+            if (idx != string::npos)
+            {
+                if (const Node *found = match(node->children[idx].get(), path, request))
+                    return found;
+            }
+            if (node->param && path[0] != '/')
+            {
+                if (const Node *found = match(node->param.get(), path, request))
+                    return found;
+            }
+        }
+        if (node->wildcard)
+            return match(node->wildcard.get(), path, request);
+        request.truncateParams(saved);
+        return nullptr;
+    }
+
+    static string allowHeader(const Node *node)
+    {
+        string allow;
+        for (int m = 0; m < HttpRequest::UNKNOWN; m++)
+        {
+            if (!node->handlers[m])
+                continue;
+            if (!allow.empty())
+                allow += ", ";
+            allow += HttpRequest::methodName(HttpRequest::Method(m));
+        }
+        return allow;
+    }
+};
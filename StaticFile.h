@@ -0,0 +1,346 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+#include "Logger.h"
+using namespace std;
+
+// 一个已打开的静态文件及其元数据。发送中的响应持有shared_ptr，所以被缓存淘汰后fd也不会提前关闭
+struct StaticFile
+{
+    int fd = -1;
+    size_t size = 0;
+    const char *map = nullptr; // 小文件整个mmap进来，用writev直接发送；大文件为nullptr，走sendfile
+    struct timespec mtime = {};
+    ino_t inode = 0;
+    string content_type;
+    string etag;
+    string last_modified;
+    atomic<int64_t> checked_at{0}; // 上次stat校验的时间(秒)
+
+    ~StaticFile()
+    {
+        if (map != nullptr)
+            munmap(const_cast<char *>(map), size);
+        if (fd != -1)
+            close(fd);
+    }
+};
+
+/*
+文件描述符和元数据的LRU缓存。命中时不需要open/stat，每个文件每秒最多stat一次检查是否被修改。
+*/
+class FileCache
+{
+public:
+    static const size_t MMAP_LIMIT = 64 * 1024; // 不超过这个大小的文件用mmap
+
+    FileCache(const string &root, size_t capacity = 1024) : root(root), capacity(capacity) {}
+
+    // relative以'/'开头且已经检查过没有".."；找不到或不是普通文件时返回nullptr
+    shared_ptr<const StaticFile> get(const string &relative)
+    {
+        string path = root + relative;
+        int64_t now = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        shared_ptr<StaticFile> file;
+        {
+            lock_guard<mutex> lock(cache_mutex);
+            auto it = index.find(path);
+            if (it != index.end())
+            {
+                lru.splice(lru.begin(), lru, it->second);
+                file = it->second->second;
+            }
+        }
+        if (file && file->checked_at.load(memory_order_relaxed) == now)
+            return file;
+
+        struct stat st;
+        if (stat(path.c_str(), &st) == -1 || !S_ISREG(st.st_mode))
+        {
+            if (file)
+                erase(path);
+            return nullptr;
+        }
+        if (file && file->inode == st.st_ino && file->size == size_t(st.st_size) &&
+            file->mtime.tv_sec == st.st_mtim.tv_sec && file->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            file->checked_at.store(now, memory_order_relaxed);
+            return file;
+        }
+
+        file = load(path, now);
+        if (!file)
+            return nullptr;
+        lock_guard<mutex> lock(cache_mutex);
+        auto it = index.find(path);
+        if (it != index.end())
+        {
+            it->second->second = file;
+            lru.splice(lru.begin(), lru, it->second);
+        }
+        else
+        {
+            lru.emplace_front(path, file);
+            index[path] = lru.begin();
+            if (lru.size() > capacity)
+            {
+                index.erase(lru.back().first);
+                lru.pop_back();
+            }
+        }
+        return file;
+    }
+
+    static string contentType(string_view path)
+    {
+        static const unordered_map<string, string> types = {
+            {"html", "text/html; charset=utf-8"}, {"htm", "text/html; charset=utf-8"},
+            {"css", "text/css"}, {"js", "application/javascript"}, {"json", "application/json"},
+            {"txt", "text/plain; charset=utf-8"}, {"xml", "application/xml"},
+            {"png", "image/png"}, {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"},
+            {"gif", "image/gif"}, {"svg", "image/svg+xml"}, {"ico", "image/x-icon"},
+            {"webp", "image/webp"}, {"woff", "font/woff"}, {"woff2", "font/woff2"},
+            {"pdf", "application/pdf"}, {"wasm", "application/wasm"}, {"mp4", "video/mp4"},
+        };
+        size_t dot = path.rfind('.');
+        size_t slash = path.rfind('/');
+        if (dot != string_view::npos && (slash == string_view::npos || dot > slash))
+        {
+            string ext(path.substr(dot + 1));
+            for (auto &c : ext)
+                c = tolower(c);
+            auto it = types.find(ext);
+            if (it != types.end())
+                return it->second;
+        }
+        return "application/octet-stream";
+    }
+
+private:
+    string root;
+    size_t capacity;
+    mutex cache_mutex;
+    list<pair<string, shared_ptr<StaticFile>>> lru;
+    unordered_map<string, list<pair<string, shared_ptr<StaticFile>>>::iterator> index;
+
+    void erase(const string &path)
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        auto it = index.find(path);
+        if (it != index.end())
+        {
+            lru.erase(it->second);
+            index.erase(it);
+        }
+    }
+
+    static shared_ptr<StaticFile> load(const string &path, int64_t now)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return nullptr;
+        auto file = make_shared<StaticFile>();
+        file->fd = fd;
+        struct stat st;
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+            return nullptr;
+        file->size = st.st_size;
+        file->mtime = st.st_mtim;
+        file->inode = st.st_ino;
+        file->checked_at.store(now, memory_order_relaxed);
+        if (file->size > 0 && file->size <= MMAP_LIMIT)
+        {
+            void *map = mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+                file->map = static_cast<const char *>(map);
+        }
+        file->content_type = contentType(path);
+        char etag[64];
+        snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx\"", (unsigned long)st.st_ino, (unsigned long)st.st_size,
+                 (unsigned long)(st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec));
+        file->etag = etag;
+        char date[64];
+        struct tm tm_time;
+        gmtime_r(&st.st_mtim.tv_sec, &tm_time);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm_time);
+        file->last_modified = date;
+        return file;
+    }
+};
+
+/*
+静态文件路由：把路由通配部分的路径映射到文档根目录下的文件。
+支持GET/HEAD、If-None-Match/If-Modified-Since返回304、单段Range请求返回206。
+*/
+class StaticRoute
+{
+public:
+    StaticRoute(const string &root) : cache(root) {}
+
+    // path为相对文档根目录的路径（路由的"*path"部分）
+    HttpResponse serve(const HttpRequest &request, string_view path)
+    {
+        if (!isSafe(path))
+            return HttpResponse::makeErrorResponse(400, "Bad Request");
+        string relative = "/" + string(path.empty() || path[0] != '/' ? path : path.substr(1));
+        if (relative.back() == '/')
+            relative += "index.html";
+        shared_ptr<const StaticFile> file = cache.get(relative);
+        if (!file)
+            return HttpResponse::makeErrorResponse(404, "Not Found");
+
+        HttpResponse response(200);
+        response.setHeader(HttpHeader::CONTENT_TYPE, file->content_type);
+        response.setHeader(HttpHeader::ETAG, file->etag);
+        response.setHeader(HttpHeader::LAST_MODIFIED, file->last_modified);
+        response.setHeader(HttpHeader::ACCEPT_RANGES, "bytes");
+
+        string_view if_none_match = request.getHeader(HttpHeader::IF_NONE_MATCH);
+        if (!if_none_match.empty())
+        {
+            if (matchesEtag(if_none_match, file->etag))
+            {
+                response.setStatusCode(304);
+                return response;
+            }
+        }
+        else if (request.getHeader(HttpHeader::IF_MODIFIED_SINCE) == file->last_modified)
+        {
+            response.setStatusCode(304);
+            return response;
+        }
+
+        size_t offset = 0, length = file->size;
+        string_view range = request.getHeader(HttpHeader::RANGE);
+        if (!range.empty())
+        {
+            int r = parseRange(range, file->size, offset, length);
+            if (r < 0)
+            {
+                HttpResponse error = HttpResponse::makeErrorResponse(416, "Range Not Satisfiable");
+                error.setHeader(HttpHeader::CONTENT_RANGE, "bytes */" + to_string(file->size));
+                return error;
+            }
+            if (r > 0)
+            {
+                response.setStatusCode(206);
+                response.setHeader(HttpHeader::CONTENT_RANGE, "bytes " + to_string(offset) + "-" +
+                                                        to_string(offset + length - 1) + "/" + to_string(file->size));
+            }
+        }
+        response.setFile(file, offset, length);
+        return response;
+    }
+
+private:
+    FileCache cache;
+
+    // 拒绝".."路径段、空字节和反斜杠，不让请求跳出文档根目录
+    static bool isSafe(string_view path)
+    {
+        if (path.find('\0') != string_view::npos || path.find('\\') != string_view::npos)
+            return false;
+        size_t start = 0;
+        while (start <= path.size())
+        {
+            size_t slash = path.find('/', start);
+            string_view segment = path.substr(start, slash == string_view::npos ? string_view::npos : slash - start);
+            if (segment == "..")
+                return false;
+            if (slash == string_view::npos)
+                break;
+            start = slash + 1;
+        }
+        return true;
+    }
+
+    static bool matchesEtag(string_view header, const string &etag)
+    {
+        if (header == "*")
+            return true;
+        // 逗号分隔的列表，弱比较：忽略W/前缀
+        while (!header.empty())
+        {
+            size_t comma = header.find(',');
+            string_view item = header.substr(0, comma);
+            while (!item.empty() && item.front() == ' ')
+                item.remove_prefix(1);
+            while (!item.empty() && item.back() == ' ')
+                item.remove_suffix(1);
+            if (item.substr(0, 2) == "W/")
+                item.remove_prefix(2);
+            if (item == etag)
+                return true;
+            if (comma == string_view::npos)
+                break;
+            header.remove_prefix(comma + 1);
+        }
+        return false;
+    }
+
+    // 解析"bytes=a-b"、"bytes=a-"、"bytes=-n"。返回1表示有效的单段范围，0表示忽略（多段或格式不认识），-1表示无法满足
+    static int parseRange(string_view range, size_t size, size_t &offset, size_t &length)
+    {
+        if (range.substr(0, 6) != "bytes=" || range.find(',') != string_view::npos)
+            return 0;
+        range.remove_prefix(6);
+        size_t dash = range.find('-');
+        if (dash == string_view::npos)
+            return 0;
+        auto number = [](string_view s, size_t &out)
+        {
+            if (s.empty() || s.size() > 18)
+                return false;
+            out = 0;
+            for (char c : s)
+            {
+                if (c < '0' || c > '9')
+                    return false;
+                out = out * 10 + (c - '0');
+            }
+            return true;
+        };
+        size_t first = 0, last = 0;
+        string_view a = range.substr(0, dash), b = range.substr(dash + 1);
+        if (a.empty())
+        {
+            // 最后n个字节
+            if (!number(b, last) || last == 0)
+                return -1;
+            if (size == 0)
+                return -1;
+            first = last >= size ? 0 : size - last;
+            last = size - 1;
+        }
+        else
+        {
+            if (!number(a, first))
+                return 0;
+            if (b.empty())
+                last = size == 0 ? 0 : size - 1;
+            else if (!number(b, last) || last < first)
+                return 0;
+            if (first >= size)
+                return -1;
+            if (last >= size)
+                last = size - 1;
+        }
+        offset = first;
+        length = last - first + 1;
+        return 1;
+    }
+};
@@ -0,0 +1,245 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <semaphore>
+#include <utility>
+using namespace std;
+
+// 挂起的协程在哪里恢复。EventLoop实现它，把恢复放到loop线程里执行
+class Scheduler
+{
+public:
+    virtual ~Scheduler() = default;
+    virtual void schedule(coroutine_handle<> handle) = 0;
+
+    // 本线程上正在运行的协程所属的Scheduler，异步操作挂起时记下它，完成后通过它恢复；为空时在完成操作的线程里直接恢复
+    static Scheduler *current()
+    {
+        return current_scheduler;
+    }
+
+    class Scope
+    {
+    public:
+        explicit Scope(Scheduler *scheduler) : previous(current_scheduler)
+        {
+            current_scheduler = scheduler;
+        }
+
+        ~Scope()
+        {
+            current_scheduler = previous;
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        Scheduler *previous;
+    };
+
+private:
+    static inline thread_local Scheduler *current_scheduler = nullptr;
+};
+
+template <class T>
+class Task;
+
+namespace task_detail
+{
+    struct PromiseBase
+    {
+        coroutine_handle<> continuation;     // co_await这个Task的协程，完成时直接切换过去
+        void (*on_done)(void *) = nullptr;   // 最外层的Task完成时的通知，见Task::start
+        void *done_arg = nullptr;
+        exception_ptr error;
+
+        suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            // 调用on_done之后协程帧随时可能被别的线程销毁，之后不能再访问promise
+            template <class Promise>
+            coroutine_handle<> await_suspend(coroutine_handle<Promise> handle) noexcept
+            {
+                PromiseBase &promise = handle.promise();
+                if (promise.continuation)
+                    return promise.continuation;
+                void (*on_done)(void *) = promise.on_done;
+                void *arg = promise.done_arg;
+                if (on_done != nullptr)
+                    on_done(arg);
+                return noop_coroutine();
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void unhandled_exception()
+        {
+            error = current_exception();
+        }
+    };
+
+    template <class T>
+    struct Promise : PromiseBase
+    {
+        optional<T> value;
+
+        Task<T> get_return_object();
+
+        void return_value(T v)
+        {
+            value.emplace(move(v));
+        }
+
+        T result()
+        {
+            if (error)
+                rethrow_exception(error);
+            return move(*value);
+        }
+    };
+
+    template <>
+    struct Promise<void> : PromiseBase
+    {
+        Task<void> get_return_object();
+
+        void return_void() {}
+
+        void result()
+        {
+            if (error)
+                rethrow_exception(error);
+        }
+    };
+}
+
+/*
+惰性启动的协程：创建后不执行，直到被co_await或者用start启动。
+- 在另一个协程里co_await一个Task时直接切换过去执行，完成后切换回来（对称转移，不经过调度）
+- 最外层的Task由HttpServer用start启动，完成时回调on_done；挂起期间协程帧和连接都归异步操作所有
+- 异步操作（例如BlockingExecutor::run）完成后通过挂起时的Scheduler::current()恢复协程
+*/
+template <class T>
+class Task
+{
+public:
+    using promise_type = task_detail::Promise<T>;
+
+    Task() = default;
+
+    explicit Task(coroutine_handle<promise_type> h) : handle(h) {}
+
+    Task(Task &&other) noexcept : handle(exchange(other.handle, nullptr)) {}
+
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            destroy();
+            handle = exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task()
+    {
+        destroy();
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    explicit operator bool() const
+    {
+        return bool(handle);
+    }
+
+    bool done() const
+    {
+        return handle && handle.done();
+    }
+
+    // 在当前线程开始执行，直到第一次挂起或者完成；完成时（可能在别的线程）调用on_done(arg)
+    void start(void (*on_done)(void *), void *arg)
+    {
+        handle.promise().on_done = on_done;
+        handle.promise().done_arg = arg;
+        handle.resume();
+    }
+
+    // 完成之后取结果，处理函数抛出的异常在这里重新抛出
+    T result()
+    {
+        return handle.promise().result();
+    }
+
+    bool await_ready() const noexcept
+    {
+        return !handle || handle.done();
+    }
+
+    coroutine_handle<> await_suspend(coroutine_handle<> caller) noexcept
+    {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+
+    T await_resume()
+    {
+        return result();
+    }
+
+private:
+    coroutine_handle<promise_type> handle;
+
+    void destroy()
+    {
+        if (handle)
+            handle.destroy();
+        handle = nullptr;
+    }
+};
+
+namespace task_detail
+{
+    template <class T>
+    Task<T> Promise<T>::get_return_object()
+    {
+        return Task<T>(coroutine_handle<Promise<T>>::from_promise(*this));
+    }
+
+    inline Task<void> Promise<void>::get_return_object()
+    {
+        return Task<void>(coroutine_handle<Promise<void>>::from_promise(*this));
+    }
+}
+
+// 在当前线程等一个Task完成，不经过事件循环：异步操作在完成它的线程里直接恢复协程。给同步的调用者用（例如Router::routeRequest）
+template <class T>
+T syncWait(Task<T> task)
+{
+    binary_semaphore finished(0);
+    Scheduler::Scope inline_resume(nullptr);
+    task.start([](void *arg)
+               { static_cast<binary_semaphore *>(arg)->release(); },
+               &finished);
+    finished.acquire();
+    return task.result();
+}
@@ -1,3 +1,4 @@
+#pragma once
 #include <vector>             // 引入标准向量容器，用于存储工作线程
 #include <queue>              // 引入标准队列容器，用于存储待执行的任务
 #include <thread>             // 引入线程库，用于创建和管理线程
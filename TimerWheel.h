@@ -0,0 +1,156 @@
+#pragma once
+#include <cstdint>
+#include <chrono>
+using namespace std;
+
+// 挂在定时轮上的侵入式节点，嵌在被定时的对象里，定时轮本身不分配内存
+struct TimerNode
+{
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0; // 到期的tick
+    void *data = nullptr; // 指回所属对象
+
+    bool linked() const
+    {
+        return prev != nullptr;
+    }
+};
+
+/*
+分层定时轮（Varghese & Lauck）：4层、每层64个槽，一个tick为TICK_MS毫秒。
+第0层覆盖0.64秒，第1层41秒，第2层约44分钟，第3层约47小时，更远的定时器放在最后一层。
+arm/cancel都是链表的O(1)插入和摘除，advance时只有跨越上层槽位边界才把那一槽的节点下放。
+只能在所属EventLoop的线程里使用。
+*/
+class TimerWheel
+{
+public:
+    static const int64_t TICK_MS = 10;
+
+    TimerWheel() : current(nowMs() / TICK_MS), count(0)
+    {
+        for (int level = 0; level < LEVELS; level++)
+        {
+            for (int slot = 0; slot < SLOTS; slot++)
+            {
+                wheel[level][slot].prev = wheel[level][slot].next = &wheel[level][slot];
+            }
+        }
+    }
+
+    static int64_t nowMs()
+    {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // 在绝对时间deadline_ms到期；已经在轮上的节点会先被摘下（即重新设定）
+    void arm(TimerNode *node, int64_t deadline_ms)
+    {
+        cancel(node);
+        uint64_t tick = deadline_ms / TICK_MS;
+        node->expires = tick > current ? tick : current + 1;
+        place(node);
+        count++;
+    }
+
+    void cancel(TimerNode *node)
+    {
+        if (!node->linked())
+            return;
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+        count--;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    // 距离下一次需要advance的毫秒数，没有定时器时返回-1，可以直接作为epoll_wait的超时
+    int nextTimeoutMs() const
+    {
+        if (count == 0)
+            return -1;
+        // 第0层中下一个非空槽；没有的话至少要在第0层转完一圈时下放上层的定时器
+        uint64_t ticks = SLOTS - (current & (SLOTS - 1));
+        for (uint64_t i = 1; i <= SLOTS; i++)
+        {
+            const TimerNode &head = wheel[0][(current + i) & (SLOTS - 1)];
+            if (head.next != &head)
+            {
+                ticks = i;
+                break;
+            }
+        }
+        int64_t wait = int64_t((current + ticks) * TICK_MS) - nowMs();
+        return wait > 0 ? int(wait) : 0;
+    }
+
+    // 推进到当前时间，对每个到期的节点调用onExpire(node)；回调里可以重新arm这个节点
+    template <class F>
+    void advance(F onExpire)
+    {
+        uint64_t target = nowMs() / TICK_MS;
+        while (current < target)
+        {
+            current++;
+            // 第0层转完一圈时，把上层对应槽的节点按新的剩余时间重新分配
+            for (int level = 1; level < LEVELS; level++)
+            {
+                if ((current & ((uint64_t(1) << (BITS * level)) - 1)) != 0)
+                    break;
+                cascade(level, (current >> (BITS * level)) & (SLOTS - 1));
+            }
+            TimerNode &head = wheel[0][current & (SLOTS - 1)];
+            while (head.next != &head)
+            {
+                TimerNode *node = head.next;
+                cancel(node);
+                onExpire(node);
+            }
+        }
+    }
+
+private:
+    static const int BITS = 6;
+    static const int SLOTS = 1 << BITS;
+    static const int LEVELS = 4;
+
+    TimerNode wheel[LEVELS][SLOTS]; // 每个槽是一个带哨兵的循环双向链表
+    uint64_t current;               // 当前tick
+    size_t count;
+
+    void place(TimerNode *node)
+    {
+        uint64_t delta = node->expires - current;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (uint64_t(1) << (BITS * (level + 1))))
+            level++;
+        uint64_t expires = node->expires;
+        // 超出最后一层范围的定时器放在最后一层最远的槽，下放时再重新计算
+        if (level == LEVELS - 1 && delta >= (uint64_t(1) << (BITS * LEVELS)))
+            expires = current + (uint64_t(1) << (BITS * LEVELS)) - 1;
+        TimerNode &head = wheel[level][(expires >> (BITS * level)) & (SLOTS - 1)];
+        node->next = &head;
+        node->prev = head.prev;
+        head.prev->next = node;
+        head.prev = node;
+    }
+
+    void cascade(int level, uint64_t slot)
+    {
+        TimerNode &head = wheel[level][slot];
+        while (head.next != &head)
+        {
+            TimerNode *node = head.next;
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+            if (node->expires <= current)
+                node->expires = current; // 本tick内到期，放进第0层当前槽马上处理
+            place(node);
+        }
+    }
+};
@@ -0,0 +1,363 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+#include "Metrics.h"
+using namespace std;
+
+/*
+抽样的请求追踪。被抽中的请求得到一个编号，处理过程中各阶段的起止时间（TSC）写进当前线程的环形缓冲区：
+排队、读取、解析、数据库、发送沿用Metrics的计时点，另外记录处理函数（路由）和整个请求。
+- 每个线程一个固定大小的环，只有本线程写，写满后覆盖最旧的事件；导出时按槽上的序号跳过正在被覆盖的事件
+- renderChrome把所有线程最近的事件导出为Chrome trace-event JSON（chrome://tracing或Perfetto打开）
+- 超过slow_ms的抽样请求再往slow_log写一行JSON（JSONL），带各阶段耗时
+没有开启时，开始处理连接时只判断一次开关；各个计时点只多一次本线程指针的判断
+*/
+class Trace
+{
+public:
+    // 前几个和Metrics::Stage一一对应
+    enum Span
+    {
+        HANDLER = Metrics::STAGE_COUNT, // 路由的处理函数
+        REQUEST,                        // 整个请求：从工作线程开始处理到响应第一次发送
+        SPAN_COUNT
+    };
+
+    struct Options
+    {
+        uint32_t sample_every = 0; // 每N个请求追踪一个，0表示关闭
+        uint64_t slow_ms = 0;      // 抽样请求超过这个耗时写进slow_log，0表示不写
+        string slow_log = "slow.jsonl";
+    };
+
+    static constexpr size_t RING_SIZE = 4096; // 每个线程保留的事件数
+
+    // 在处理请求之前调用
+    static void configure(const Options &options)
+    {
+        State &s = state();
+        lock_guard<mutex> lock(s.lock);
+        if (s.slow_file != nullptr)
+            fclose(s.slow_file);
+        s.slow_file = nullptr;
+        if (options.sample_every != 0 && options.slow_ms != 0)
+        {
+            s.slow_file = fopen(options.slow_log.c_str(), "a");
+            if (s.slow_file == nullptr)
+                perror("fopen slow log");
+        }
+        s.slow_ns = options.slow_ms * 1000000;
+        sample_every.store(options.sample_every, memory_order_relaxed);
+        Metrics::setTracing(options.sample_every != 0);
+    }
+
+    static bool enabled()
+    {
+        return Metrics::tracing();
+    }
+
+    // 是否追踪下一个请求，每个线程各自计数
+    static bool sample()
+    {
+        static thread_local uint32_t counter = 0;
+        uint32_t every = sample_every.load(memory_order_relaxed);
+        if (every == 0 || ++counter < every)
+            return false;
+        counter = 0;
+        return true;
+    }
+
+    static uint64_t nextId()
+    {
+        return next_id.fetch_add(1, memory_order_relaxed);
+    }
+
+    // 写进当前线程的环；arg和status只对HANDLER和REQUEST有意义（路由编号和状态码）
+    static void record(uint64_t id, int span, uint64_t start, uint64_t end, uint32_t arg = 0, uint32_t status = 0)
+    {
+        Ring &ring = local();
+        uint64_t i = ring.head.load(memory_order_relaxed);
+        Event &e = ring.events[i % RING_SIZE];
+        // 序号为奇数表示正在写
+        e.seq.store(2 * i + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        e.id.store(id, memory_order_relaxed);
+        e.start.store(start, memory_order_relaxed);
+        e.end.store(end, memory_order_relaxed);
+        e.info.store(uint64_t(span) | uint64_t(status) << 8 | uint64_t(arg) << 32, memory_order_relaxed);
+        e.seq.store(2 * i + 2, memory_order_release);
+        ring.head.store(i + 1, memory_order_relaxed);
+    }
+
+    static const char *spanName(int span)
+    {
+        static_assert(SPAN_COUNT == 8 && Metrics::QUEUE_WAIT == 5, "span names follow Metrics::Stage");
+        static const char *names[SPAN_COUNT] = {"accept", "read", "parse", "db", "send", "queue_wait", "handler", "request"};
+        return span >= 0 && span < SPAN_COUNT ? names[span] : "unknown";
+    }
+
+    // 所有线程环里的事件，Chrome trace-event JSON格式，时间以第一个事件为起点
+    static string renderChrome()
+    {
+        struct Copy
+        {
+            int tid;
+            uint64_t id, start, end, info;
+        };
+        vector<Copy> events;
+        {
+            State &s = state();
+            lock_guard<mutex> lock(s.lock);
+            for (Ring *ring : s.rings)
+            {
+                for (Event &e : ring->events)
+                {
+                    uint64_t seq = e.seq.load(memory_order_acquire);
+                    if (seq == 0 || seq % 2 == 1)
+                        continue;
+                    Copy c{ring->tid, e.id.load(memory_order_relaxed), e.start.load(memory_order_relaxed),
+                           e.end.load(memory_order_relaxed), e.info.load(memory_order_relaxed)};
+                    atomic_thread_fence(memory_order_acquire);
+                    if (e.seq.load(memory_order_relaxed) == seq)
+                        events.push_back(c);
+                }
+            }
+        }
+        uint64_t origin = UINT64_MAX;
+        for (const Copy &c : events)
+            origin = min(origin, c.start);
+        vector<string> routes;
+        string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        char line[256];
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            const Copy &c = events[i];
+            int span = int(c.info & 0xFF);
+            uint32_t status = uint32_t(c.info >> 8 & 0xFFFFFF);
+            uint32_t route = uint32_t(c.info >> 32);
+            double ts = Metrics::toNs(c.start - origin) / 1000.0;
+            double dur = Metrics::toNs(c.end > c.start ? c.end - c.start : 0) / 1000.0;
+            snprintf(line, sizeof(line), "%s\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"trace_id\":%llu",
+                     i == 0 ? "" : ",", spanName(span), c.tid, ts, dur, (unsigned long long)c.id);
+            out += line;
+            if (span == HANDLER || span == REQUEST)
+            {
+                if (routes.size() <= route)
+                    routes.resize(route + 1);
+                if (routes[route].empty())
+                    routes[route] = Metrics::routeName(int(route));
+                out += ",\"route\":\"";
+                appendEscaped(out, routes[route]);
+                out += "\",\"status\":" + to_string(status);
+            }
+            out += "}}";
+        }
+        out += "\n]}\n";
+        return out;
+    }
+
+    // 抽样请求的耗时是否达到了写慢请求日志的阈值
+    static bool isSlow(uint64_t ns)
+    {
+        uint64_t limit = state().slow_ns;
+        return limit != 0 && ns >= limit;
+    }
+
+    static void writeSlow(const string &line)
+    {
+        State &s = state();
+        lock_guard<mutex> lock(s.lock);
+        if (s.slow_file == nullptr)
+            return;
+        fwrite(line.data(), 1, line.size(), s.slow_file);
+        fflush(s.slow_file);
+    }
+
+    static void appendEscaped(string &out, string_view s)
+    {
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+    }
+
+private:
+    struct Event
+    {
+        atomic<uint64_t> seq{0}; // 2*序号+2表示写完，奇数表示正在写
+        atomic<uint64_t> id{0};
+        atomic<uint64_t> start{0};
+        atomic<uint64_t> end{0};
+        atomic<uint64_t> info{0}; // span | status << 8 | arg << 32
+    };
+
+    struct Ring
+    {
+        int tid = 0;
+        atomic<uint64_t> head{0};
+        Event events[RING_SIZE];
+    };
+
+    struct State
+    {
+        mutex lock;
+        vector<Ring *> rings;
+        FILE *slow_file = nullptr;
+        uint64_t slow_ns = 0;
+    };
+
+    static inline atomic<uint32_t> sample_every{0};
+    static inline atomic<uint64_t> next_id{1};
+
+    static State &state()
+    {
+        static State s;
+        return s;
+    }
+
+    // 线程第一次记录时分配自己的环，线程退出后保留，导出时还能看到
+    static Ring &local()
+    {
+        thread_local Ring *ring = nullptr;
+        if (__builtin_expect(ring == nullptr, 0))
+        {
+            Ring *created = new Ring();
+            State &s = state();
+            lock_guard<mutex> lock(s.lock);
+            created->tid = int(s.rings.size()) + 1;
+            s.rings.push_back(created);
+            ring = created;
+        }
+        return *ring;
+    }
+};
+
+/*
+一个被追踪的请求，放在Connection里。工作线程处理这个连接时用Scope把它设为本线程的Metrics::TraceHook，
+各个计时点的耗时就记到它名下；BlockingExecutor执行阻塞操作时把它带到执行器线程上
+*/
+class TraceContext : public Metrics::TraceHook
+{
+public:
+    uint64_t id = 0;    // 0表示没有在追踪
+    bool ended = false; // 响应已经排进发送队列，等这一轮发送后结束
+
+    // 开始追踪下一个请求，start是loop发现连接可读的时间
+    void begin(uint64_t start_ticks)
+    {
+        id = Trace::nextId();
+        ended = false;
+        start = start_ticks;
+        route = Metrics::UNMATCHED;
+        status = 0;
+        for (uint64_t &ns : span_ns)
+            ns = 0;
+    }
+
+    void span(int stage, uint64_t from, uint64_t to) override
+    {
+        Trace::record(id, stage, from, to);
+        if (stage >= 0 && stage < Trace::SPAN_COUNT)
+            span_ns[stage] += Metrics::toNs(to > from ? to - from : 0);
+    }
+
+    void routed(int route_id, int code, uint64_t from, uint64_t to) override
+    {
+        route = route_id;
+        status = code;
+        Trace::record(id, Trace::HANDLER, from, to, uint32_t(route_id), uint32_t(code));
+        span_ns[Trace::HANDLER] += Metrics::toNs(to > from ? to - from : 0);
+    }
+
+    // 请求处理完（响应已经排队），记下慢日志要用的请求行
+    void endRequest(string_view request_method, string_view request_path)
+    {
+        ended = true;
+        method.assign(request_method.data(), request_method.size());
+        path.assign(request_path.data(), request_path.size());
+    }
+
+    // 这一轮的发送完成后结束追踪：记录整个请求，超过阈值时写慢请求日志
+    void finish(uint64_t end_ticks)
+    {
+        Trace::record(id, Trace::REQUEST, start, end_ticks, uint32_t(route), uint32_t(status));
+        uint64_t total = Metrics::toNs(end_ticks > start ? end_ticks - start : 0);
+        if (Trace::isSlow(total))
+            logSlow(total);
+        id = 0;
+        ended = false;
+    }
+
+    // 在本线程上把它设为当前追踪的请求，析构时恢复
+    class Scope
+    {
+    public:
+        explicit Scope(Metrics::TraceHook *hook) : previous(Metrics::traceHook())
+        {
+            Metrics::setTraceHook(hook);
+        }
+
+        ~Scope()
+        {
+            Metrics::setTraceHook(previous);
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        Metrics::TraceHook *previous;
+    };
+
+private:
+    uint64_t start = 0;
+    int route = Metrics::UNMATCHED;
+    int status = 0;
+    uint64_t span_ns[Trace::SPAN_COUNT] = {};
+    string method;
+    string path;
+
+    void logSlow(uint64_t total_ns)
+    {
+        string line = "{\"time\":" + to_string(time(nullptr)) + ",\"trace_id\":" + to_string(id) + ",\"method\":\"";
+        Trace::appendEscaped(line, method);
+        line += "\",\"path\":\"";
+        Trace::appendEscaped(line, path);
+        line += "\",\"route\":\"";
+        Trace::appendEscaped(line, Metrics::routeName(route));
+        line += "\",\"status\":" + to_string(status) + ",\"duration_us\":" + to_string(total_ns / 1000) + ",\"spans_us\":{";
+        bool first = true;
+        for (int i = 0; i < Trace::REQUEST; i++)
+        {
+            if (i == Metrics::ACCEPT)
+                continue;
+            line += first ? "\"" : ",\"";
+            line += Trace::spanName(i);
+            line += "\":" + to_string(span_ns[i] / 1000);
+            first = false;
+        }
+        line += "}}\n";
+        Trace::writeSlow(line);
+    }
+};
@@ -0,0 +1,584 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include "IoBackend.h"
+#include "Logger.h"
+#include "Metrics.h"
+using namespace std;
+
+/*
+io_uring后端，直接用io_uring_setup/io_uring_enter/io_uring_register系统调用和mmap出来的环，不依赖liburing。
+- 监听套接字上挂一个multishot accept，一次提交持续产生新连接；因为fd用完等错误结束时，用超时操作退避一段时间再重新提交
+- recv从注册的provided buffer ring里取缓冲区，loop把数据拷进conn->input后立刻归还缓冲区，再交给工作线程
+- 工作线程不做任何系统调用：响应交回loop，用sendmsg(MSG_WAITALL)提交，发完整个队列时链接(IOSQE_IO_LINK)下一个recv
+- 每轮poll只有一次io_uring_enter，同时提交这一轮积累的所有操作并等待完成事件
+- 大文件段没有对应的sendfile操作，由loop用非阻塞sendfile发送，缓冲区满时用POLL_ADD等待可写
+每个连接记录进行中的操作数，关闭时先shutdown让它们结束，全部完成后才关闭fd、释放连接。
+*/
+class UringBackend : public IoBackend
+{
+public:
+    static const unsigned ENTRIES = 1024;
+    static const unsigned BUFFER_COUNT = 256; // 必须是2的幂
+    static const unsigned BUFFER_SIZE = 16 * 1024;
+    static const uint16_t BUFFER_GROUP = 0;
+
+    ~UringBackend()
+    {
+        if (buffers != nullptr)
+            munmap(buffers, size_t(BUFFER_COUNT) * BUFFER_SIZE);
+        if (buf_ring != nullptr)
+            munmap(buf_ring, BUFFER_COUNT * sizeof(struct io_uring_buf));
+        if (sqes != nullptr)
+            munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+        if (ring_ptr != nullptr)
+            munmap(ring_ptr, ring_size);
+        if (ring_fd != -1)
+            close(ring_fd);
+    }
+
+    // 内核是否支持这个后端用到的全部特性（multishot accept和buffer ring需要5.19以上），结果只探测一次
+    static bool available()
+    {
+        static const bool ok = probe();
+        return ok;
+    }
+
+    const char *name() const override
+    {
+        return "io_uring";
+    }
+
+    bool open(int listen, int wakeup, IoHandler *h) override
+    {
+        listen_fd = listen;
+        wakeup_fd = wakeup;
+        handler = h;
+        // 只有loop线程提交，可以让内核把完成处理推迟到io_uring_enter里，减少中断上下文的工作
+        if (!setupRing(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) && !setupRing(0))
+            return false;
+        if (!setupBuffers())
+            return false;
+        submitAccept();
+        submitWakeup();
+        return true;
+    }
+
+    void poll(int timeout_ms) override
+    {
+        // 上一轮缓冲区不够时没提交的recv
+        if (!starved.empty())
+        {
+            vector<Connection *> retry;
+            retry.swap(starved);
+            for (Connection *conn : retry)
+            {
+                conn->io_pending--;
+                if (conn->io_closing)
+                    maybeRelease(conn);
+                else
+                    submitRecv(conn);
+            }
+        }
+        bool ready = *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        enter(true, ready ? 0 : timeout_ms);
+        reapCompletions();
+    }
+
+    bool add(Connection *conn) override
+    {
+        submitRecv(conn);
+        return true;
+    }
+
+    bool armFromAnyThread() const override
+    {
+        return false;
+    }
+
+    bool arm(Connection *conn, bool want_write) override
+    {
+        if (want_write)
+            submitOutput(conn);
+        else
+            submitRecv(conn);
+        return true;
+    }
+
+    void release(Connection *conn) override
+    {
+        conn->io_closing = true;
+        if (conn->io_pending == 0)
+        {
+            close(conn->fd);
+            handler->onReleased(conn);
+            return;
+        }
+        // 让进行中的recv/send/poll尽快以0或错误完成
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+
+    // 数据已经在分发前由loop收进conn->input
+    RecvResult receive(Connection *conn) override
+    {
+        return RecvResult(conn->io_result);
+    }
+
+    // 发送由loop在arm(want_write)时提交
+    bool send(Connection *) override
+    {
+        return true;
+    }
+
+private:
+    enum Tag
+    {
+        TAG_ACCEPT = 1,
+        TAG_WAKEUP,
+        TAG_RECV,
+        TAG_SEND,
+        TAG_POLLOUT,
+        TAG_ACCEPT_RETRY // 退避结束，重新提交accept
+    };
+
+    int ring_fd = -1;
+    void *ring_ptr = nullptr;
+    size_t ring_size = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    unsigned sq_entries = 0, sq_mask = 0, sqe_tail = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr, cq_mask = 0;
+    struct io_uring_cqe *cqes = nullptr;
+
+    struct io_uring_buf_ring *buf_ring = nullptr;
+    char *buffers = nullptr;
+    uint16_t buf_tail = 0;
+
+    int listen_fd = -1, wakeup_fd = -1;
+    IoHandler *handler = nullptr;
+    vector<Connection *> starved;
+    struct __kernel_timespec accept_retry_at = {};
+
+    static int setup(unsigned entries, struct io_uring_params *p)
+    {
+        return int(syscall(__NR_io_uring_setup, entries, p));
+    }
+
+    static int registerOp(int fd, unsigned opcode, void *arg, unsigned nr_args)
+    {
+        return int(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+    }
+
+    static bool probe()
+    {
+        struct io_uring_params p = {};
+        int fd = setup(8, &p);
+        if (fd < 0)
+            return false;
+        unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        bool ok = (p.features & needed) == needed;
+        size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        struct io_uring_probe *ops = static_cast<struct io_uring_probe *>(calloc(1, probe_size));
+        if (ok && registerOp(fd, IORING_REGISTER_PROBE, ops, 256) == 0)
+        {
+            for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD})
+                ok = ok && op <= ops->last_op && (ops->ops[op].flags & IO_URING_OP_SUPPORTED);
+        }
+        else
+        {
+            ok = false;
+        }
+        free(ops);
+        // buffer ring和multishot accept同在5.19加入，能注册buffer ring就说明两者都支持
+        if (ok)
+        {
+            void *ring = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            struct io_uring_buf_reg reg = {};
+            reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+            reg.ring_entries = 1;
+            ok = ring != MAP_FAILED && registerOp(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+            if (ring != MAP_FAILED)
+                munmap(ring, 4096);
+        }
+        close(fd);
+        return ok;
+    }
+
+    bool setupRing(unsigned flags)
+    {
+        struct io_uring_params p = {};
+        p.flags = flags;
+        ring_fd = setup(ENTRIES, &p);
+        if (ring_fd < 0)
+            return false;
+        size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        ring_size = max(sq_size, cq_size);
+        ring_ptr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, p.sq_entries * sizeof(struct io_uring_sqe),
+                                                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (ring_ptr == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            ring_ptr = nullptr;
+            sqes = nullptr;
+            close(ring_fd);
+            ring_fd = -1;
+            return false;
+        }
+        char *base = static_cast<char *>(ring_ptr);
+        sq_entries = p.sq_entries;
+        sq_head = reinterpret_cast<unsigned *>(base + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(base + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned *>(base + p.sq_off.ring_mask);
+        unsigned *array = reinterpret_cast<unsigned *>(base + p.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; i++)
+            array[i] = i; // SQE按下标顺序使用，索引数组固定为恒等映射
+        sqe_tail = *sq_tail;
+        cq_head = reinterpret_cast<unsigned *>(base + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(base + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned *>(base + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe *>(base + p.cq_off.cqes);
+        return true;
+    }
+
+    bool setupBuffers()
+    {
+        void *ring = mmap(nullptr, BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void *data = mmap(nullptr, size_t(BUFFER_COUNT) * BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED || data == MAP_FAILED)
+            return false;
+        buf_ring = static_cast<struct io_uring_buf_ring *>(ring);
+        buffers = static_cast<char *>(data);
+        struct io_uring_buf_reg reg = {};
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+        reg.ring_entries = BUFFER_COUNT;
+        reg.bgid = BUFFER_GROUP;
+        if (registerOp(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+            return false;
+        for (unsigned bid = 0; bid < BUFFER_COUNT; bid++)
+            recycleBuffer(bid);
+        return true;
+    }
+
+    // 把缓冲区还给内核：写进环的尾部再发布新的tail
+    void recycleBuffer(unsigned bid)
+    {
+        // 环本身就是io_uring_buf数组（tail占第一项的resv字段）。C++下头文件里的bufs柔性数组前面多了一个空结构体，偏移不对，不能直接用
+        struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(buf_ring) + (buf_tail & (BUFFER_COUNT - 1));
+        buf->addr = reinterpret_cast<uint64_t>(buffers + size_t(bid) * BUFFER_SIZE);
+        buf->len = BUFFER_SIZE;
+        buf->bid = uint16_t(bid);
+        buf_tail++;
+        __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+    }
+
+    // 提交所有新的SQE；wait为true时等到至少一个完成事件或超时
+    void enter(bool wait, int timeout_ms)
+    {
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (!wait)
+        {
+            if (to_submit > 0)
+                syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, nullptr, 0);
+            return;
+        }
+        struct __kernel_timespec ts = {};
+        struct io_uring_getevents_arg arg = {};
+        if (timeout_ms >= 0)
+        {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = reinterpret_cast<uint64_t>(&ts);
+        }
+        long ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                           &arg, sizeof(arg));
+        if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+            LOG_ERROR("io_uring_enter failed: %s", strerror(errno));
+    }
+
+    // 环满时先把已有的提交掉
+    struct io_uring_sqe *getSqe()
+    {
+        if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        {
+            enter(false, 0);
+            if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+                return nullptr;
+        }
+        struct io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+        sqe_tail++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    static uint64_t tag(Connection *conn, Tag t)
+    {
+        return reinterpret_cast<uint64_t>(conn) | t;
+    }
+
+    void submitAccept()
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+        {
+            LOG_ERROR("io_uring: no room to submit accept");
+            return;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = tag(nullptr, TAG_ACCEPT);
+    }
+
+    // 过accept_backoff_ms毫秒再提交accept，期间新连接留在监听队列里
+    void submitAcceptRetry()
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+        {
+            LOG_ERROR("io_uring: no room to submit accept backoff");
+            return;
+        }
+        accept_retry_at.tv_sec = accept_backoff_ms / 1000;
+        accept_retry_at.tv_nsec = (accept_backoff_ms % 1000) * 1000000L;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(&accept_retry_at);
+        sqe->len = 1;
+        sqe->off = 0;
+        sqe->timeout_flags = 0;
+        sqe->user_data = tag(nullptr, TAG_ACCEPT_RETRY);
+    }
+
+    void submitWakeup()
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+        {
+            LOG_ERROR("io_uring: no room to submit wakeup poll");
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = wakeup_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = tag(nullptr, TAG_WAKEUP);
+    }
+
+    void submitRecv(Connection *conn)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+        {
+            // 下一轮再试
+            conn->io_pending++;
+            starved.push_back(conn);
+            return;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->fd;
+        sqe->len = BUFFER_SIZE;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = tag(conn, TAG_RECV);
+        conn->io_pending++;
+    }
+
+    void submitPollOut(Connection *conn)
+    {
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+        {
+            handler->onBroken(conn);
+            return;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = conn->fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = tag(conn, TAG_POLLOUT);
+        conn->io_pending++;
+    }
+
+    // 提交conn->output；全部发完之后交给onDrained决定继续收还是关闭
+    void submitOutput(Connection *conn)
+    {
+        conn->io_linked = false;
+        if (conn->output.empty())
+        {
+            drained(conn);
+            return;
+        }
+        int count = conn->output.fillIov(conn->io_iov, Connection::IO_IOV_MAX);
+        if (count == 0)
+        {
+            // 队首是要sendfile的大文件段
+            if (!conn->output.flush(conn->fd))
+                handler->onBroken(conn);
+            else if (conn->output.empty())
+                drained(conn);
+            else
+                submitPollOut(conn);
+            return;
+        }
+        struct io_uring_sqe *sqe = getSqe();
+        if (sqe == nullptr)
+        {
+            handler->onBroken(conn);
+            return;
+        }
+        conn->io_msg = {};
+        conn->io_msg.msg_iov = conn->io_iov;
+        conn->io_msg.msg_iovlen = count;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&conn->io_msg);
+        sqe->len = 1;
+        // MSG_WAITALL让内核把发送做完，发送不完整时链接的recv会被取消
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = tag(conn, TAG_SEND);
+        conn->io_pending++;
+        if (conn->output.coversAll(count) && !conn->close_after_write && !conn->stream)
+        {
+            sqe->flags |= IOSQE_IO_LINK;
+            conn->io_linked = true;
+            submitRecv(conn);
+        }
+    }
+
+    void drained(Connection *conn)
+    {
+        conn->output.reset();
+        bool linked = conn->io_linked;
+        conn->io_linked = false;
+        // onDrained返回false时连接已经被关闭，不能再访问
+        if (handler->onDrained(conn) && !linked)
+            submitRecv(conn);
+    }
+
+    void maybeRelease(Connection *conn)
+    {
+        if (conn->io_pending == 0)
+        {
+            close(conn->fd);
+            handler->onReleased(conn);
+        }
+    }
+
+    void reapCompletions()
+    {
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe cqe = cqes[head & cq_mask];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            complete(cqe);
+        }
+    }
+
+    void complete(const struct io_uring_cqe &cqe)
+    {
+        Tag t = Tag(cqe.user_data & 7);
+        Connection *conn = reinterpret_cast<Connection *>(cqe.user_data & ~uint64_t(7));
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        switch (t)
+        {
+        case TAG_ACCEPT:
+            if (cqe.res >= 0)
+            {
+                uint64_t start = Metrics::now();
+                // multishot accept的多次完成共用一个地址缓冲区，不取地址，用到时再getpeername
+                handler->onAccept(cqe.res, 0);
+                Metrics::recordStage(Metrics::ACCEPT, start);
+                accept_backoff_ms = 0;
+            }
+            else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED)
+            {
+                acceptFailed(-cqe.res);
+                if (!more)
+                    submitAcceptRetry();
+                return;
+            }
+            if (!more)
+                submitAccept();
+            return;
+        case TAG_ACCEPT_RETRY:
+            submitAccept();
+            return;
+        case TAG_WAKEUP:
+            handler->onWakeup();
+            if (!more)
+                submitWakeup();
+            return;
+        case TAG_RECV:
+            onRecv(conn, cqe);
+            return;
+        case TAG_SEND:
+            conn->io_pending--;
+            if (conn->io_closing)
+            {
+                maybeRelease(conn);
+                return;
+            }
+            if (cqe.res < 0)
+            {
+                handler->onBroken(conn);
+                return;
+            }
+            conn->output.consume(cqe.res);
+            if (conn->output.empty())
+                drained(conn);
+            else
+                submitOutput(conn);
+            return;
+        case TAG_POLLOUT:
+            conn->io_pending--;
+            if (conn->io_closing)
+                maybeRelease(conn);
+            else
+                submitOutput(conn);
+            return;
+        }
+    }
+
+    void onRecv(Connection *conn, const struct io_uring_cqe &cqe)
+    {
+        conn->io_pending--;
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+        {
+            unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0 && !conn->io_closing)
+                conn->input.append(buffers + size_t(bid) * BUFFER_SIZE, cqe.res);
+            recycleBuffer(bid);
+        }
+        if (conn->io_closing)
+        {
+            maybeRelease(conn);
+            return;
+        }
+        if (cqe.res == -ENOBUFS)
+        {
+            // 这一批完成事件把缓冲区用完了，归还之后下一轮重新提交
+            conn->io_pending++;
+            starved.push_back(conn);
+            return;
+        }
+        if (cqe.res == -ECANCELED)
+            return; // 链接在前面的发送没有完整发出，由发送的完成事件继续处理
+        conn->io_result = cqe.res > 0 ? RECV_OK : cqe.res == 0 ? RECV_EOF : RECV_ERROR;
+        handler->onReadable(conn);
+    }
+};
@@ -0,0 +1,487 @@
+#pragma once
+#include <vector>             // 存储工作线程
+#include <thread>             // 创建和管理线程
+#include <atomic>             // 无锁队列的下标和槽位
+#include <mutex>              // 只用于空闲线程休眠
+#include <condition_variable> // 只用于空闲线程休眠
+#include <latch>              // 等所有线程分配好自己的队列，runOnEachThread
+#include <memory>
+#include <algorithm>
+#include <future>             // 可选的带返回值提交
+#include <functional>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+#include "CpuTopology.h"
+using namespace std;
+
+/*
+工作窃取线程池，与ThreadPool并存。
+- 每个工作线程有一个无锁的Chase-Lev双端队列（工作线程内部提交的任务，本线程从底部LIFO取，其他线程从顶部窃取）
+  和一个无锁的有界MPMC收件箱（外部线程，例如事件循环，按轮转提交到这里）。
+- 任务在队列槽位中内联保存：可平凡复制且不超过INLINE_SIZE字节的可调用对象（如只捕获指针的lambda）
+  提交时没有任何堆分配；更大的对象退化为装箱到堆上。
+- submit不返回future，enqueue保留ThreadPool的带future接口作为可选项。
+- 互斥锁和条件变量只在线程无事可做准备休眠时才会用到。
+- 可以按CpuTopology把线程绑定到CPU上：每个线程绑定后自己分配队列，窃取时先找同一CPU、再找同一节点上的线程；
+  submitTo把任务优先交给指定的线程（例如和事件循环在同一CPU上的），连接的状态不用跨核搬运。
+*/
+class WorkStealingPool
+{
+public:
+    static const size_t INLINE_SIZE = 56;
+
+    // 定长任务：一个函数指针加内联存储，本身可平凡复制，可以逐字拷进无锁队列的槽位
+    struct Task
+    {
+        void (*invoke)(unsigned char *storage);
+        alignas(8) unsigned char storage[INLINE_SIZE];
+
+        void operator()()
+        {
+            invoke(storage);
+        }
+    };
+    static_assert(sizeof(Task) % sizeof(uint64_t) == 0, "Task must be a whole number of words");
+
+    // cpus不为空时第i个线程绑定到cpus[i % cpus.size()]
+    WorkStealingPool(size_t threads, const vector<CpuTopology::Cpu> &cpus = {})
+        : stop(false), sleepers(0), wake_epoch(0), started(ptrdiff_t(max(threads, size_t(1))) + 1)
+    {
+        if (threads == 0)
+            threads = 1;
+        queues.resize(threads);
+        buildStealOrder(threads, cpus);
+        for (size_t i = 0; i < threads; i++)
+        {
+            int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()].id;
+            workers.emplace_back([this, i, cpu]
+                                 {
+                // 先绑定再分配，队列的页由本线程第一次写入，落在这个CPU所在的节点上
+                if (cpu >= 0)
+                    CpuTopology::pinCurrentThread(cpu);
+                queues[i].reset(new WorkerQueues());
+                started.arrive_and_wait();
+                this->workerLoop(i); });
+        }
+        started.arrive_and_wait();
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            unique_lock<mutex> lock(sleep_mutex);
+            stop.store(true);
+            wake_epoch++;
+        }
+        sleep_cv.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    size_t size() const
+    {
+        return workers.size();
+    }
+
+    // 调用者所在的池，不是工作线程时为nullptr
+    static WorkStealingPool *current()
+    {
+        return currentPool();
+    }
+
+    // 提交一个不关心结果的任务
+    template <class F>
+    void submit(F &&f)
+    {
+        push(makeTask(forward<F>(f)));
+    }
+
+    // 优先放进第worker个线程的收件箱，满了再按submit的方式放；唤醒的线程不一定是它，但会先从同一CPU上的线程窃取
+    template <class F>
+    void submitTo(size_t worker, F &&f)
+    {
+        Task t = makeTask(forward<F>(f));
+        if (queues[worker % queues.size()]->inbox.push(t))
+        {
+            wakeOne();
+            return;
+        }
+        push(t);
+    }
+
+    // 在每个线程上各执行一次f，都执行完才返回（例如提前创建线程局部的数据）。
+    // 每个任务执行完f后占着自己的线程等其余的任务，所以这些任务一定分别落在不同的线程上
+    template <class F>
+    void runOnEachThread(F f)
+    {
+        auto done = make_shared<latch>(ptrdiff_t(queues.size()) + 1);
+        for (size_t i = 0; i < queues.size(); i++)
+            submitTo(i, [&f, done]
+                     { f(); done->arrive_and_wait(); });
+        done->arrive_and_wait();
+    }
+
+    // 与ThreadPool::enqueue相同的接口，需要结果时使用；packaged_task需要一次堆分配
+    template <class F, class... Args>
+    auto enqueue(F &&f, Args &&...args)
+        -> future<typename result_of<F(Args...)>::type>
+    {
+        using return_type = typename result_of<F(Args...)>::type;
+        auto task = make_shared<packaged_task<return_type()>>(
+            bind(forward<F>(f), forward<Args>(args)...));
+        future<return_type> res = task->get_future();
+        submit([task]()
+               { (*task)(); });
+        return res;
+    }
+
+private:
+    static const size_t WORDS = sizeof(Task) / sizeof(uint64_t);
+    static const size_t DEQUE_CAPACITY = 1024; // 必须是2的幂
+    static const size_t INBOX_CAPACITY = 1024; // 必须是2的幂
+
+    // 槽位由原子字组成，窃取者和所有者并发读写同一槽位时不存在数据竞争
+    struct Slot
+    {
+        atomic<uint64_t> words[WORDS];
+
+        void store(const Task &t)
+        {
+            uint64_t raw[WORDS];
+            memcpy(raw, &t, sizeof(Task));
+            for (size_t i = 0; i < WORDS; i++)
+                words[i].store(raw[i], memory_order_relaxed);
+        }
+
+        void load(Task &t) const
+        {
+            uint64_t raw[WORDS];
+            for (size_t i = 0; i < WORDS; i++)
+                raw[i] = words[i].load(memory_order_relaxed);
+            memcpy(&t, raw, sizeof(Task));
+        }
+    };
+
+    // Chase-Lev双端队列（Lê et al. 2013的C11版本），容量固定，满了由调用方改用收件箱
+    struct Deque
+    {
+        alignas(64) atomic<int64_t> top{0};
+        alignas(64) atomic<int64_t> bottom{0};
+        Slot slots[DEQUE_CAPACITY];
+
+        // 只能由所有者调用
+        bool push(const Task &t)
+        {
+            int64_t b = bottom.load(memory_order_relaxed);
+            int64_t tp = top.load(memory_order_acquire);
+            if (b - tp >= int64_t(DEQUE_CAPACITY))
+                return false;
+            slots[b & (DEQUE_CAPACITY - 1)].store(t);
+            atomic_thread_fence(memory_order_release);
+            bottom.store(b + 1, memory_order_relaxed);
+            return true;
+        }
+
+        // 只能由所有者调用
+        bool pop(Task &t)
+        {
+            int64_t b = bottom.load(memory_order_relaxed) - 1;
+            bottom.store(b, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            int64_t tp = top.load(memory_order_relaxed);
+            if (tp > b)
+            {
+                bottom.store(b + 1, memory_order_relaxed);
+                return false;
+            }
+            slots[b & (DEQUE_CAPACITY - 1)].load(t);
+            if (tp == b)
+            {
+                // 只剩最后一个任务，和窃取者竞争
+                bool won = top.compare_exchange_strong(tp, tp + 1, memory_order_seq_cst, memory_order_relaxed);
+                bottom.store(b + 1, memory_order_relaxed);
+                return won;
+            }
+            return true;
+        }
+
+        bool steal(Task &t)
+        {
+            int64_t tp = top.load(memory_order_acquire);
+            atomic_thread_fence(memory_order_seq_cst);
+            int64_t b = bottom.load(memory_order_acquire);
+            if (tp >= b)
+                return false;
+            slots[tp & (DEQUE_CAPACITY - 1)].load(t);
+            return top.compare_exchange_strong(tp, tp + 1, memory_order_seq_cst, memory_order_relaxed);
+        }
+
+        bool empty() const
+        {
+            return top.load(memory_order_acquire) >= bottom.load(memory_order_acquire);
+        }
+    };
+
+    // Vyukov有界MPMC队列：每个槽位有序号，占住槽位的线程独占它直到发布，所以任务可以直接拷贝
+    struct Inbox
+    {
+        struct Cell
+        {
+            atomic<size_t> seq;
+            Task task;
+        };
+        alignas(64) atomic<size_t> head{0};
+        alignas(64) atomic<size_t> tail{0};
+        Cell cells[INBOX_CAPACITY];
+
+        Inbox()
+        {
+            for (size_t i = 0; i < INBOX_CAPACITY; i++)
+                cells[i].seq.store(i, memory_order_relaxed);
+        }
+
+        bool push(const Task &t)
+        {
+            size_t pos = tail.load(memory_order_relaxed);
+            Cell *cell;
+            while (true)
+            {
+                cell = &cells[pos & (INBOX_CAPACITY - 1)];
+                size_t seq = cell->seq.load(memory_order_acquire);
+                intptr_t diff = intptr_t(seq) - intptr_t(pos);
+                if (diff == 0)
+                {
+                    if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                    return false; // 满了
+                else
+                    pos = tail.load(memory_order_relaxed);
+            }
+            cell->task = t;
+            cell->seq.store(pos + 1, memory_order_release);
+            return true;
+        }
+
+        bool pop(Task &t)
+        {
+            size_t pos = head.load(memory_order_relaxed);
+            Cell *cell;
+            while (true)
+            {
+                cell = &cells[pos & (INBOX_CAPACITY - 1)];
+                size_t seq = cell->seq.load(memory_order_acquire);
+                intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+                if (diff == 0)
+                {
+                    if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                    return false; // 空
+                else
+                    pos = head.load(memory_order_relaxed);
+            }
+            t = cell->task;
+            cell->seq.store(pos + INBOX_CAPACITY, memory_order_release);
+            return true;
+        }
+
+        bool empty() const
+        {
+            return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+        }
+    };
+
+    struct WorkerQueues
+    {
+        Deque deque;
+        Inbox inbox;
+    };
+
+    vector<unique_ptr<WorkerQueues>> queues;
+    vector<vector<size_t>> steal_order; // 每个线程依次尝试窃取的线程
+    vector<thread> workers;
+    atomic<bool> stop;
+    atomic<int> sleepers;
+    uint64_t wake_epoch; // 由sleep_mutex保护
+    mutex sleep_mutex;
+    condition_variable sleep_cv;
+    latch started; // 构造函数等所有线程分配好队列再返回
+
+    // 当前线程所属的池和下标，外部线程为nullptr
+    static WorkStealingPool *&currentPool()
+    {
+        static thread_local WorkStealingPool *pool = nullptr;
+        return pool;
+    }
+    static size_t &currentIndex()
+    {
+        static thread_local size_t index = 0;
+        return index;
+    }
+
+    template <class F>
+    static Task makeTask(F &&f)
+    {
+        using Fn = typename decay<F>::type;
+        Task t;
+        if constexpr (is_trivially_copyable<Fn>::value && sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= 8)
+        {
+            new (t.storage) Fn(forward<F>(f));
+            t.invoke = [](unsigned char *storage)
+            {
+                (*reinterpret_cast<Fn *>(storage))();
+            };
+        }
+        else
+        {
+            // 太大或带析构的可调用对象装箱到堆上，槽位里只放指针
+            Fn *boxed = new Fn(forward<F>(f));
+            memcpy(t.storage, &boxed, sizeof(boxed));
+            t.invoke = [](unsigned char *storage)
+            {
+                Fn *fn;
+                memcpy(&fn, storage, sizeof(fn));
+                unique_ptr<Fn> owner(fn);
+                (*fn)();
+            };
+        }
+        return t;
+    }
+
+    void push(const Task &t)
+    {
+        size_t n = queues.size();
+        // 工作线程内部提交优先放进自己的双端队列
+        if (currentPool() == this && queues[currentIndex()]->deque.push(t))
+        {
+            wakeOne();
+            return;
+        }
+        // 外部线程按轮转把任务放进各个工作线程的收件箱，全部满了就让出CPU重试
+        static thread_local size_t next = hash<thread::id>()(this_thread::get_id());
+        while (true)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                if (queues[next++ % n]->inbox.push(t))
+                {
+                    wakeOne();
+                    return;
+                }
+            }
+            this_thread::yield();
+        }
+    }
+
+    void wakeOne()
+    {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleepers.load(memory_order_relaxed) > 0)
+        {
+            {
+                unique_lock<mutex> lock(sleep_mutex);
+                wake_epoch++;
+            }
+            sleep_cv.notify_one();
+        }
+    }
+
+    bool findTask(size_t self, Task &t)
+    {
+        WorkerQueues &own = *queues[self];
+        if (own.deque.pop(t) || own.inbox.pop(t))
+            return true;
+        for (size_t i : steal_order[self])
+        {
+            WorkerQueues &victim = *queues[i];
+            if (victim.deque.steal(t) || victim.inbox.pop(t))
+                return true;
+        }
+        return false;
+    }
+
+    // 从自己后面一个开始轮一圈，起点错开以免都去抢同一个受害者；绑定了CPU时同一CPU上的排在最前，然后是同一节点的
+    void buildStealOrder(size_t n, const vector<CpuTopology::Cpu> &cpus)
+    {
+        steal_order.resize(n);
+        for (size_t self = 0; self < n; self++)
+        {
+            vector<size_t> &order = steal_order[self];
+            for (size_t i = 1; i < n; i++)
+                order.push_back((self + i) % n);
+            if (cpus.empty())
+                continue;
+            const CpuTopology::Cpu &own = cpus[self % cpus.size()];
+            auto distance = [&](size_t worker)
+            {
+                const CpuTopology::Cpu &other = cpus[worker % cpus.size()];
+                return other.id == own.id ? 0 : other.node == own.node ? 1 : 2;
+            };
+            stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                        { return distance(a) < distance(b); });
+        }
+    }
+
+    bool hasWork() const
+    {
+        for (const auto &q : queues)
+        {
+            if (!q->deque.empty() || !q->inbox.empty())
+                return true;
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self)
+    {
+        currentPool() = this;
+        currentIndex() = self;
+        Task t;
+        while (true)
+        {
+            if (findTask(self, t))
+            {
+                t();
+                continue;
+            }
+            // 先自旋几轮再休眠，避免突发流量下频繁进出内核
+            bool found = false;
+            for (int spin = 0; spin < 64 && !found; spin++)
+            {
+                this_thread::yield();
+                found = findTask(self, t);
+            }
+            if (found)
+            {
+                t();
+                continue;
+            }
+            unique_lock<mutex> lock(sleep_mutex);
+            sleepers.fetch_add(1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (hasWork())
+            {
+                sleepers.fetch_sub(1);
+                continue;
+            }
+            if (stop.load())
+            {
+                sleepers.fetch_sub(1);
+                return;
+            }
+            uint64_t epoch = wake_epoch;
+            sleep_cv.wait(lock, [this, epoch]
+                          { return wake_epoch != epoch; });
+            sleepers.fetch_sub(1);
+        }
+    }
+};
@@ -0,0 +1,135 @@
+// 分配计数测试：进程内启动服务器，用一个keep-alive连接反复请求GET /，统计loop线程和工作线程调用operator new的次数
+// （日志、数据库等后台线程和客户端自己的分配不算）。预热之后的ROUNDS轮（每轮ROUND_REQUESTS个请求）必须每一轮都没有分配；
+// 每个可用的I/O后端各测一次
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <chrono>
+#include "HttpServer.h"
+
+static atomic<size_t> allocations{0};
+
+void *operator new(size_t size)
+{
+    if (EventLoop::current() != nullptr || WorkStealingPool::current() != nullptr)
+        allocations.fetch_add(1, memory_order_relaxed);
+    if (void *p = malloc(size != 0 ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static const int WARMUP_REQUESTS = 2000;
+static const int ROUND_REQUESTS = 1000;
+static const int ROUNDS = 10;
+
+static int connectTo(int port)
+{
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    for (int attempt = 0; attempt < 200; attempt++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+            return fd;
+        close(fd);
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return -1;
+}
+
+// 发一个请求并读完响应（响应体是"Hello, World!"），客户端这边只用栈上的缓冲区
+static bool roundTrip(int fd)
+{
+    static const char request[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    static const char body[] = "Hello, World!";
+    const size_t body_len = sizeof(body) - 1;
+    if (send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) != ssize_t(sizeof(request) - 1))
+        return false;
+    char buffer[1024];
+    size_t len = 0;
+    while (len < body_len || memcmp(buffer + len - body_len, body, body_len) != 0)
+    {
+        ssize_t n = recv(fd, buffer + len, sizeof(buffer) - len, 0);
+        if (n <= 0)
+            return false;
+        len += n;
+    }
+    return true;
+}
+
+static bool runBackend(IoBackend::Kind kind, int port, database &db)
+{
+    const char *name = kind == IoBackend::IO_URING ? "io_uring" : "epoll";
+    HttpServer *server = new HttpServer(port, 10, 1, db);
+    server->setIoBackend(kind);
+    server->setupRoutes();
+    thread([server]
+           { server->start(); })
+        .detach();
+
+    int fd = connectTo(port);
+    if (fd == -1)
+    {
+        printf("%s: cannot connect to port %d\n", name, port);
+        return false;
+    }
+    for (int i = 0; i < WARMUP_REQUESTS; i++)
+    {
+        if (!roundTrip(fd))
+        {
+            printf("%s: request failed during warmup\n", name);
+            return false;
+        }
+    }
+    for (int round = 1; round <= ROUNDS; round++)
+    {
+        size_t before = allocations.load();
+        for (int i = 0; i < ROUND_REQUESTS; i++)
+        {
+            if (!roundTrip(fd))
+            {
+                printf("%s: request failed\n", name);
+                return false;
+            }
+        }
+        size_t count = allocations.load() - before;
+        printf("%s: round %d: %zu allocations in %d requests\n", name, round, count, ROUND_REQUESTS);
+        if (count != 0)
+            return false;
+    }
+    return true;
+}
+
+int main()
+{
+    logger::setLevel(WARNING);
+    database db(":memory:", 1);
+    bool ok = runBackend(IoBackend::EPOLL, 18081, db);
+    if (UringBackend::available())
+        ok = runBackend(IoBackend::IO_URING, 18082, db) && ok;
+    else
+        printf("io_uring: not supported by this kernel, skipped\n");
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    fflush(stdout);
+    // 服务器线程不会退出，跳过静态对象的析构
+    _exit(ok ? 0 : 1);
+}
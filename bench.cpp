@@ -0,0 +1,465 @@
+// 微基准：HttpRequest::parse、表单和JSON请求体解码、Router::routeRequest、HttpResponse序列化、线程池提交（绑定和不绑定CPU）、限流、database::loginUser、指标记录
+// 用法: bench [--filter 子串] [--out result.json] [--baseline old.json] [--threshold 百分比]
+// 指定--baseline时逐项与旧结果比较，任何一项变慢超过阈值（默认10%）则以1退出
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <thread>
+#include "HttpRequest.h"
+#include "HttpResponse.h"
+#include "Router.h"
+#include "ThreadPool.h"
+#include "WorkStealingPool.h"
+#include "CpuTopology.h"
+#include "RateLimiter.h"
+#include "Database.h"
+#include "Metrics.h"
+
+using namespace std;
+
+struct BenchResult
+{
+    string name;
+    size_t iterations;
+    double ns_per_op;
+};
+
+// 阻止编译器把被测代码当成死代码删掉
+template <class T>
+inline void doNotOptimize(T const &value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+static string filter;
+static vector<BenchResult> results;
+
+// 运行body(iterations)若干轮，取最快一轮的平均耗时
+template <class F>
+void bench(const string &name, size_t iterations, F body)
+{
+    if (!filter.empty() && name.find(filter) == string::npos)
+        return;
+    body(max<size_t>(iterations / 10, 1)); // 预热
+    double best = 1e300;
+    for (int round = 0; round < 5; round++)
+    {
+        auto start = chrono::steady_clock::now();
+        body(iterations);
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        best = min(best, ns / iterations);
+    }
+    results.push_back({name, iterations, best});
+    cerr << name << ": " << best << " ns/op" << endl;
+}
+
+static const string GET_REQUEST =
+    "GET /api/v1/resource150/42?verbose=1 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const string LOGIN_REQUEST =
+    "POST /login HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "Content-Length: 32\r\n"
+    "\r\n"
+    "username=yuanshen&password=test1";
+
+static void benchParse()
+{
+    bench("parse_get", 1000000, [](size_t n)
+          {
+        HttpRequest request;
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t consumed;
+            request.reset();
+            doNotOptimize(request.parse(GET_REQUEST, consumed));
+        } });
+    bench("parse_post_login", 1000000, [](size_t n)
+          {
+        HttpRequest request;
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t consumed;
+            request.reset();
+            doNotOptimize(request.parse(LOGIN_REQUEST, consumed));
+        } });
+}
+
+static void benchBody()
+{
+    // 没有转义的表单不拷贝，带转义的只解码有转义的字段
+    bench("form_plain", 1000000, [](size_t n)
+          {
+        for (size_t i = 0; i < n; i++)
+        {
+            FormData form("username=yuanshen&password=test1&remember=on");
+            doNotOptimize(form.get("password"));
+        } });
+    bench("form_escaped", 1000000, [](size_t n)
+          {
+        for (size_t i = 0; i < n; i++)
+        {
+            FormData form("username=yuan+shen&password=p%40ss%2Fword&remember=on");
+            doNotOptimize(form.get("password"));
+        } });
+    static const string LOGIN_JSON =
+        R"({"device": {"os": "android", "version": "14", "tags": ["a", "b", "c"]}, )"
+        R"("username": "yuanshen", "password": "test1", "remember": true})";
+    bench("json_fields", 1000000, [](size_t n)
+          {
+        for (size_t i = 0; i < n; i++)
+        {
+            JsonReader json(LOGIN_JSON);
+            string_view username, password;
+            json.root()["username"].getString(username);
+            json.root()["password"].getString(password);
+            doNotOptimize(password);
+        } });
+}
+
+static void benchRouter()
+{
+    // 几百条路由，接近真实服务的规模
+    Router router;
+    for (int i = 0; i < 200; i++)
+    {
+        string base = "/api/v1/resource" + to_string(i);
+        router.addRoute("GET", base, [](const HttpRequest &)
+                        { return HttpResponse(200); });
+        router.addRoute("GET", base + "/:id", [](const HttpRequest &)
+                        { return HttpResponse(200); });
+        router.addRoute("POST", base + "/:id/items", [](const HttpRequest &)
+                        { return HttpResponse(201); });
+    }
+    router.addRoute("GET", "/", [](const HttpRequest &)
+                    { return HttpResponse(200); });
+
+    auto run = [&router](const string &raw)
+    {
+        return [&router, raw](size_t n)
+        {
+            HttpRequest request;
+            size_t consumed;
+            request.parse(raw, consumed);
+            for (size_t i = 0; i < n; i++)
+            {
+                request.truncateParams(0);
+                HttpResponse response = router.routeRequest(request);
+                doNotOptimize(response);
+            }
+        };
+    };
+    bench("route_param_hit", 1000000, run(GET_REQUEST));
+    bench("route_root_hit", 1000000, run("GET / HTTP/1.1\r\n\r\n"));
+    bench("route_not_found", 1000000, run("GET /api/v2/nothing HTTP/1.1\r\n\r\n"));
+}
+
+static void benchResponse()
+{
+    HttpResponse response(200);
+    response.setHeader("Content-Type", "text/plain");
+    response.setHeader("Connection", "keep-alive");
+    response.setBody("Hello, World!");
+    bench("response_toString", 1000000, [&response](size_t n)
+          {
+        for (size_t i = 0; i < n; i++)
+        {
+            string s = response.toString();
+            doNotOptimize(s);
+        } });
+    bench("response_serializeHeaders", 1000000, [&response](size_t n)
+          {
+        string buffer;
+        for (size_t i = 0; i < n; i++)
+        {
+            buffer.clear();
+            response.serializeHeaders(buffer);
+            doNotOptimize(buffer);
+        } });
+}
+
+// 提交n个空任务并等它们全部执行完
+template <class Submit>
+static void runTasks(size_t n, Submit submit)
+{
+    atomic<size_t> done(0);
+    for (size_t i = 0; i < n; i++)
+        submit([&done]
+               { done.fetch_add(1, memory_order_relaxed); });
+    while (done.load(memory_order_relaxed) < n)
+        this_thread::yield();
+}
+
+static void benchPools()
+{
+    ThreadPool pool(4);
+    bench("threadpool_enqueue", 200000, [&pool](size_t n)
+          { runTasks(n, [&pool](auto &&f)
+                     { pool.enqueue(f); }); });
+    WorkStealingPool ws(4);
+    bench("workstealing_submit", 200000, [&ws](size_t n)
+          { runTasks(n, [&ws](auto &&f)
+                     { ws.submit(f); }); });
+}
+
+// 每批CONNECTIONS个连接：提交线程写入连接的状态（像loop收到数据），工作线程读一遍再写回结果（像处理请求），整批完成再下一批
+static const size_t CONNECTIONS = 256;
+static const size_t STATE_SIZE = 4096;
+
+template <class Submit>
+static void runConnections(size_t n, vector<char> &states, Submit submit)
+{
+    atomic<size_t> done(0);
+    for (size_t begin = 0; begin < n; begin += CONNECTIONS)
+    {
+        size_t end = min(n, begin + CONNECTIONS);
+        for (size_t i = begin; i < end; i++)
+        {
+            char *state = &states[(i - begin) * STATE_SIZE];
+            memset(state, int(i), STATE_SIZE);
+            submit(i - begin, [&done, state]
+                   {
+                uint64_t sum = 0;
+                for (size_t j = 0; j < STATE_SIZE; j += 64)
+                    sum += uint8_t(state[j]);
+                memcpy(state, &sum, sizeof(sum));
+                done.fetch_add(1, memory_order_release); });
+        }
+        while (done.load(memory_order_acquire) < end)
+            this_thread::yield();
+    }
+}
+
+// 同样数量的工作线程，任务按HttpServer::admit的方式分给每个CPU的工作线程（连接i属于第i % CPU数个CPU，在它的几个工作线程之间轮流），
+// 两次只差线程是否按CpuTopology绑定：不绑定时由调度器决定线程在哪里运行，绑定时提交线程在第一个CPU上
+static void benchPlacement()
+{
+    CpuTopology topology = CpuTopology::detect();
+    vector<CpuTopology::Cpu> cpus;
+    for (size_t i = 0; i < topology.size(); i++)
+        cpus.push_back(topology[i]);
+    size_t stride = cpus.size();
+    size_t workers = 2 * stride;
+    vector<char> states(CONNECTIONS * STATE_SIZE);
+    auto worker_of = [stride](size_t i)
+    { return i % stride + i / stride % 2 * stride; };
+    {
+        WorkStealingPool pool(workers);
+        bench("placement_unpinned", 100000, [&](size_t n)
+              { runConnections(n, states, [&pool, &worker_of](size_t i, auto &&f)
+                               { pool.submitTo(worker_of(i), f); }); });
+    }
+    cpu_set_t original;
+    sched_getaffinity(0, sizeof(original), &original);
+    CpuTopology::pinCurrentThread(cpus[0].id);
+    {
+        WorkStealingPool pool(workers, cpus);
+        bench("placement_pinned", 100000, [&](size_t n)
+              { runConnections(n, states, [&pool, &worker_of](size_t i, auto &&f)
+                               { pool.submitTo(worker_of(i), f); }); });
+    }
+    sched_setaffinity(0, sizeof(original), &original);
+}
+
+// 1024个客户端轮流取令牌，桶足够大，每次都放行：一次查找加一次CAS
+static void benchRateLimit()
+{
+    RateLimit limit;
+    limit.rate = 1e6;
+    limit.burst = 60000;
+    RateLimiter limiter(limit);
+    bench("rate_limit_acquire", 1000000, [&limiter](size_t n)
+          {
+        for (size_t i = 0; i < n; i++)
+            doNotOptimize(limiter.acquire(RateLimiter::ipKey(uint32_t(i & 1023) + 1))); });
+}
+
+// 一个采样点的开销：一次rdtsc加上本线程直方图的更新
+static void benchMetrics()
+{
+    Metrics::toNs(0);
+    bench("metrics_record_stage", 10000000, [](size_t n)
+          {
+        uint64_t t = Metrics::now();
+        for (size_t i = 0; i < n; i++)
+            t = Metrics::recordStage(Metrics::PARSE, t); });
+}
+
+static void benchDatabase()
+{
+    string path = "/tmp/bench_" + to_string(getpid()) + ".db";
+    {
+        database db(path, 1);
+        db.registerUser("yuanshen", "test1");
+        bench("db_login_hit", 100000, [&db](size_t n)
+              {
+            for (size_t i = 0; i < n; i++)
+                doNotOptimize(db.loginUser("yuanshen", "test1"));
+            });
+        bench("db_login_miss", 100000, [&db](size_t n)
+              {
+            for (size_t i = 0; i < n; i++)
+                doNotOptimize(db.loginUser("nobody", "test1"));
+            });
+        // 每次都是没见过的用户名，缓存不命中，走SQLite
+        size_t cold = 0;
+        bench("db_login_cold", 100000, [&db, &cold](size_t n)
+              {
+            for (size_t i = 0; i < n; i++)
+                doNotOptimize(db.loginUser("cold" + to_string(cold++), "test1"));
+            });
+    }
+    unlink(path.c_str());
+    unlink((path + "-wal").c_str());
+    unlink((path + "-shm").c_str());
+}
+
+// 32个线程并发注册不同的用户名，比较不同组提交窗口下每次注册的平均耗时（倒数即每秒注册数）
+static void benchRegister()
+{
+    string path = "/tmp/bench_register_" + to_string(getpid()) + ".db";
+    {
+        database db(path, 1);
+        const size_t THREADS = 32;
+        atomic<size_t> next_user(0);
+        auto run = [&db, &next_user, THREADS](size_t n)
+        {
+            vector<thread> threads;
+            for (size_t t = 0; t < THREADS; t++)
+            {
+                threads.emplace_back([&db, &next_user, n, t, THREADS]
+                                     {
+                    for (size_t i = t; i < n; i += THREADS)
+                        db.registerUser("user" + to_string(next_user.fetch_add(1)), "pw"); });
+            }
+            for (auto &thread : threads)
+                thread.join();
+        };
+        struct Setting
+        {
+            const char *name;
+            int window_us;
+            size_t max_batch;
+        };
+        const Setting settings[] = {
+            {"db_register_autocommit", 0, 1},
+            {"db_register_window_0us", 0, 256},
+            {"db_register_window_200us", 200, 256},
+            {"db_register_window_1000us", 1000, 256},
+            {"db_register_window_5000us", 5000, 256},
+        };
+        for (const Setting &setting : settings)
+        {
+            db.setWriteBatching(chrono::microseconds(setting.window_us), setting.max_batch);
+            bench(setting.name, 4000, run);
+        }
+    }
+    unlink(path.c_str());
+    unlink((path + "-wal").c_str());
+    unlink((path + "-shm").c_str());
+}
+
+static string toJson(const vector<BenchResult> &list)
+{
+    ostringstream out;
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        out << "    {\"name\": \"" << list[i].name << "\", \"iterations\": " << list[i].iterations
+            << ", \"ns_per_op\": " << list[i].ns_per_op << "}" << (i + 1 < list.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return out.str();
+}
+
+// 读取toJson写出的文件：每行一个基准
+static map<string, double> loadBaseline(const string &path)
+{
+    map<string, double> baseline;
+    ifstream in(path);
+    string line;
+    while (getline(in, line))
+    {
+        size_t name = line.find("\"name\": \"");
+        size_t ns = line.find("\"ns_per_op\": ");
+        if (name == string::npos || ns == string::npos)
+            continue;
+        name += 9;
+        baseline[line.substr(name, line.find('"', name) - name)] = stod(line.substr(ns + 13));
+    }
+    return baseline;
+}
+
+int main(int argc, char **argv)
+{
+    string out_path, baseline_path;
+    double threshold = 10;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string arg = argv[i];
+        if (arg == "--filter")
+            filter = argv[i + 1];
+        else if (arg == "--out")
+            out_path = argv[i + 1];
+        else if (arg == "--baseline")
+            baseline_path = argv[i + 1];
+        else if (arg == "--threshold")
+            threshold = stod(argv[i + 1]);
+    }
+    // 数据库基准不需要日志
+    logger::setLevel(ERROR);
+
+    benchParse();
+    benchBody();
+    benchRouter();
+    benchResponse();
+    benchPools();
+    benchPlacement();
+    benchRateLimit();
+    benchMetrics();
+    benchDatabase();
+    benchRegister();
+
+    string json = toJson(results);
+    if (out_path.empty())
+        cout << json;
+    else
+        ofstream(out_path) << json;
+
+    if (baseline_path.empty())
+        return 0;
+    map<string, double> baseline = loadBaseline(baseline_path);
+    bool regressed = false;
+    for (const auto &r : results)
+    {
+        auto it = baseline.find(r.name);
+        if (it == baseline.end())
+            continue;
+        double change = (r.ns_per_op - it->second) / it->second * 100;
+        cerr << r.name << ": " << it->second << " -> " << r.ns_per_op << " ns/op (" << (change >= 0 ? "+" : "") << change << "%)";
+        if (change > threshold)
+        {
+            cerr << "  REGRESSION";
+            regressed = true;
+        }
+        cerr << endl;
+    }
+    return regressed ? 1 : 0;
+}
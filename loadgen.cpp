@@ -0,0 +1,355 @@
+// 基于epoll的HTTP压测工具，对本机服务器的GET /、POST /login、POST /register施压，输出RPS和p50/p99/p999延迟(JSON)
+// 用法: loadgen [--host 127.0.0.1] [--port 8080] [--connections 64] [--threads 1] [--duration 5]
+//               [--rate 0] [--scenario all|root|login|register] [--out result.json]
+// --rate为0时是闭环模式：每个连接收到响应后立刻发下一个请求；
+// 大于0时是开环模式：按固定速率(请求/秒)调度，延迟从计划发送时刻算起，不会因服务器变慢而少算排队时间
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+
+using namespace std;
+
+struct Options
+{
+    string host = "127.0.0.1";
+    int port = 8080;
+    int connections = 64;
+    int threads = 1;
+    double duration = 5;
+    double rate = 0;
+    string scenario = "all";
+    string out;
+};
+
+struct ScenarioResult
+{
+    string name;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    double seconds = 0;
+    vector<uint64_t> latencies; // 纳秒
+};
+
+static int64_t nowNs()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 生成第seq个请求的字节
+class RequestFactory
+{
+public:
+    RequestFactory(const string &scenario, const string &host, int thread_id)
+        : scenario(scenario), host(host), prefix("bench_" + to_string(getpid()) + "_" + to_string(thread_id) + "_") {}
+
+    string next()
+    {
+        if (scenario == "root")
+            return "GET / HTTP/1.1\r\nHost: " + host + "\r\n\r\n";
+        string body;
+        if (scenario == "login")
+            body = "username=loadgen_user&password=loadgen_pw";
+        else
+            body = "username=" + prefix + to_string(seq++) + "&password=pw";
+        return "POST /" + scenario + " HTTP/1.1\r\nHost: " + host +
+               "\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: " +
+               to_string(body.size()) + "\r\n\r\n" + body;
+    }
+
+private:
+    string scenario, host, prefix;
+    uint64_t seq = 0;
+};
+
+struct ClientConn
+{
+    int fd = -1;
+    string out;
+    size_t out_off = 0;
+    string in;
+    deque<int64_t> pending; // 每个在途请求的起始时刻
+};
+
+static int connectTo(const Options &opt)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    inet_pton(AF_INET, opt.host.c_str(), &addr.sin_addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// 从缓冲区取出一个完整响应，返回状态码；不完整返回0
+static int takeResponse(string &in)
+{
+    size_t header_end = in.find("\r\n\r\n");
+    if (header_end == string::npos)
+        return 0;
+    size_t content_length = 0;
+    string headers = in.substr(0, header_end);
+    transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+    size_t cl = headers.find("\r\ncontent-length:");
+    if (cl != string::npos)
+        content_length = strtoul(headers.c_str() + cl + 17, nullptr, 10);
+    size_t total = header_end + 4 + content_length;
+    if (in.size() < total)
+        return 0;
+    int status = in.size() > 12 ? atoi(in.c_str() + 9) : -1;
+    in.erase(0, total);
+    return status;
+}
+
+static void flushOut(ClientConn &c)
+{
+    while (c.out_off < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        c.out_off += n;
+    }
+    if (c.out_off == c.out.size())
+    {
+        c.out.clear();
+        c.out_off = 0;
+    }
+}
+
+static void runThread(const Options &opt, const string &scenario, int thread_id, int connections, ScenarioResult &result)
+{
+    RequestFactory factory(scenario, opt.host, thread_id);
+    int epfd = epoll_create1(0);
+    vector<ClientConn> conns(connections);
+    auto open_conn = [&](size_t i)
+    {
+        conns[i] = ClientConn();
+        conns[i].fd = connectTo(opt);
+        if (conns[i].fd == -1)
+            return false;
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+        return true;
+    };
+    auto send_request = [&](ClientConn &c, int64_t start)
+    {
+        c.out += factory.next();
+        c.pending.push_back(start);
+        flushOut(c);
+    };
+
+    bool open_loop = opt.rate > 0;
+    int64_t interval = open_loop ? int64_t(1e9 / (opt.rate / opt.threads)) : 0;
+    int64_t start = nowNs();
+    int64_t end = start + int64_t(opt.duration * 1e9);
+    int64_t next_due = start;
+    size_t rr = 0;
+
+    for (int i = 0; i < connections; i++)
+    {
+        if (!open_conn(i))
+        {
+            cerr << "connect failed: " << strerror(errno) << endl;
+            result.errors++;
+            continue;
+        }
+        if (!open_loop)
+            send_request(conns[i], nowNs());
+    }
+
+    vector<struct epoll_event> events(connections + 1);
+    char buffer[65536];
+    while (true)
+    {
+        int64_t now = nowNs();
+        if (now >= end)
+            break;
+        if (open_loop)
+        {
+            // 按计划时刻发出所有到期的请求，轮流分配给各连接（必要时在同一连接上流水线）
+            while (next_due <= now)
+            {
+                ClientConn &c = conns[rr++ % connections];
+                if (c.fd != -1)
+                    send_request(c, next_due);
+                next_due += interval;
+            }
+        }
+        int timeout = open_loop ? int(max<int64_t>(0, (next_due - now) / 1000000)) : 100;
+        int n = epoll_wait(epfd, events.data(), events.size(), timeout);
+        for (int e = 0; e < n; e++)
+        {
+            size_t i = events[e].data.u64;
+            ClientConn &c = conns[i];
+            ssize_t bytes;
+            bool closed = false;
+            while ((bytes = read(c.fd, buffer, sizeof(buffer))) > 0)
+                c.in.append(buffer, bytes);
+            if (bytes == 0 || (bytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+                closed = true;
+            int status;
+            while (!c.pending.empty() && (status = takeResponse(c.in)) != 0)
+            {
+                int64_t t = nowNs();
+                result.latencies.push_back(t - c.pending.front());
+                c.pending.pop_front();
+                result.requests++;
+                if (status != 200)
+                    result.errors++;
+                if (!open_loop && t < end)
+                    send_request(c, t);
+            }
+            flushOut(c);
+            if (closed)
+            {
+                // 服务器关闭了连接：在途请求记为错误并重连
+                result.errors += c.pending.size();
+                close(c.fd);
+                if (open_conn(i) && !open_loop)
+                    send_request(conns[i], nowNs());
+            }
+        }
+    }
+    result.seconds = (nowNs() - start) / 1e9;
+    for (auto &c : conns)
+    {
+        if (c.fd != -1)
+            close(c.fd);
+    }
+    close(epfd);
+}
+
+// 发一个阻塞请求，用于压测login前准备账号
+static void prepareLogin(const Options &opt)
+{
+    int fd = connectTo(opt);
+    if (fd == -1)
+        return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    string body = "username=loadgen_user&password=loadgen_pw";
+    string req = "POST /register HTTP/1.1\r\nHost: " + opt.host + "\r\nConnection: close\r\nContent-Length: " +
+                 to_string(body.size()) + "\r\n\r\n" + body;
+    send(fd, req.data(), req.size(), MSG_NOSIGNAL);
+    char buffer[1024];
+    while (read(fd, buffer, sizeof(buffer)) > 0)
+    {
+    }
+    close(fd);
+}
+
+static double percentile(const vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = min(sorted.size() - 1, size_t(p * sorted.size()));
+    return sorted[idx] / 1000.0;
+}
+
+static ScenarioResult runScenario(const Options &opt, const string &scenario)
+{
+    if (scenario == "login")
+        prepareLogin(opt);
+    vector<ScenarioResult> parts(opt.threads);
+    vector<thread> threads;
+    for (int t = 0; t < opt.threads; t++)
+    {
+        int conns = opt.connections / opt.threads + (t < opt.connections % opt.threads ? 1 : 0);
+        threads.emplace_back([&, t, conns]
+                             { runThread(opt, scenario, t, max(conns, 1), parts[t]); });
+    }
+    for (auto &t : threads)
+        t.join();
+    ScenarioResult total;
+    total.name = scenario;
+    for (auto &p : parts)
+    {
+        total.requests += p.requests;
+        total.errors += p.errors;
+        total.seconds = max(total.seconds, p.seconds);
+        total.latencies.insert(total.latencies.end(), p.latencies.begin(), p.latencies.end());
+    }
+    sort(total.latencies.begin(), total.latencies.end());
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string arg = argv[i], value = argv[i + 1];
+        if (arg == "--host")
+            opt.host = value;
+        else if (arg == "--port")
+            opt.port = stoi(value);
+        else if (arg == "--connections")
+            opt.connections = stoi(value);
+        else if (arg == "--threads")
+            opt.threads = stoi(value);
+        else if (arg == "--duration")
+            opt.duration = stod(value);
+        else if (arg == "--rate")
+            opt.rate = stod(value);
+        else if (arg == "--scenario")
+            opt.scenario = value;
+        else if (arg == "--out")
+            opt.out = value;
+    }
+    opt.threads = max(1, min(opt.threads, opt.connections));
+
+    vector<string> scenarios;
+    if (opt.scenario == "all")
+        scenarios = {"root", "login", "register"};
+    else
+        scenarios = {opt.scenario};
+
+    ostringstream json;
+    json << "{\n  \"mode\": \"" << (opt.rate > 0 ? "open" : "closed") << "\", \"connections\": " << opt.connections
+         << ", \"threads\": " << opt.threads << ", \"duration_s\": " << opt.duration << ", \"rate\": " << opt.rate
+         << ",\n  \"scenarios\": [\n";
+    for (size_t s = 0; s < scenarios.size(); s++)
+    {
+        ScenarioResult r = runScenario(opt, scenarios[s]);
+        double rps = r.seconds > 0 ? r.requests / r.seconds : 0;
+        cerr << r.name << ": " << uint64_t(rps) << " req/s, p50 " << percentile(r.latencies, 0.5) << " us, p99 "
+             << percentile(r.latencies, 0.99) << " us, p999 " << percentile(r.latencies, 0.999) << " us, errors "
+             << r.errors << endl;
+        json << "    {\"name\": \"" << r.name << "\", \"requests\": " << r.requests << ", \"errors\": " << r.errors
+             << ", \"rps\": " << rps << ", \"p50_us\": " << percentile(r.latencies, 0.5)
+             << ", \"p99_us\": " << percentile(r.latencies, 0.99) << ", \"p999_us\": " << percentile(r.latencies, 0.999)
+             << ", \"max_us\": " << (r.latencies.empty() ? 0 : r.latencies.back() / 1000.0) << "}"
+             << (s + 1 < scenarios.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+    if (opt.out.empty())
+        cout << json.str();
+    else
+        ofstream(opt.out) << json.str();
+    return 0;
+}
@@ -1,12 +1,51 @@
-
+#include <cstdlib>
+#include <cstring>
 #include "Database.h"
 #include "HttpServer.h"
 
 int main()
 {
     database db("user.db"); // create database
-    HttpServer server(8080, 10, db);
+    // 每个可用的CPU一个loop（亲和性掩码和cgroup配额限制之后的，不是机器的全部核数）
+    HttpServer server(8080, 10, int(CpuTopology::detect().size()), db);
+    // SERVER_IO_BACKEND=epoll|io_uring 指定I/O后端，默认自动选择
+    if (const char *backend = getenv("SERVER_IO_BACKEND"))
+    {
+        if (strcmp(backend, "epoll") == 0)
+            server.setIoBackend(IoBackend::EPOLL);
+        else if (strcmp(backend, "io_uring") == 0)
+            server.setIoBackend(IoBackend::IO_URING);
+    }
+    // SERVER_TRACE_SAMPLE=N 每N个请求追踪一个；SERVER_TRACE_SLOW_MS=M 抽样请求超过M毫秒写进slow.jsonl
+    if (const char *sample = getenv("SERVER_TRACE_SAMPLE"))
+    {
+        Trace::Options tracing;
+        tracing.sample_every = uint32_t(strtoul(sample, nullptr, 10));
+        if (const char *slow = getenv("SERVER_TRACE_SLOW_MS"))
+            tracing.slow_ms = strtoull(slow, nullptr, 10);
+        server.setTracing(tracing);
+    }
+    // SERVER_CPU_PIN=1 按CPU拓扑绑定loop和工作线程，SERVER_WORKERS_PER_CPU=N 每个CPU的工作线程数（默认2）
+    if (const char *pin = getenv("SERVER_CPU_PIN"))
+    {
+        CpuPlacement placement;
+        placement.pin = strcmp(pin, "1") == 0;
+        if (const char *per_cpu = getenv("SERVER_WORKERS_PER_CPU"))
+            placement.workers_per_cpu = atoi(per_cpu);
+        server.setCpuPlacement(placement);
+    }
+    // SERVER_AUTH_RATE_LIMIT=每秒令牌数/桶容量（例如5/20）：/login和/register按客户端IP和用户名限流，超过时回429
+    if (const char *auth_limit = getenv("SERVER_AUTH_RATE_LIMIT"))
+    {
+        RateLimit limit;
+        char *end;
+        limit.rate = strtod(auth_limit, &end);
+        limit.burst = *end == '/' ? strtod(end + 1, nullptr) : limit.rate;
+        limit.by_username = true;
+        server.getRouter().setRateLimit("POST", "/login", limit);
+        server.getRouter().setRateLimit("POST", "/register", limit);
+    }
     server.setupRoutes();
     server.start();
     return 0;
-}
\ No newline at end of file
+}
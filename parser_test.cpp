@@ -0,0 +1,82 @@
+// 请求解析测试：畸形的请求头必须被拒绝（服务器回400），代理和这里对请求边界理解不一致就是请求走私。
+// 每个用例是一个完整的原始请求和期望的解析结果
+#include <cstdio>
+#include <string>
+#include "HttpRequest.h"
+
+struct Case
+{
+    const char *name;
+    string raw;
+    HttpRequest::ParseResult expected;
+    size_t body_size; // 期望COMPLETE时请求体的长度
+};
+
+static const char *resultName(HttpRequest::ParseResult result)
+{
+    switch (result)
+    {
+    case HttpRequest::NEED_MORE:
+        return "NEED_MORE";
+    case HttpRequest::COMPLETE:
+        return "COMPLETE";
+    case HttpRequest::HEADERS_COMPLETE:
+        return "HEADERS_COMPLETE";
+    default:
+        return "INVALID";
+    }
+}
+
+// 不区分大小写的比较只折叠字母：|0x20会让'\r'等于'-'、'^'等于'~'
+static bool checkFold(string_view a, string_view b, bool expected)
+{
+    bool equal = HttpHeader::equalsIgnoreCase(a, b);
+    if (equal != expected)
+        printf("equalsIgnoreCase(%zu bytes): %s  WRONG\n", a.size(), equal ? "equal" : "different");
+    return equal == expected;
+}
+
+static bool runCase(const Case &c)
+{
+    HttpRequest request;
+    size_t consumed = 0;
+    HttpRequest::ParseResult result = request.parse(c.raw, consumed);
+    bool ok = result == c.expected && (result != HttpRequest::COMPLETE || request.getBody().size() == c.body_size);
+    printf("%s: %s%s\n", c.name, resultName(result), ok ? "" : "  WRONG");
+    return ok;
+}
+
+int main()
+{
+    const Case cases[] = {
+        {"plain GET", "GET / HTTP/1.1\r\nHost: a\r\n\r\n", HttpRequest::COMPLETE, 0},
+        {"body", "POST / HTTP/1.1\r\nHost: a\r\nContent-Length: 5\r\n\r\nhello", HttpRequest::COMPLETE, 5},
+        {"space before colon", "GET / HTTP/1.1\r\nHost : a\r\n\r\n", HttpRequest::INVALID, 0},
+        {"space in name", "GET / HTTP/1.1\r\nX Y: z\r\n\r\n", HttpRequest::INVALID, 0},
+        {"space before Content-Length colon", "POST / HTTP/1.1\r\nContent-Length : 5\r\n\r\nhello", HttpRequest::INVALID, 0},
+        {"CR inside Transfer-Encoding name", "POST / HTTP/1.1\r\nTransfer\rEncoding: chunked\r\n\r\n0\r\n\r\n", HttpRequest::INVALID, 0},
+        {"CR inside Content-Length name", "POST / HTTP/1.1\r\nContent\rLength: 5\r\n\r\nhello", HttpRequest::INVALID, 0},
+        {"upper-case Content-Length", "POST / HTTP/1.1\r\nCONTENT-LENGTH: 5\r\n\r\nhello", HttpRequest::COMPLETE, 5},
+        {"separator in name", "GET / HTTP/1.1\r\nX(Y): z\r\n\r\n", HttpRequest::INVALID, 0},
+        {"obs-fold", "GET / HTTP/1.1\r\nHost: a\r\n b\r\n\r\n", HttpRequest::INVALID, 0},
+        {"bare CR in value", "GET / HTTP/1.1\r\nX: a\rb\r\n\r\n", HttpRequest::INVALID, 0},
+        {"bare CR in request line", "GET /\r HTTP/1.1\r\nHost: a\r\n\r\n", HttpRequest::INVALID, 0},
+        {"bare CR after colon in request line", "GET /a:b\rc HTTP/1.1\r\nHost: a\r\n\r\n", HttpRequest::INVALID, 0},
+        {"CR at end of value", "GET / HTTP/1.1\r\nX: a\r\r\n\r\n", HttpRequest::INVALID, 0},
+        {"differing Content-Length", "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 0\r\n\r\nhello", HttpRequest::INVALID, 0},
+        {"repeated Content-Length", "POST / HTTP/1.1\r\nContent-Length: 5\r\nContent-Length: 5\r\n\r\nhello", HttpRequest::COMPLETE, 5},
+    };
+    bool ok = true;
+    for (const Case &c : cases)
+        ok = runCase(c) && ok;
+    ok = checkFold("content-length", "CONTENT-LENGTH", true) && ok;
+    ok = checkFold("content-length", "Content\rLength", false) && ok;
+    ok = checkFold("transfer-encoding", "Transfer\rEncoding", false) && ok;
+    ok = checkFold("x-a^b", "X-A~B", false) && ok;
+    ok = checkFold("x-request^id-long", "X-Request~Id-Long", false) && ok;
+    ok = checkFold("Accept-Language", "accept-language", true) && ok;
+    ok = HttpHeader::lookup("Content\rLength") == HttpHeader::OTHER && ok;
+    ok = HttpHeader::lookup("transfer-ENCODING") == HttpHeader::TRANSFER_ENCODING && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
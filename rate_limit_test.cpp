@@ -0,0 +1,55 @@
+// 限流测试：一个客户端按固定间隔不停地发请求（模拟的时间，不用真的等），发送的速率高于限速时，
+// 长期放行的请求数应该是burst + rate * 时长。每个用例允许差一个请求；1/rate不是整毫秒时burst至少要是2，否则到达时间按毫秒取整本身就会少放行
+#include <cstdio>
+#include <cmath>
+#include "RateLimiter.h"
+
+struct Case
+{
+    double rate;
+    double burst;
+    int64_t every_ms; // 请求间隔
+};
+
+static const int64_t DURATION_MS = 600000;
+
+static bool runCase(const Case &c)
+{
+    RateLimit limit;
+    limit.rate = c.rate;
+    limit.burst = c.burst;
+    RateLimiter limiter(limit);
+    uint64_t key = RateLimiter::ipKey(1);
+    int64_t start = TimerWheel::nowMs();
+    long admitted = 0, sent = 0;
+    for (int64_t t = 0; t < DURATION_MS; t += c.every_ms)
+    {
+        sent++;
+        if (limiter.acquire(key, start + t) == 0)
+            admitted++;
+    }
+    double expected = min(double(sent), c.burst + c.rate * double(DURATION_MS) / 1000);
+    bool ok = fabs(double(admitted) - expected) <= 1;
+    printf("rate %g burst %g every %lld ms: %ld of %ld admitted, expected %.0f %s\n", c.rate, c.burst,
+           (long long)c.every_ms, admitted, sent, expected, ok ? "ok" : "WRONG");
+    return ok;
+}
+
+int main()
+{
+    // 按毫秒补充并截断时，前三个用例几乎拿不到补充
+    const Case cases[] = {
+        {1, 1, 1},
+        {1, 10, 3},
+        {10, 10, 1},
+        {7.3, 5, 2},
+        {100, 20, 1},
+        {333, 2, 1},
+        {5, 10, 250}, // 发送比限速慢，全部放行
+    };
+    bool ok = true;
+    for (const Case &c : cases)
+        ok = runCase(c) && ok;
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -4,85 +4,80 @@
 #include <future>
 #include <functional>
 #include <chrono>
-#include <queue>
-class ThreadPool {
-public:
-    ThreadPool(size_t numThreads) : stop(false) {
-        for (size_t i = 0; i < numThreads; ++i) {
-            workers.emplace_back([this] {
-                while (true) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(queue_mutex);
-                        condition.wait(lock, [this] {
-                            return stop || !tasks.empty();
-                        });
-                        if (stop && tasks.empty()) {
-                            return;
-                        }
-                        task = std::move(tasks.front());
-                        tasks.pop();
-                    }
-                    task();
-                }
-            });
-        }
-    }
-
-    ~ThreadPool() {
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            stop = true;
-        }
-        condition.notify_all();
-        for (std::thread& worker : workers) {
-            worker.join();
-        }
-    }
-
-    template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args)
-        -> std::future<typename std::result_of<F(Args...)>::type> {
-        using return_type = typename std::result_of<F(Args...)>::type;
-        auto task = std::make_shared<std::packaged_task<return_type()>>(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-        );
-        std::future<return_type> res = task->get_future();
-        {
-            std::unique_lock<std::mutex> lock(queue_mutex);
-            if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
-            tasks.emplace([task](){ (*task)(); });
-        }
-        condition.notify_one();
-        return res;
-    }
-
-private:
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
-    std::mutex queue_mutex;
-    std::condition_variable condition;
-    bool stop;
-};
+#include <atomic>
+#include "ThreadPool.h"
+#include "WorkStealingPool.h"
 
 // 示例任务函数
 int square(int num) {
-    std::this_thread::sleep_for(std::chrono::seconds(1));
     return num * num;
 }
 
+// 从submitters个线程一共提交tasks个空任务，返回从开始提交到全部执行完的平均纳秒数
+template<class Submit>
+double runBenchmark(size_t submitters, size_t tasks, Submit submit) {
+    std::atomic<size_t> done(0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t s = 0; s < submitters; ++s) {
+        threads.emplace_back([&, s] {
+            for (size_t i = s; i < tasks; i += submitters) {
+                submit([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    while (done.load(std::memory_order_relaxed) < tasks) {
+        std::this_thread::yield();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / tasks;
+}
+
 int main() {
-    ThreadPool pool(4);  // 创建线程池，使用4个线程
+    const size_t workers = 4;
+    const size_t tasks = 1000000;
 
-    std::vector<std::future<int>> results;
-    for (int i = 1; i <= 10; ++i) {
-        results.emplace_back(pool.enqueue(square, i));  // 将任务添加到线程池中执行
+    // 两种线程池的future接口结果应一致
+    {
+        ThreadPool pool(workers);
+        WorkStealingPool ws(workers);
+        std::vector<std::future<int>> a, b;
+        for (int i = 1; i <= 10; ++i) {
+            a.emplace_back(pool.enqueue(square, i));
+            b.emplace_back(ws.enqueue(square, i));
+        }
+        for (size_t i = 0; i < a.size(); ++i) {
+            int x = a[i].get(), y = b[i].get();
+            if (x != y) {
+                std::cout << "Mismatch: " << x << " != " << y << std::endl;
+                return 1;
+            }
+        }
+        std::cout << "Result check passed" << std::endl;
     }
-    
-    // 获取任务结果并输出
-    for (auto& result : results) {
-        std::cout << "Result: " << result.get() << std::endl;
+
+    for (size_t submitters : {1, 4}) {
+        double pool_ns, ws_future_ns, ws_submit_ns;
+        {
+            ThreadPool pool(workers);
+            pool_ns = runBenchmark(submitters, tasks, [&](auto&& f) { pool.enqueue(f); });
+        }
+        {
+            WorkStealingPool ws(workers);
+            ws_future_ns = runBenchmark(submitters, tasks, [&](auto&& f) { ws.enqueue(f); });
+        }
+        {
+            WorkStealingPool ws(workers);
+            ws_submit_ns = runBenchmark(submitters, tasks, [&](auto&& f) { ws.submit(f); });
+        }
+        std::cout << submitters << " submitter(s), " << workers << " workers, " << tasks << " tasks" << std::endl;
+        std::cout << "  ThreadPool::enqueue        " << pool_ns << " ns/task" << std::endl;
+        std::cout << "  WorkStealingPool::enqueue  " << ws_future_ns << " ns/task" << std::endl;
+        std::cout << "  WorkStealingPool::submit   " << ws_submit_ns << " ns/task" << std::endl;
     }
 
     return 0;
-}
\ No newline at end of file
+}